@@ -0,0 +1,779 @@
+/* Code shared by the tools interpreting G-CODE like GRBL does: number parsing
+ * and formatting, the interpreter's state, gcode-fixup's power curve, arc
+ * geometry, and for the tools replaying their input, the temporary file of
+ * records and the parser filling it. Functions are static inline so that each tool only builds those it uses
+ * and still compiles from its own single file.
+ */
+#ifndef _GCODE_COMMON_H
+#define _GCODE_COMMON_H
+
+#include <ctype.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* GRBL's default arc tolerance ($12) and arc constants from its config.h */
+#define ARC_TOLERANCE            0.002   // mm
+#define ARC_ANGULAR_TRAVEL_EPSILON 5E-7
+
+/* largest power curve we accept, in spindle values */
+#define MAX_CURVE_SIZE           (1 << 20)
+
+/* I/O buffer sizes. The input one grows if a line does not fit. */
+#define INPUT_BUFFER_SIZE        (1 << 20)
+#define TEMP_BUFFER_SIZE         (1 << 20)
+
+/* kinds of records in the temporary file */
+enum {
+	REC_MOVE = 0,             // G0-G3 move
+	REC_TEXT,                 // line copied as is
+	REC_DWELL,                // G4 line, copied where the head is
+};
+
+/* a record of the temporary file. Positions are absolute machine coordinates
+ * in mm, and the modal values are the ones the move runs with. Text records
+ * are followed by <len> bytes of text, and only arcs store their center.
+ */
+struct rec {
+	uint8_t kind;             // REC_*
+	uint8_t g;                // REC_MOVE: 0..3
+	uint8_t spindle;          // REC_MOVE: 3, 4 or 5
+	uint8_t homing;           // REC_TEXT: the line moves the head (G28/G30)
+	uint32_t len;             // REC_TEXT/REC_DWELL: bytes of text
+	double x, y, z;           // end of the move
+	double s, f;
+	double cx, cy;            // center of G2/G3 arcs
+};
+
+#define REC_BASE                 offsetof(struct rec, cx)
+
+/* the temporary file of records. <move> is called for each move record
+ * written, with the machine position it starts from, so that tools may
+ * measure the job while it is parsed. It is meant to be the first member of
+ * the tool's own state.
+ */
+struct recfile {
+	FILE *tmp;
+	char *text;               // text of the last record read
+	size_t text_size;
+	unsigned long moves, texts;  // records written
+	void (*move)(struct recfile *rf, const struct rec *r, const double a[3]);
+};
+
+/* G-CODE interpreter state */
+struct gcode {
+	double pos[3];            // work position, mm
+	double g92[3];            // G92 offset, mm
+	double feed;              // mm/min, 0 if not set yet
+	double s;
+	int motion;               // 0..3
+	int absolute;             // G90
+	int inches;               // G20
+	int plane;                // 17..19
+	int spindle;              // 3, 4 or 5
+	unsigned long line;       // current line number
+	unsigned long rejected;   // moves GRBL would reject
+	unsigned long dropped;    // lines whose words were not all kept
+};
+
+/* power curve mapping input spindle values to output ones. It is sampled at
+ * each integral input value from 0 to <max>, and holds the values before
+ * truncation so that fractional inputs may be interpolated. A computed curve
+ * is the exact gamma/power/offset formula, in which case fractional and out of
+ * range values are computed as well to remain compatible with the awk script.
+ * A loaded curve is interpolated and clamped to its ends instead.
+ */
+struct curve {
+	double *val;              // <max>+1 entries
+	int max;                  // highest input value
+	int loaded;               // 0 if computed, 1 if loaded from a file
+	double gamma, power, offset, norm;
+};
+
+/* powers of ten exactly representable as doubles */
+static const double pow10_tab[] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* display the message and exit with the code */
+__attribute__((noreturn)) static inline void die(int code, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	exit(code);
+}
+
+/* resets interpreter <gc> to GRBL's power-up state */
+static inline void gcode_init(struct gcode *gc)
+{
+	memset(gc, 0, sizeof(*gc));
+	gc->absolute = 1;
+	gc->plane = 17;
+	gc->spindle = 5;
+}
+
+/* parses the number at *<str>, not beyond <end>, and advances *<str> past it.
+ * Like GRBL, it does not support exponents. Missing numbers return zero.
+ */
+static inline double parse_num(const char **str, const char *end)
+{
+	const char *p = *str;
+	uint64_t mant = 0;
+	int digits = 0, frac = 0, neg = 0;
+	double v;
+
+	if (p < end && (*p == '+' || *p == '-'))
+		neg = *p++ == '-';
+
+	while (p < end && isdigit((unsigned char)*p)) {
+		if (digits < 19)
+			mant = mant * 10 + *p - '0';
+		else
+			frac--;
+		digits++;
+		p++;
+	}
+
+	if (p < end && *p == '.') {
+		p++;
+		while (p < end && isdigit((unsigned char)*p)) {
+			if (digits < 19) {
+				mant = mant * 10 + *p - '0';
+				frac++;
+			}
+			digits++;
+			p++;
+		}
+	}
+
+	*str = p;
+	if (frac >= 0 && frac <= 22)
+		v = (double)mant / pow10_tab[frac];
+	else
+		v = (double)mant * pow(10, -frac);
+	return neg ? -v : v;
+}
+
+/* appends <n> units with <prec> decimals at <o> in the shortest form, without
+ * leading nor trailing zeros (e.g. "-.5"). Returns the new end.
+ */
+static inline char *fmt_units(char *o, long long n, int prec)
+{
+	unsigned long long u = n < 0 ? -(unsigned long long)n : (unsigned long long)n;
+	unsigned long long div = 1, ip, fp;
+	char tmp[24];
+	int i;
+
+	for (i = 0; i < prec; i++)
+		div *= 10;
+	ip = u / div;
+	fp = u % div;
+
+	if (n < 0)
+		*o++ = '-';
+	if (ip || !fp) {
+		i = 0;
+		do {
+			tmp[i++] = '0' + ip % 10;
+			ip /= 10;
+		} while (ip);
+		while (i)
+			*o++ = tmp[--i];
+	}
+	if (fp) {
+		while (fp % 10 == 0) {
+			fp /= 10;
+			prec--;
+		}
+		*o++ = '.';
+		for (i = prec - 1; i >= 0; i--) {
+			o[i] = '0' + fp % 10;
+			fp /= 10;
+		}
+		o += prec;
+	}
+	return o;
+}
+
+/* computes the output spindle value for input <v> using the curve's formula,
+ * before truncation.
+ */
+static inline double curve_formula(const struct curve *c, double v)
+{
+	return ((exp(log(1 + v) / c->gamma) / c->norm * (c->max + 1) - 1) * c->power) + c->offset;
+}
+
+/* builds curve <c> for inputs 0 to <max> from the <gamma>, <power> and
+ * <offset> settings. Returns non-zero on success, 0 on allocation error.
+ */
+static inline int build_curve(struct curve *c, int max, double gamma, double power, double offset)
+{
+	int i;
+
+	c->val = malloc((max + 1) * sizeof(*c->val));
+	if (!c->val)
+		return 0;
+
+	c->max = max;
+	c->loaded = 0;
+	c->gamma = gamma;
+	c->power = power;
+	c->offset = offset;
+	c->norm = exp(log(1 + max) / gamma);
+	for (i = 0; i <= max; i++)
+		c->val[i] = curve_formula(c, i);
+	return 1;
+}
+
+/* maps input spindle value <v> through curve <c>, before truncation */
+static inline double map_power(const struct curve *c, double v)
+{
+	double i = trunc(v);
+	int n;
+
+	if (i == v && i >= 0 && i <= c->max)
+		return c->val[(int)i];
+
+	if (!c->loaded)
+		return curve_formula(c, v);
+
+	if (v <= 0)
+		return c->val[0];
+	if (v >= c->max)
+		return c->val[c->max];
+	n = i;
+	return c->val[n] + (c->val[n + 1] - c->val[n]) * (v - i);
+}
+
+/* loads curve <c> from file <name>, in the format gcode-fixup --save-curve
+ * uses: lines starting with '#' are ignored, an optional "max <value>" line
+ * sets the highest input value, otherwise it is the highest input found.
+ * Other lines are "input output" pairs with growing inputs, between which
+ * outputs are linearly interpolated. Returns non-zero on success, 0 on error.
+ */
+static inline int load_curve(struct curve *c, const char *name)
+{
+	double *pin = NULL, *pout = NULL;
+	int npts = 0, size = 0;
+	char line[256];
+	double in, out;
+	int max = -1;
+	int i, n;
+	FILE *f;
+
+	f = fopen(name, "r");
+	if (!f)
+		return 0;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (*line == '#' || *line == '\n')
+			continue;
+
+		if (strncmp(line, "max ", 4) == 0) {
+			max = atoi(line + 4);
+			continue;
+		}
+
+		if (sscanf(line, "%lf %lf", &in, &out) != 2 ||
+		    (npts && in <= pin[npts - 1]))
+			goto fail;
+
+		if (npts == size) {
+			size = size * 2 + 256;
+			pin = realloc(pin, size * sizeof(*pin));
+			pout = realloc(pout, size * sizeof(*pout));
+			if (!pin || !pout)
+				goto fail;
+		}
+		pin[npts] = in;
+		pout[npts] = out;
+		npts++;
+	}
+
+	if (!npts)
+		goto fail;
+	if (max < 0)
+		max = ceil(pin[npts - 1]);
+	if (max < 1 || max > MAX_CURVE_SIZE)
+		goto fail;
+
+	c->val = malloc((max + 1) * sizeof(*c->val));
+	if (!c->val)
+		goto fail;
+
+	/* resample at integral inputs */
+	for (i = n = 0; i <= max; i++) {
+		while (n < npts - 1 && pin[n + 1] <= i)
+			n++;
+		if (i <= pin[0])
+			c->val[i] = pout[0];
+		else if (n == npts - 1)
+			c->val[i] = pout[n];
+		else
+			c->val[i] = pout[n] + (pout[n + 1] - pout[n]) * (i - pin[n]) / (pin[n + 1] - pin[n]);
+	}
+
+	c->max = max;
+	c->loaded = 1;
+	free(pin);
+	free(pout);
+	fclose(f);
+	return 1;
+ fail:
+	free(pin);
+	free(pout);
+	fclose(f);
+	return 0;
+}
+
+/* returns the angle swept by an arc in mode <g> from <r> to <rt>, both
+ * relative to the center, negative when clockwise, like GRBL's mc_arc()
+ * computes it.
+ */
+static inline double arc_travel(int g, double r0, double r1, double rt0, double rt1)
+{
+	double travel = atan2(r0 * rt1 - r1 * rt0, r0 * rt0 + r1 * rt1);
+
+	if (g == 2) {
+		if (travel >= -ARC_ANGULAR_TRAVEL_EPSILON)
+			travel -= 2 * M_PI;
+	}
+	else if (travel <= ARC_ANGULAR_TRAVEL_EPSILON)
+		travel += 2 * M_PI;
+	return travel;
+}
+
+/* returns the number of straight moves GRBL splits an arc of radius <radius>
+ * sweeping angle <travel> into, with arc tolerance <tol> ($12).
+ */
+static inline long arc_segments(double radius, double travel, double tol)
+{
+	long segments;
+
+	if (radius <= tol / 2)
+		return 1;
+	segments = floor(fabs(0.5 * travel * radius) / sqrt(tol * (2 * radius - tol)));
+	return segments > 1 ? segments : 1;
+}
+
+/* sets <p> to point <n> out of <segments> of the arc from <a> to <b> around
+ * center <c> sweeping <travel>. <a0> and <a1> are the indexes of the plane's
+ * axes and <al> the one of the linear axis.
+ */
+static inline void arc_point(double p[3], const double a[3], const double b[3], const double c[2],
+                             double travel, long n, long segments, int a0, int a1, int al)
+{
+	double r0 = a[a0] - c[0], r1 = a[a1] - c[1];
+	double theta = travel * n / segments;
+
+	if (n == segments) {
+		memcpy(p, b, 3 * sizeof(*p));
+		return;
+	}
+	p[a0] = c[0] + r0 * cos(theta) - r1 * sin(theta);
+	p[a1] = c[1] + r0 * sin(theta) + r1 * cos(theta);
+	p[al] = a[al] + (b[al] - a[al]) * n / segments;
+}
+
+/* computes the center offset of an arc of radius <r> from the current
+ * position to <target> like GRBL does, or returns 0 if it is not possible.
+ */
+static inline int arc_radius_offset(const struct gcode *gc, const double target[3], double r,
+                                    double offset[3], int a0, int a1)
+{
+	double x = target[a0] - gc->pos[a0], y = target[a1] - gc->pos[a1];
+	double h = 4.0 * r * r - x * x - y * y;
+
+	if (h < 0 || (x == 0 && y == 0))
+		return 0;
+	h = -sqrt(h) / sqrt(x * x + y * y);
+	if (gc->motion == 3)
+		h = -h;
+	if (r < 0)
+		h = -h;
+	offset[a0] = 0.5 * (x - y * h);
+	offset[a1] = 0.5 * (y + x * h);
+	return 1;
+}
+
+/* sets [*<lo>, *<hi>] to the range covered along axis <ax> by move <r> from
+ * <a>, and returns its length in mm.
+ */
+static inline double move_range(const struct rec *r, const double a[3], int ax,
+                                double *lo, double *hi)
+{
+	const double b[3] = { r->x, r->y, r->z };
+	double radius, th0, travel, c, d, phi, v;
+	int q;
+
+	*lo = a[ax] < b[ax] ? a[ax] : b[ax];
+	*hi = a[ax] < b[ax] ? b[ax] : a[ax];
+	if (r->g <= 1)
+		return sqrt((b[0] - a[0]) * (b[0] - a[0]) + (b[1] - a[1]) * (b[1] - a[1]) +
+		            (b[2] - a[2]) * (b[2] - a[2]));
+
+	/* the extremes of an arc are at angles 0 and pi along X, and pi/2 and
+	 * 3pi/2 along Y, when the arc passes there.
+	 */
+	radius = hypot(a[0] - r->cx, a[1] - r->cy);
+	th0 = atan2(a[1] - r->cy, a[0] - r->cx);
+	travel = arc_travel(r->g, a[0] - r->cx, a[1] - r->cy, r->x - r->cx, r->y - r->cy);
+	c = ax ? r->cy : r->cx;
+	for (q = 0; q < 2; q++) {
+		phi = (ax ? M_PI / 2 : 0) + q * M_PI;
+		d = fmod(travel > 0 ? phi - th0 : th0 - phi, 2 * M_PI);
+		if (d < 0)
+			d += 2 * M_PI;
+		if (d > fabs(travel))
+			continue;
+		v = q ? c - radius : c + radius;
+		if (v < *lo)
+			*lo = v;
+		if (v > *hi)
+			*hi = v;
+	}
+	return hypot(travel * radius, b[2] - a[2]);
+}
+
+/* appends record <r> followed by <len> bytes of <text> to the temporary file */
+static inline void put_rec(struct recfile *rf, struct rec *r, const char *text, size_t len)
+{
+	size_t size = r->kind == REC_MOVE && r->g >= 2 ? sizeof(*r) : REC_BASE;
+
+	r->len = len;
+	if (fwrite(r, size, 1, rf->tmp) != 1 || (len && fwrite(text, len, 1, rf->tmp) != 1))
+		die(1, "cannot write the temporary file\n");
+	if (r->kind == REC_MOVE)
+		rf->moves++;
+	else
+		rf->texts++;
+}
+
+/* reads the next record from the temporary file into <r>, and its text into
+ * rf->text. Returns 0 at the end.
+ */
+static inline int get_rec(struct recfile *rf, struct rec *r)
+{
+	if (fread(r, REC_BASE, 1, rf->tmp) != 1)
+		return 0;
+	if (r->kind == REC_MOVE && r->g >= 2 && fread(&r->cx, sizeof(*r) - REC_BASE, 1, rf->tmp) != 1)
+		die(1, "cannot read the temporary file\n");
+	if (r->kind != REC_MOVE) {
+		if (r->len >= rf->text_size) {
+			rf->text_size = r->len + 1;
+			rf->text = realloc(rf->text, rf->text_size);
+			if (!rf->text)
+				die(1, "out of memory\n");
+		}
+		if (r->len && fread(rf->text, r->len, 1, rf->tmp) != 1)
+			die(1, "cannot read the temporary file\n");
+		rf->text[r->len] = 0;
+	}
+	return 1;
+}
+
+/* records a move of the current modal state from machine position <a> to
+ * <r>'s end, and passes it to rf->move.
+ */
+static inline void record_move(struct recfile *rf, const struct gcode *gc, struct rec *r,
+                               const double a[3])
+{
+	r->kind = REC_MOVE;
+	r->g = gc->motion;
+	r->spindle = gc->spindle;
+	r->homing = 0;
+	r->s = gc->s;
+	r->f = gc->feed;
+	put_rec(rf, r, NULL, 0);
+	if (rf->move)
+		rf->move(rf, r, a);
+}
+
+/* records an arc in the current plane from the current position to <target>
+ * around the center at <offset> from the current position, both in work
+ * coordinates. Arcs outside of the XY plane are turned into straight moves.
+ */
+static inline void record_arc(struct recfile *rf, struct gcode *gc, const double target[3],
+                              const double offset[3], int a0, int a1, int al)
+{
+	double a[3], b[3], p[3], prev[3], c[2], travel;
+	struct rec r;
+	long segments, n;
+	int i, motion = gc->motion;
+
+	for (i = 0; i < 3; i++) {
+		a[i] = gc->pos[i] + gc->g92[i];
+		b[i] = target[i] + gc->g92[i];
+	}
+	c[0] = a[a0] + offset[a0];
+	c[1] = a[a1] + offset[a1];
+	memset(&r, 0, sizeof(r));
+
+	if (gc->plane == 17) {
+		r.x = b[0];
+		r.y = b[1];
+		r.z = b[2];
+		r.cx = c[0];
+		r.cy = c[1];
+		record_move(rf, gc, &r, a);
+		return;
+	}
+
+	travel = arc_travel(motion, -offset[a0], -offset[a1], b[a0] - c[0], b[a1] - c[1]);
+	segments = arc_segments(hypot(offset[a0], offset[a1]), travel, ARC_TOLERANCE);
+	gc->motion = 1;
+	memcpy(prev, a, sizeof(prev));
+	for (n = 1; n <= segments; n++) {
+		arc_point(p, a, b, c, travel, n, segments, a0, a1, al);
+		r.x = p[0];
+		r.y = p[1];
+		r.z = p[2];
+		record_move(rf, gc, &r, prev);
+		memcpy(prev, p, sizeof(prev));
+	}
+	gc->motion = motion;
+}
+
+/* parses the line of <len> bytes at <line> into records. Modal changes are
+ * only kept in the interpreter's state since the output sets them where
+ * needed, and lines without motion which are neither modal changes nor
+ * program ends are kept as text.
+ */
+static inline void parse_line(struct recfile *rf, struct gcode *gc, const char *line, size_t len)
+{
+	const char *p = line, *end = line + len;
+	double word[26];
+	unsigned int seen = 0;    // one bit per letter
+	int motion = -1, g92 = 0, dwell = 0, set_plane = 0, no_move = 0, homing = 0;
+	int other = 0, comment = 0;
+	double target[3], offset[3] = { 0, 0, 0 }, a[3];
+	double unit;
+	struct rec r;
+	int i, a0, a1, al;
+
+	gc->line++;
+	memset(&r, 0, sizeof(r));
+	while (len && (line[len - 1] == '\r' || line[len - 1] == ' ' || line[len - 1] == '\t'))
+		len--;
+	end = line + len;
+
+	if (p < end && *p == '$') {
+		r.kind = REC_TEXT;
+		put_rec(rf, &r, line, len);
+		return;
+	}
+
+	while (p < end) {
+		int c = toupper((unsigned char)*p++);
+		double v;
+
+		if (c == '(') {
+			while (p < end && *p++ != ')')
+				;
+			comment = 1;
+			continue;
+		}
+		if (c == ';') {
+			comment = 1;
+			break;
+		}
+		if (c < 'A' || c > 'Z')
+			continue;
+
+		while (p < end && *p == ' ')
+			p++;
+		v = parse_num(&p, end);
+
+		if (c == 'G') {
+			int g = (int)(v * 10 + 0.5);
+
+			if (g <= 30 && g % 10 == 0)
+				motion = g / 10;
+			else if (g == 40)
+				dwell = 1;
+			else if (g >= 170 && g <= 190 && g % 10 == 0)
+				set_plane = g / 10;
+			else if (g == 200 || g == 210)
+				gc->inches = g == 200;
+			else if (g == 900 || g == 910)
+				gc->absolute = g == 900;
+			else if (g == 920)
+				g92 = 1;
+			else if (g == 100 || g == 280 || g == 300) {
+				no_move = 1;      // axis words are not a target
+				homing |= g != 100;
+				other = 1;
+			}
+			else
+				other = 1;
+		}
+		else if (c == 'M') {
+			int m = (int)v;
+
+			if (m >= 3 && m <= 5)
+				gc->spindle = m;
+			else if (m != 2 && m != 30)
+				other = 1;        // program ends are replaced
+		}
+		else if (c == 'N')
+			continue;
+		else {
+			if (!strchr("FIJKPRSXYZ", c))
+				other = 1;
+			word[c - 'A'] = v;
+			seen |= 1U << (c - 'A');
+		}
+	}
+
+	unit = gc->inches ? 25.4 : 1.0;
+	if (set_plane)
+		gc->plane = set_plane;
+	if (seen & (1U << ('F' - 'A')))
+		gc->feed = word['F' - 'A'] * unit;
+	if (seen & (1U << ('S' - 'A')))
+		gc->s = word['S' - 'A'];
+
+	if (dwell || no_move) {
+		r.kind = dwell ? REC_DWELL : REC_TEXT;
+		r.homing = homing;
+		put_rec(rf, &r, line, len);
+		return;
+	}
+
+	if (g92) {
+		/* the machine does not move, only the work coordinates */
+		for (i = 0; i < 3; i++) {
+			if (seen & (1U << ('X' - 'A' + i))) {
+				gc->g92[i] += gc->pos[i] - word['X' - 'A' + i] * unit;
+				gc->pos[i] = word['X' - 'A' + i] * unit;
+			}
+		}
+		return;
+	}
+
+	if (motion >= 0)
+		gc->motion = motion;
+
+	if (!(seen & 7U << ('X' - 'A'))) {
+		if (other || (comment && len)) {
+			r.kind = REC_TEXT;
+			put_rec(rf, &r, line, len);
+		}
+		return;
+	}
+
+	if (other || comment)
+		gc->dropped++;
+
+	for (i = 0; i < 3; i++) {
+		target[i] = gc->pos[i];
+		if (seen & (1U << ('X' - 'A' + i)))
+			target[i] = word['X' - 'A' + i] * unit + (gc->absolute ? 0 : gc->pos[i]);
+	}
+
+	if (gc->motion != 0 && gc->feed <= 0) {
+		/* error 22: undefined feed rate */
+		gc->rejected++;
+		return;
+	}
+
+	if (gc->motion <= 1) {
+		for (i = 0; i < 3; i++)
+			a[i] = gc->pos[i] + gc->g92[i];
+		r.x = target[0] + gc->g92[0];
+		r.y = target[1] + gc->g92[1];
+		r.z = target[2] + gc->g92[2];
+		record_move(rf, gc, &r, a);
+	}
+	else {
+		a0 = gc->plane == 18 ? 2 : gc->plane == 19 ? 1 : 0;
+		a1 = gc->plane == 18 ? 0 : gc->plane == 19 ? 2 : 1;
+		al = 3 - a0 - a1;
+
+		if (seen & (1U << ('R' - 'A'))) {
+			if (!arc_radius_offset(gc, target, word['R' - 'A'] * unit, offset, a0, a1)) {
+				gc->rejected++;
+				return;
+			}
+		}
+		else {
+			for (i = 0; i < 3; i++)
+				if (seen & (1U << ('I' - 'A' + i)))
+					offset[i] = word['I' - 'A' + i] * unit;
+		}
+		record_arc(rf, gc, target, offset, a0, a1, al);
+	}
+	memcpy(gc->pos, target, sizeof(target));
+}
+
+/* parses the G-CODE read from <fd> into the temporary file. Returns 0 on read
+ * error.
+ */
+static inline int parse_fd(struct recfile *rf, struct gcode *gc, int fd)
+{
+	static char *buf;
+	static size_t size;
+	size_t len = 0;
+	char *p, *nl, *end;
+	ssize_t ret;
+
+	if (!buf) {
+		size = INPUT_BUFFER_SIZE;
+		buf = malloc(size);
+		if (!buf)
+			die(1, "out of memory\n");
+	}
+
+	while (1) {
+		if (len == size) {
+			/* a single line fills the buffer */
+			size *= 2;
+			buf = realloc(buf, size);
+			if (!buf)
+				die(1, "out of memory\n");
+		}
+
+		ret = read(fd, buf + len, size - len);
+		if (ret < 0)
+			return 0;
+
+		if (ret == 0) {
+			/* last line without LF */
+			if (len)
+				parse_line(rf, gc, buf, len);
+			return 1;
+		}
+
+		len += ret;
+		end = buf + len;
+		for (p = buf; (nl = memchr(p, '\n', end - p)) != NULL; p = nl + 1)
+			parse_line(rf, gc, p, nl - p);
+
+		len = end - p;
+		memmove(buf, p, len);
+	}
+}
+
+/* creates the temporary file of <rf>, whose moves are passed to <move> */
+static inline void recfile_init(struct recfile *rf,
+                                void (*move)(struct recfile *rf, const struct rec *r,
+                                             const double a[3]))
+{
+	memset(rf, 0, sizeof(*rf));
+	rf->move = move;
+	rf->tmp = tmpfile();
+	if (!rf->tmp)
+		die(1, "cannot create a temporary file\n");
+	setvbuf(rf->tmp, NULL, _IOFBF, TEMP_BUFFER_SIZE);
+}
+
+#endif /* _GCODE_COMMON_H */
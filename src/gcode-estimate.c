@@ -0,0 +1,837 @@
+/* Estimates how long GRBL 1.1 takes to run a G-CODE file by replaying it
+ * through a model of its motion planner: per-axis max rates, accelerations
+ * and step resolutions, junction deviation, arc segmentation within the arc
+ * tolerance, and a planner buffer of limited size which forces the machine to
+ * be able to stop at the end of the last block received.
+ *
+ * The stream is assumed to never starve the planner, and the stepper's own
+ * segment buffer and AMASS are not modeled since they do not change the
+ * velocity profiles.
+ */
+#include <ctype.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gcode-common.h"
+
+/* GRBL 1.1's default settings */
+#define DEFAULT_STEPS_PER_MM     250.0   // $100-$102
+#define DEFAULT_MAX_RATE         500.0   // $110-$112, mm/min
+#define DEFAULT_ACCEL            10.0    // $120-$122, mm/s^2
+#define DEFAULT_JUNCTION_DEV     0.010   // $11, mm
+#define DEFAULT_ARC_TOLERANCE    0.002   // $12, mm
+#define DEFAULT_LASER_MODE       0       // $32
+
+/* GRBL's BLOCK_BUFFER_SIZE. One slot is always left empty. */
+#define DEFAULT_BLOCKS           16
+
+/* planner constants from GRBL's config.h and planner.h */
+#define MINIMUM_FEED_RATE        1.0     // mm/min
+#define MINIMUM_JUNCTION_SPEED   0.0     // mm/min
+#define SOME_LARGE_VALUE         1.0E+38
+
+/* time-per-line histogram: HISTO_BINS decades starting at HISTO_MIN seconds,
+ * the first and last bins also counting what is below or above.
+ */
+#define HISTO_BINS               7
+#define HISTO_MIN                1e-4
+
+/* long options without a short equivalent */
+enum {
+	OPT_SETTINGS = 256,
+	OPT_BLOCKS,
+	OPT_SELF_CHECK,
+};
+
+const struct option long_options[] = {
+	{"help",        no_argument,       0, 'h'              },
+	{"set",         required_argument, 0, 'S'              },
+	{"settings",    required_argument, 0, OPT_SETTINGS     },
+	{"blocks",      required_argument, 0, OPT_BLOCKS       },
+	{"self-check",  no_argument,       0, OPT_SELF_CHECK   },
+	{0,             0,                 0, 0                }
+};
+
+/* machine settings, with the same units as GRBL's */
+struct settings {
+	double steps[3];          // $100-$102, steps/mm
+	double max_rate[3];       // $110-$112, mm/min
+	double accel[3];          // $120-$122, mm/s^2
+	double junction_dev;      // $11, mm
+	double arc_tolerance;     // $12, mm
+	int laser;                // $32
+};
+
+/* motion kinds, for the per-phase times */
+enum {
+	KIND_RAPID = 0,           // G0
+	KIND_IDLE,                // G1-G3 with the laser off
+	KIND_BURN,                // G1-G3 with the laser on
+	KIND_DWELL,               // G4
+	KINDS
+};
+
+/* a planner block. Speeds are in mm/min and accelerations in mm/min^2 like
+ * in GRBL, and squared speeds are used where GRBL does.
+ */
+struct block {
+	double len;               // mm
+	double accel;
+	double nominal_sqr;
+	double max_entry_sqr;
+	unsigned long line;       // input line number
+	int kind;
+};
+
+/* the planner's ring of <count> blocks starting at <head>, of which at most
+ * <size> may be queued. <entry_sqr> is the entry speed of the oldest one.
+ */
+struct planner {
+	struct block *ring;
+	int size, head, count;
+	double entry_sqr;
+	double prev_unit[3];      // unit vector of the previous block
+	double prev_nominal_sqr;  // nominal speed of the previous block
+	int empty;                // the machine stopped, next block starts at 0
+	int64_t pos[3];           // machine position in steps
+
+	/* statistics */
+	unsigned long blocks;
+	double time[KINDS];       // seconds
+	double dist[KINDS];       // mm
+	unsigned long cur_line;   // line <cur_time> belongs to
+	double cur_time;          // time spent so far on <cur_line>
+	unsigned long histo[HISTO_BINS];
+	double histo_time[HISTO_BINS];
+};
+
+/* returns the highest value of <max> along unit vector <u>, i.e. the one for
+ * which no axis exceeds its own limit, like GRBL's
+ * limit_value_by_axis_maximum().
+ */
+static double limit_by_axis(const double max[3], const double u[3])
+{
+	double limit = SOME_LARGE_VALUE;
+	int i;
+
+	for (i = 0; i < 3; i++)
+		if (u[i] != 0 && fabs(max[i] / u[i]) < limit)
+			limit = fabs(max[i] / u[i]);
+	return limit;
+}
+
+/* returns the duration in seconds of a block of length <d> mm at acceleration
+ * <a> mm/min^2, entered at speed sqrt(<v0s>), left at sqrt(<v1s>) and
+ * cruising at most at sqrt(<vns>), in mm/min.
+ */
+static double trapezoid_time(double v0s, double v1s, double vns, double a, double d)
+{
+	double v0 = sqrt(v0s), v1 = sqrt(v1s), vn = sqrt(vns), vp;
+	double da = (vns - v0s) / (2 * a);
+	double dd = (vns - v1s) / (2 * a);
+
+	if (da + dd <= d)
+		return ((vn - v0) / a + (vn - v1) / a + (d - da - dd) / vn) * 60.0;
+
+	/* triangle: not enough room to reach the nominal speed */
+	vp = sqrt((2 * a * d + v0s + v1s) / 2);
+	if (vp < v0)
+		vp = v0;
+	if (vp < v1)
+		vp = v1;
+	return ((vp - v0) / a + (vp - v1) / a) * 60.0;
+}
+
+/* accounts <t> seconds to line <line> of the time-per-line histogram. Times
+ * are accumulated until the line changes.
+ */
+static void account_line(struct planner *pl, unsigned long line, double t)
+{
+	int bin;
+
+	if (line != pl->cur_line && pl->cur_time > 0) {
+		bin = (int)floor(log10(pl->cur_time / HISTO_MIN)) + 1;
+		if (bin < 0)
+			bin = 0;
+		if (bin >= HISTO_BINS)
+			bin = HISTO_BINS - 1;
+		pl->histo[bin]++;
+		pl->histo_time[bin] += pl->cur_time;
+		pl->cur_time = 0;
+	}
+	pl->cur_line = line;
+	pl->cur_time += t;
+}
+
+/* runs the oldest block. Its exit speed is the highest one permitting the
+ * following blocks to stop at the end of the last one, which is what GRBL's
+ * reverse planner pass computes, and which the block can reach.
+ */
+static void plan_run_oldest(struct planner *pl)
+{
+	struct block *b = &pl->ring[pl->head];
+	double next_sqr = 0, exit_sqr, t;
+	int i;
+
+	for (i = pl->count - 1; i >= 1; i--) {
+		const struct block *n = &pl->ring[(pl->head + i) % pl->size];
+		double v = next_sqr + 2 * n->accel * n->len;
+
+		next_sqr = v < n->max_entry_sqr ? v : n->max_entry_sqr;
+	}
+
+	exit_sqr = pl->entry_sqr + 2 * b->accel * b->len;
+	if (next_sqr < exit_sqr)
+		exit_sqr = next_sqr;
+
+	t = trapezoid_time(pl->entry_sqr, exit_sqr, b->nominal_sqr, b->accel, b->len);
+	pl->time[b->kind] += t;
+	pl->dist[b->kind] += b->len;
+	account_line(pl, b->line, t);
+
+	pl->entry_sqr = exit_sqr;
+	pl->head = (pl->head + 1) % pl->size;
+	pl->count--;
+}
+
+/* runs all queued blocks, leaving the machine stopped, like GRBL's
+ * protocol_buffer_synchronize().
+ */
+static void plan_sync(struct planner *pl)
+{
+	while (pl->count)
+		plan_run_oldest(pl);
+	pl->entry_sqr = 0;
+	pl->empty = 1;
+}
+
+/* queues a linear move to <target> (mm, machine coordinates) at <rate>
+ * mm/min, or at the rapid rate if <rate> is negative, from line <line>. The
+ * oldest block runs first if the buffer is full. Follows GRBL's
+ * plan_buffer_line().
+ */
+static void plan_line(struct planner *pl, const struct settings *st, const double target[3],
+                      double rate, int kind, unsigned long line)
+{
+	struct block *b;
+	double delta[3], unit[3], len = 0, accel[3];
+	double rapid, nominal_sqr, junction_sqr, max_entry;
+	int64_t steps[3];
+	int i, moved = 0;
+
+	for (i = 0; i < 3; i++) {
+		steps[i] = llround(target[i] * st->steps[i]);
+		delta[i] = (steps[i] - pl->pos[i]) / st->steps[i];
+		moved |= steps[i] != pl->pos[i];
+		len += delta[i] * delta[i];
+	}
+
+	/* GRBL drops blocks without any step */
+	if (!moved)
+		return;
+
+	len = sqrt(len);
+	for (i = 0; i < 3; i++) {
+		unit[i] = delta[i] / len;
+		accel[i] = st->accel[i] * 3600.0;
+		pl->pos[i] = steps[i];
+	}
+
+	if (pl->count == pl->size)
+		plan_run_oldest(pl);
+
+	b = &pl->ring[(pl->head + pl->count) % pl->size];
+	b->len = len;
+	b->line = line;
+	b->kind = kind;
+	b->accel = limit_by_axis(accel, unit);
+	rapid = limit_by_axis(st->max_rate, unit);
+	if (rate < 0 || rate > rapid)
+		rate = rapid;
+	if (rate < MINIMUM_FEED_RATE)
+		rate = MINIMUM_FEED_RATE;
+	nominal_sqr = rate * rate;
+	b->nominal_sqr = nominal_sqr;
+
+	/* junction speed from the deviation of a virtual circle tangent to
+	 * both paths at the junction.
+	 */
+	if (pl->empty) {
+		junction_sqr = 0;
+		pl->empty = 0;
+	}
+	else {
+		double cos_theta = 0, junction_unit[3], sin_theta_d2, jaccel;
+		double norm = 0;
+
+		for (i = 0; i < 3; i++) {
+			cos_theta -= pl->prev_unit[i] * unit[i];
+			junction_unit[i] = unit[i] - pl->prev_unit[i];
+			norm += junction_unit[i] * junction_unit[i];
+		}
+
+		if (cos_theta > 0.999999)
+			junction_sqr = MINIMUM_JUNCTION_SPEED * MINIMUM_JUNCTION_SPEED;
+		else if (cos_theta < -0.999999)
+			junction_sqr = SOME_LARGE_VALUE;
+		else {
+			norm = sqrt(norm);
+			for (i = 0; i < 3; i++)
+				junction_unit[i] /= norm;
+			jaccel = limit_by_axis(accel, junction_unit);
+			sin_theta_d2 = sqrt(0.5 * (1.0 - cos_theta));
+			junction_sqr = jaccel * st->junction_dev * sin_theta_d2 / (1.0 - sin_theta_d2);
+			if (junction_sqr < MINIMUM_JUNCTION_SPEED * MINIMUM_JUNCTION_SPEED)
+				junction_sqr = MINIMUM_JUNCTION_SPEED * MINIMUM_JUNCTION_SPEED;
+		}
+	}
+
+	max_entry = nominal_sqr < pl->prev_nominal_sqr ? nominal_sqr : pl->prev_nominal_sqr;
+	b->max_entry_sqr = junction_sqr < max_entry ? junction_sqr : max_entry;
+	if (!pl->count)
+		pl->entry_sqr = 0;
+
+	memcpy(pl->prev_unit, unit, sizeof(unit));
+	pl->prev_nominal_sqr = nominal_sqr;
+	pl->count++;
+	pl->blocks++;
+}
+
+/* returns the kind of move the current modal state produces */
+static int motion_kind(const struct gcode *gc)
+{
+	if (gc->motion == 0)
+		return KIND_RAPID;
+	if (gc->spindle != 5 && gc->s > 0)
+		return KIND_BURN;
+	return KIND_IDLE;
+}
+
+/* converts work position <work> to machine coordinates in <mach> */
+static void to_machine(const struct gcode *gc, const double work[3], double mach[3])
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+		mach[i] = work[i] + gc->g92[i];
+}
+
+/* splits the arc from the current position to <target> around the center at
+ * <offset> from the current position into linear blocks, like GRBL's
+ * mc_arc(). <a0> and <a1> are the indexes of the plane's axes and <al> the one
+ * of the linear axis.
+ */
+static void plan_arc(struct planner *pl, const struct settings *st, struct gcode *gc,
+                     const double target[3], const double offset[3], int a0, int a1, int al)
+{
+	const double c[2] = { gc->pos[a0] + offset[a0], gc->pos[a1] + offset[a1] };
+	double travel = arc_travel(gc->motion, -offset[a0], -offset[a1],
+	                           target[a0] - c[0], target[a1] - c[1]);
+	long segments = arc_segments(hypot(offset[a0], offset[a1]), travel, st->arc_tolerance);
+	double p[3], mach[3];
+	int kind = motion_kind(gc);
+	long n;
+
+	for (n = 1; n <= segments; n++) {
+		arc_point(p, gc->pos, target, c, travel, n, segments, a0, a1, al);
+		to_machine(gc, p, mach);
+		plan_line(pl, st, mach, gc->feed, kind, gc->line);
+	}
+}
+
+/* executes the line of <len> bytes at <line> */
+static void estimate_line(struct planner *pl, const struct settings *st, struct gcode *gc,
+                          const char *line, size_t len)
+{
+	const char *p = line, *end = line + len;
+	double word[26];
+	unsigned int seen = 0;    // one bit per letter
+	int motion = -1, g92 = 0, dwell = 0, sync = 0, set_plane = 0, no_move = 0;
+	int spindle = gc->spindle;
+	double target[3], offset[3] = { 0, 0, 0 }, mach[3];
+	double unit;
+	int i, a0, a1, al;
+
+	gc->line++;
+	if (p < end && *p == '$')
+		return;
+
+	while (p < end) {
+		int c = toupper((unsigned char)*p++);
+		double v;
+
+		if (c == '(') {
+			while (p < end && *p++ != ')')
+				;
+			continue;
+		}
+		if (c == ';')
+			break;
+		if (c < 'A' || c > 'Z')
+			continue;
+
+		while (p < end && *p == ' ')
+			p++;
+		v = parse_num(&p, end);
+
+		if (c == 'G') {
+			int g = (int)(v * 10 + 0.5);
+
+			if (g <= 30 && g % 10 == 0)
+				motion = g / 10;
+			else if (g == 40)
+				dwell = 1;
+			else if (g >= 170 && g <= 190 && g % 10 == 0)
+				set_plane = g / 10;
+			else if (g == 200 || g == 210)
+				gc->inches = g == 200;
+			else if (g == 900 || g == 910)
+				gc->absolute = g == 900;
+			else if (g == 920)
+				g92 = 1;
+			else if (g == 100 || g == 280 || g == 300)
+				no_move = 1;      // axis words are not a target
+		}
+		else if (c == 'M') {
+			int m = (int)v;
+
+			if (m >= 3 && m <= 5)
+				spindle = m;
+			else if (m == 0 || m == 1 || m == 2 || m == 30)
+				sync = 1;
+		}
+		else {
+			word[c - 'A'] = v;
+			seen |= 1U << (c - 'A');
+		}
+	}
+
+	unit = gc->inches ? 25.4 : 1.0;
+	if (set_plane)
+		gc->plane = set_plane;
+
+	if (seen & (1U << ('F' - 'A')))
+		gc->feed = word['F' - 'A'] * unit;
+
+	/* spindle changes stop the machine, except S words on G1-G3 motion
+	 * lines in laser mode.
+	 */
+	if (spindle != gc->spindle) {
+		plan_sync(pl);
+		gc->spindle = spindle;
+	}
+	if ((seen & (1U << ('S' - 'A'))) && word['S' - 'A'] != gc->s) {
+		int ismotion = st->laser && (seen & 7U << ('X' - 'A')) &&
+		               (motion < 0 ? gc->motion : motion) != 0;
+
+		if (gc->spindle != 5 && !ismotion)
+			plan_sync(pl);
+		gc->s = word['S' - 'A'];
+	}
+
+	if (dwell) {
+		double t = (seen & (1U << ('P' - 'A'))) ? word['P' - 'A'] : 0;
+
+		plan_sync(pl);
+		pl->time[KIND_DWELL] += t;
+		account_line(pl, gc->line, t);
+		return;
+	}
+
+	if (no_move)
+		return;
+
+	if (g92) {
+		/* the machine does not move, only the work coordinates */
+		for (i = 0; i < 3; i++) {
+			if (seen & (1U << ('X' - 'A' + i))) {
+				gc->g92[i] += gc->pos[i] - word['X' - 'A' + i] * unit;
+				gc->pos[i] = word['X' - 'A' + i] * unit;
+			}
+		}
+		return;
+	}
+
+	if (motion >= 0)
+		gc->motion = motion;
+
+	if (seen & 7U << ('X' - 'A')) {
+		for (i = 0; i < 3; i++) {
+			target[i] = gc->pos[i];
+			if (seen & (1U << ('X' - 'A' + i)))
+				target[i] = word['X' - 'A' + i] * unit + (gc->absolute ? 0 : gc->pos[i]);
+		}
+
+		if (gc->motion != 0 && gc->feed <= 0) {
+			/* error 22: undefined feed rate */
+			gc->rejected++;
+			return;
+		}
+
+		if (gc->motion <= 1) {
+			to_machine(gc, target, mach);
+			plan_line(pl, st, mach, gc->motion ? gc->feed : -1, motion_kind(gc), gc->line);
+		}
+		else {
+			a0 = gc->plane == 18 ? 2 : gc->plane == 19 ? 1 : 0;
+			a1 = gc->plane == 18 ? 0 : gc->plane == 19 ? 2 : 1;
+			al = 3 - a0 - a1;
+
+			if (seen & (1U << ('R' - 'A'))) {
+				if (!arc_radius_offset(gc, target, word['R' - 'A'] * unit, offset, a0, a1)) {
+					gc->rejected++;
+					return;
+				}
+			}
+			else {
+				for (i = 0; i < 3; i++)
+					if (seen & (1U << ('I' - 'A' + i)))
+						offset[i] = word['I' - 'A' + i] * unit;
+			}
+			plan_arc(pl, st, gc, target, offset, a0, a1, al);
+		}
+		memcpy(gc->pos, target, sizeof(target));
+	}
+
+	if (sync)
+		plan_sync(pl);
+}
+
+/* estimates the time needed to run the G-CODE read from <fd>. Returns 0 on
+ * read error.
+ */
+int estimate_fd(struct planner *pl, const struct settings *st, struct gcode *gc, int fd)
+{
+	static char *buf;
+	static size_t size;
+	size_t len = 0;
+	char *p, *nl, *end;
+	ssize_t ret;
+
+	if (!buf) {
+		size = INPUT_BUFFER_SIZE;
+		buf = malloc(size);
+		if (!buf)
+			die(1, "out of memory\n");
+	}
+
+	while (1) {
+		if (len == size) {
+			/* a single line fills the buffer */
+			size *= 2;
+			buf = realloc(buf, size);
+			if (!buf)
+				die(1, "out of memory\n");
+		}
+
+		ret = read(fd, buf + len, size - len);
+		if (ret < 0)
+			return 0;
+
+		if (ret == 0) {
+			/* last line without LF */
+			if (len)
+				estimate_line(pl, st, gc, buf, len);
+			plan_sync(pl);
+			account_line(pl, 0, 0);
+			return 1;
+		}
+
+		len += ret;
+		end = buf + len;
+		for (p = buf; (nl = memchr(p, '\n', end - p)) != NULL; p = nl + 1)
+			estimate_line(pl, st, gc, p, nl - p);
+
+		len = end - p;
+		memmove(buf, p, len);
+	}
+}
+
+/* initializes planner <pl> for <blocks> blocks and interpreter <gc> */
+void estimate_init(struct planner *pl, struct gcode *gc, int blocks)
+{
+	memset(pl, 0, sizeof(*pl));
+	pl->size = blocks - 1;
+	pl->ring = calloc(pl->size, sizeof(*pl->ring));
+	if (!pl->ring)
+		die(1, "out of memory\n");
+	pl->empty = 1;
+
+	gcode_init(gc);
+}
+
+/* sets GRBL setting <num> to <val>. Returns 0 if it is unknown or invalid. */
+int set_setting(struct settings *st, int num, double val)
+{
+	if (num >= 100 && num <= 102 && val > 0)
+		st->steps[num - 100] = val;
+	else if (num >= 110 && num <= 112 && val > 0)
+		st->max_rate[num - 110] = val;
+	else if (num >= 120 && num <= 122 && val > 0)
+		st->accel[num - 120] = val;
+	else if (num == 11 && val >= 0)
+		st->junction_dev = val;
+	else if (num == 12 && val > 0)
+		st->arc_tolerance = val;
+	else if (num == 32)
+		st->laser = val != 0;
+	else
+		return 0;
+	return 1;
+}
+
+/* parses "[$]<num>=<val>" at <str> and applies it. Returns 0 if invalid. */
+int parse_setting(struct settings *st, const char *str)
+{
+	const char *p = str + (*str == '$');
+	const char *end = p + strlen(p);
+	double num, val;
+
+	if (!isdigit((unsigned char)*p))
+		return 0;
+	num = parse_num(&p, end);
+	if (*p++ != '=')
+		return 0;
+	val = parse_num(&p, end);
+	return set_setting(st, (int)num, val);
+}
+
+/* loads the settings from file <name>, typically the output of GRBL's "$$"
+ * command. Other lines and unsupported settings are ignored. Returns 0 if the
+ * file cannot be read.
+ */
+int load_settings(struct settings *st, const char *name)
+{
+	char line[256];
+	FILE *file;
+
+	file = fopen(name, "r");
+	if (!file)
+		return 0;
+	while (fgets(line, sizeof(line), file) != NULL)
+		if (*line == '$')
+			parse_setting(st, line);
+	fclose(file);
+	return 1;
+}
+
+/* prints <t> seconds as hours, minutes and seconds */
+static void print_time(const char *name, double t, double total)
+{
+	long s = (long)t;
+
+	printf("%-8s %4ld:%02ld:%04.1f %10.1fs %5.1f%%\n", name,
+	       s / 3600, s / 60 % 60, t - (s - s % 60), t,
+	       total > 0 ? 100.0 * t / total : 0.0);
+}
+
+void report(const struct planner *pl, const struct gcode *gc)
+{
+	static const char *const names[KINDS] = { "rapids", "idle", "burning", "dwell" };
+	double total = 0, lo;
+	int i;
+
+	for (i = 0; i < KINDS; i++)
+		total += pl->time[i];
+
+	print_time("total", total, total);
+	for (i = 0; i < KINDS; i++)
+		print_time(names[i], pl->time[i], total);
+	printf("distance: %.1fmm rapids, %.1fmm idle, %.1fmm burning\n",
+	       pl->dist[KIND_RAPID], pl->dist[KIND_IDLE], pl->dist[KIND_BURN]);
+	printf("lines: %lu, blocks: %lu, rejected: %lu\n", gc->line, pl->blocks, gc->rejected);
+
+	printf("time per line:\n");
+	for (i = 0, lo = HISTO_MIN / 10; i < HISTO_BINS; i++, lo *= 10) {
+		if (i == 0)
+			printf("  %9s < %-7g", "", lo * 10);
+		else if (i == HISTO_BINS - 1)
+			printf("  %9g <= %-6s", lo, "");
+		else
+			printf("  %9g - %-7g", lo, lo * 10);
+		printf(" %10lu lines %10.1fs %5.1f%%\n", pl->histo[i], pl->histo_time[i],
+		       total > 0 ? 100.0 * pl->histo_time[i] / total : 0.0);
+	}
+}
+
+/* runs the G-CODE in <text> with settings <st> and returns its duration */
+static double check_time(const struct settings *st, const char *text)
+{
+	struct planner pl;
+	struct gcode gc;
+	const char *p, *nl;
+	double t = 0;
+	int i;
+
+	estimate_init(&pl, &gc, DEFAULT_BLOCKS);
+	for (p = text; (nl = strchr(p, '\n')) != NULL; p = nl + 1)
+		estimate_line(&pl, st, &gc, p, nl - p);
+	plan_sync(&pl);
+	for (i = 0; i < KINDS; i++)
+		t += pl.time[i];
+	free(pl.ring);
+	return t;
+}
+
+/* compares the estimates with durations computed by hand. All cases use
+ * 100 mm/s^2 and 50 mm/s (3000 mm/min) max rate on X and Y.
+ */
+int self_check(void)
+{
+	static const struct {
+		const char *gcode;
+		double time;
+	} cases[] = {
+		/* accel to 50 mm/s in 0.5s over 12.5mm, 75mm cruise in 1.5s, decel */
+		{ "G0X100\n", 2.5 },
+		/* F is capped to the max rate */
+		{ "G1X100F6000\n", 2.5 },
+		/* 25mm at 25mm/s (F1500): 0.25s, 3.125mm on each end, 0.75s */
+		{ "G1X25F1500\n", 1.25 },
+		/* triangle over 10mm: peak sqrt(100*10)=31.62mm/s, 2*0.3162s */
+		{ "G1X10F3000\n", 0.632456 },
+		/* diagonal: 70.71mm/s and 141.4mm/s^2 along it, 141.4mm: 2.5s */
+		{ "G0X100Y100\n", 2.5 },
+		/* collinear moves are joined at full speed */
+		{ "G1X50F3000\nX100\n", 2.5 },
+		/* 90deg corner at 1.848mm/s with $11=0.01: the junction accel
+		 * is 141.4, sin(theta/2) 0.7071, v^2=141.4*0.01*0.7071/0.2929.
+		 * Each move: 0.5s accel, (2500-3.414)/200=12.483mm decel in
+		 * 0.48152s, 100-12.5-12.483mm cruise at 50mm/s in 1.50034s.
+		 */
+		{ "G1X100F3000\nY100\n", 4.96372 },
+		/* a reversal stops the machine */
+		{ "G1X100F3000\nX0\n", 5.0 },
+		/* a dwell in between stops too */
+		{ "G1X50F3000\nG4P1.5\nX100\n", 1.5 + 2 * 1.5 },
+		/* S changes on motion lines in laser mode keep the speed */
+		{ "$32=1\nM4\nG1X50F3000S10\nX100S20\n", 2.5 },
+		/* but not outside of laser mode */
+		{ "M4\nG1X50F3000S10\nX100S20\n", 3.0 },
+		/* 1/4 circle of 10mm radius at 10 mm/s split into 39 segments
+		 * of 2.3deg, i.e. 15.7071mm instead of 15.7080mm, with junctions
+		 * faster than 10mm/s: 0.1s accel and decel over 0.5mm each,
+		 * then 14.7071mm at 10mm/s.
+		 */
+		{ "G3X-10Y10I-10J0F600\n", 1.67071 },
+	};
+	struct settings st = {
+		.steps = { 250, 250, 250 },
+		.max_rate = { 3000, 3000, 3000 },
+		.accel = { 100, 100, 100 },
+		.junction_dev = 0.01,
+		.arc_tolerance = 0.002,
+	};
+	int i, fail = 0;
+
+	for (i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++) {
+		struct settings s = st;
+		const char *text = cases[i].gcode;
+		double expect = cases[i].time;
+		double t;
+
+		while (*text == '$') {
+			parse_setting(&s, text);
+			text = strchr(text, '\n') + 1;
+		}
+		t = check_time(&s, text);
+		printf("case %d: expected %.6fs, got %.6fs: %s\n", i + 1, expect, t,
+		       fabs(t - expect) <= 1e-3 * expect ? "OK" : "FAIL");
+		fail |= fabs(t - expect) > 1e-3 * expect;
+	}
+	return !fail;
+}
+
+void usage(int code, const char *cmd)
+{
+	die(code,
+	    "Usage: %s [args*] [file.gcode]\n"
+	    "Estimates the time GRBL 1.1 needs to run the file, or stdin.\n"
+	    "Arguments:\n"
+	    "  -h | --help             display this help message\n"
+	    "  -S | --set <n>=<value>  set GRBL setting $<n> (def: GRBL's defaults)\n"
+	    "     --settings <file>    load the settings from this output of '$$'\n"
+	    "     --blocks <n>         planner buffer size (def: %d)\n"
+	    "     --self-check         compare with hand-computed cases, then exit\n"
+	    "Supported settings: $11 junction deviation, $12 arc tolerance, $32 laser\n"
+	    "mode, $100-$102 steps/mm, $110-$112 max rates, $120-$122 accelerations.\n"
+	    "\n", cmd, DEFAULT_BLOCKS);
+}
+
+int main(int argc, char **argv)
+{
+	struct settings st = {
+		.steps = { DEFAULT_STEPS_PER_MM, DEFAULT_STEPS_PER_MM, DEFAULT_STEPS_PER_MM },
+		.max_rate = { DEFAULT_MAX_RATE, DEFAULT_MAX_RATE, DEFAULT_MAX_RATE },
+		.accel = { DEFAULT_ACCEL, DEFAULT_ACCEL, DEFAULT_ACCEL },
+		.junction_dev = DEFAULT_JUNCTION_DEV,
+		.arc_tolerance = DEFAULT_ARC_TOLERANCE,
+		.laser = DEFAULT_LASER_MODE,
+	};
+	int blocks = DEFAULT_BLOCKS;
+	struct planner pl;
+	struct gcode gc;
+	int fd;
+
+	while (1) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "hS:", long_options, &option_index);
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			usage(0, argv[0]);
+			break;
+
+		case 'S':
+			if (!parse_setting(&st, optarg))
+				die(1, "invalid or unsupported setting '%s'\n", optarg);
+			break;
+
+		case OPT_SETTINGS:
+			if (!load_settings(&st, optarg))
+				die(1, "cannot read settings from '%s'\n", optarg);
+			break;
+
+		case OPT_BLOCKS:
+			blocks = atoi(optarg);
+			if (blocks < 2)
+				die(1, "the planner needs at least 2 blocks\n");
+			break;
+
+		case OPT_SELF_CHECK:
+			return self_check() ? 0 : 1;
+
+		case ':': /* missing argument */
+		case '?': /* unknown option */
+			usage(1, argv[0]);
+		}
+	}
+
+	estimate_init(&pl, &gc, blocks);
+
+	if (optind >= argc) {
+		if (!estimate_fd(&pl, &st, &gc, 0))
+			die(1, "read error\n");
+	}
+	else {
+		fd = open(argv[optind], O_RDONLY);
+		if (fd < 0)
+			die(1, "cannot open '%s'\n", argv[optind]);
+		if (!estimate_fd(&pl, &st, &gc, fd))
+			die(1, "read error\n");
+		close(fd);
+	}
+
+	report(&pl, &gc);
+	return 0;
+}
@@ -0,0 +1,4311 @@
+/* Native implementation of tools/gcode-fixup. It accepts all of the awk
+ * script's options and, when only given those, produces the same output, byte
+ * for byte, as the script running on GNU awk. It streams the input through
+ * large buffers, processes lines in place and never goes through regex
+ * substitutions, hence runs way faster on large raster files.
+ *
+ * The awk script's semantics are preserved on purpose, including its quirks
+ * (numbers printed with 6 significant digits, the max spindle value reporting
+ * the previous value, etc), so that both tools remain interchangeable. The
+ * options the script does not have (spindle ranges, power curve files,
+ * passthrough, and the passes rewriting the moves themselves) change the
+ * output and only exist here.
+ */
+#include <ctype.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gcode-common.h"
+
+/* default settings, same as the awk script */
+#define DEFAULT_POWER            1.0
+#define DEFAULT_GAMMA            1.0
+#define DEFAULT_OFFSET           0.0
+#define DEFAULT_FEED             "5000"
+#define DEFAULT_SCALE            1.0
+#define DEFAULT_OFF              0.0
+
+/* geometric tolerance of the passes modifying paths, in mm. Half of the
+ * default pixel size in laser-preview, so that changes remain invisible.
+ */
+#define DEFAULT_TOLERANCE        0.05
+
+/* arc fitting: runs of at least ARC_MIN_MOVES and at most ARC_MAX_MOVES
+ * moves are replaced with a single arc, whose radius may not exceed
+ * ARC_MAX_RADIUS mm.
+ */
+#define ARC_MIN_MOVES            4
+#define ARC_MAX_MOVES            64
+#define ARC_MAX_RADIUS           1000.0
+
+/* polyline simplification: number of points of a run kept to check that
+ * going backwards does not move the path too far from them.
+ */
+#define SIMPLIFY_MAX_POINTS      64
+
+/* path reordering: default time budget of the improvement phase in seconds,
+ * and number of neighbours considered for each path.
+ */
+#define DEFAULT_REORDER_TIME     1.0
+#define REORDER_NEIGHBOURS       8
+
+/* duplicate elimination: initial number of slots of the line table (power of
+ * two), largest coordinate in tolerance steps, above which moves are left
+ * unchanged so that positions cannot overflow, and length in mm over which
+ * two directions one angle step apart drift by the tolerance.
+ */
+#define DEDUP_MIN_SLOTS          1024
+#define DEDUP_MAX_STEPS          (1 << 29)
+#define DEDUP_ANGLE_LEN          100.0
+
+/* length of the laser-off extensions added on both ends of trimmed raster
+ * rows, in mm.
+ */
+#define DEFAULT_OVERSCAN         0.0
+
+/* fewest consecutive horizontal moves forming a raster row */
+#define TRIM_MIN_MOVES           3
+
+/* acceleration of the X axis in mm/s^2 (GRBL's $120) used to size the
+ * overscan of trimmed rows, 0 to only use the fixed length.
+ */
+#define DEFAULT_ACCEL            0.0
+
+/* feed rate optimizer: default highest spindle ratio runs may be raised to,
+ * and max number of moves of a run, above which it is split to bound the
+ * memory usage.
+ */
+#define DEFAULT_MAX_POWER        1.0
+#define SPEED_RUN_MAX            65536
+
+/* compact output: default number of decimals of coordinates and highest
+ * supported one.
+ */
+#define DEFAULT_PRECISION        3
+#define MAX_PRECISION            8
+
+/* serial link assumed for the planner starvation estimates: default bits per
+ * second, bytes of a typical move line including the line feed, and default
+ * number of blocks in GRBL's planner buffer.
+ */
+#define DEFAULT_BAUD_RATE        115200
+#define LINK_LINE_BYTES          24
+#define DEFAULT_PLANNER_BLOCKS   16
+
+/* fraction of the highest feed rate which does not starve the planner that
+ * --link-fix applies, leaving room for the F words it adds.
+ */
+#define LINK_FIX_MARGIN          0.9
+
+/* highest spindle value, i.e. GRBL's $30 setting */
+#define DEFAULT_MAX_S            255
+
+/* output buffer size, the input one being INPUT_BUFFER_SIZE */
+#define OUTPUT_BUFFER_SIZE       (1 << 20)
+
+/* number of lines per columnar block */
+#define BLOCK_SIZE               4096
+
+/* number of entries in the number formatting cache, power of two */
+#define FMT_CACHE_SIZE           4096
+
+/* largest number of points of a --self-check case */
+#define SELF_CHECK_MAX_POINTS    8
+
+/* long options without a short equivalent */
+enum {
+	OPT_SAVE_CURVE = 256,
+	OPT_LOAD_CURVE,
+	OPT_PASSTHROUGH,
+	OPT_MERGE,
+	OPT_TRIM,
+	OPT_OVERSCAN,
+	OPT_ACCEL,
+	OPT_SPEED_UP,
+	OPT_MAX_POWER,
+	OPT_SIMPLIFY,
+	OPT_ARCS,
+	OPT_REORDER,
+	OPT_REVERSE,
+	OPT_REORDER_TIME,
+	OPT_TOLERANCE,
+	OPT_COMPACT,
+	OPT_PRECISION,
+	OPT_QUANTIZE,
+	OPT_LINK_CHECK,
+	OPT_LINK_FIX,
+	OPT_BAUD,
+	OPT_PLANNER,
+	OPT_DEDUP,
+	OPT_SELF_CHECK,
+};
+
+const struct option long_options[] = {
+	{"help",        no_argument,       0, 'h'              },
+	{"power",       required_argument, 0, 'p'              },
+	{"offset",      required_argument, 0, 'o'              },
+	{"gamma",       required_argument, 0, 'g'              },
+	{"feed",        required_argument, 0, 'f'              },
+	{"scale",       required_argument, 0, 's'              },
+	{"xscale",      required_argument, 0, 'x'              },
+	{"yscale",      required_argument, 0, 'y'              },
+	{"zscale",      required_argument, 0, 'z'              },
+	{"xoff",        required_argument, 0, 'X'              },
+	{"yoff",        required_argument, 0, 'Y'              },
+	{"zoff",        required_argument, 0, 'Z'              },
+	{"max-s",       required_argument, 0, 'm'              },
+	{"save-curve",  required_argument, 0, OPT_SAVE_CURVE   },
+	{"load-curve",  required_argument, 0, OPT_LOAD_CURVE   },
+	{"passthrough", no_argument,       0, OPT_PASSTHROUGH  },
+	{"merge",       no_argument,       0, OPT_MERGE        },
+	{"trim",        no_argument,       0, OPT_TRIM         },
+	{"overscan",    required_argument, 0, OPT_OVERSCAN     },
+	{"accel",       required_argument, 0, OPT_ACCEL        },
+	{"speed-up",    no_argument,       0, OPT_SPEED_UP     },
+	{"max-power",   required_argument, 0, OPT_MAX_POWER    },
+	{"simplify",    no_argument,       0, OPT_SIMPLIFY     },
+	{"arcs",        no_argument,       0, OPT_ARCS         },
+	{"reorder",     no_argument,       0, OPT_REORDER      },
+	{"reverse",     no_argument,       0, OPT_REVERSE      },
+	{"reorder-time", required_argument, 0, OPT_REORDER_TIME },
+	{"tolerance",   required_argument, 0, OPT_TOLERANCE    },
+	{"compact",     no_argument,       0, OPT_COMPACT      },
+	{"precision",   required_argument, 0, OPT_PRECISION    },
+	{"quantize",    required_argument, 0, OPT_QUANTIZE     },
+	{"link-check",  no_argument,       0, OPT_LINK_CHECK   },
+	{"link-fix",    no_argument,       0, OPT_LINK_FIX     },
+	{"baud",        required_argument, 0, OPT_BAUD         },
+	{"planner",     required_argument, 0, OPT_PLANNER      },
+	{"dedup",       no_argument,       0, OPT_DEDUP        },
+	{"self-check",  no_argument,       0, OPT_SELF_CHECK   },
+	{"verbose",     no_argument,       0, 'v'              },
+	{0,             0,                 0, 0                }
+};
+
+/* one cached "%.6g" representation of a double */
+struct fmt_entry {
+	uint64_t bits;           // the double's bits
+	uint8_t len;             // length of <str>, 0 if unused
+	char str[31];
+};
+
+/* flags describing the words present on a block line */
+#define B_G       0x0001     // G0..G3 first word, in <g>
+#define B_X       0x0002
+#define B_Y       0x0004
+#define B_Z       0x0008
+#define B_S       0x0010
+#define B_F       0x0020
+#define B_XZERO   0x0040     // X0 in G0 mode: no offset applied
+#define B_YZERO   0x0080
+#define B_ZZERO   0x0100
+#define B_FMAX    0x0200     // feed rate was clamped to the max feed
+#define B_IJ      0x0400     // arc center set, only for moves
+#define B_SCAN    0x0800     // laser-off part of a raster row, kept a G1
+
+/* columnar representation of up to BLOCK_SIZE consecutive lines which only
+ * contain an optional leading G0..G3 followed by at most one of each X, Y, Z
+ * (in this order), S and F, which covers almost all lines of raster and
+ * vector jobs. Other lines are processed word by word. Transforms run as
+ * passes over whole columns, then lines are serialized in order. Once a line
+ * is emitted, its x/y/z hold the resulting machine position.
+ */
+struct block {
+	int count;
+	double x[BLOCK_SIZE], y[BLOCK_SIZE], z[BLOCK_SIZE];
+	double s[BLOCK_SIZE], f[BLOCK_SIZE];
+	uint16_t flags[BLOCK_SIZE];
+	uint8_t g[BLOCK_SIZE];    // motion mode once the line is parsed
+};
+
+/* a move from (x0,y0,z0) to (x,y,z) in motion mode <g> at spindle value <s>
+ * and feed rate <f>, once transformed. <axes> holds B_X/B_Y/B_Z for the axes
+ * the input explicitly set, as the others may not be known by the machine,
+ * and B_IJ for arcs produced by the passes, whose center is at <i>,<j> from
+ * the start.
+ */
+struct move {
+	double x0, y0, z0;
+	double x, y, z;
+	double s, f;
+	double i, j;
+	int g;
+	int axes;
+};
+
+struct fixup;
+
+/* a stage of the move pipeline. Lines of the simple block form are turned
+ * into moves which go through all enabled passes in order, the last one being
+ * the emitter. <push> receives moves in order and may hold some of them.
+ * <flush> is called when a line that cannot be represented as a move comes,
+ * and must forward all pending moves.
+ */
+struct pass {
+	struct pass *next;
+	void (*push)(struct fixup *fx, struct pass *pass, const struct move *m);
+	void (*flush)(struct fixup *fx, struct pass *pass);
+	void (*report)(struct fixup *fx, struct pass *pass);  // optional, for -v
+	const char *name;
+	unsigned long in, out;    // number of moves received and forwarded
+};
+
+/* pipeline output stage, tracking the state of the machine */
+struct emitter {
+	struct pass pass;
+	double x, y, z, s, f;
+	long long n[3];           // X, Y, Z in output units in compact mode
+	int g;
+	int rel;                  // G91 is active
+	int known;                // B_G/B_X/B_Y/B_Z/B_S/B_F for known values
+
+	/* compact mode: lines which could be relative, held until they save
+	 * more than the G91 and G90 they need, in both forms.
+	 */
+	char *held_abs, *held_rel;
+	size_t held_abs_len, held_rel_len, held_size;
+	int held_gain;            // bytes saved by the relative form
+};
+
+/* raster run merging pass */
+struct merge {
+	struct pass pass;
+	struct move cur;          // move being extended
+	int pending;              // non-zero if <cur> is set
+};
+
+/* duplicate segment elimination pass. Each line holds the burnt spans of the
+ * moves lying on the line of unit direction (<ux>,<uy>), pointing to positive
+ * X (or negative Y if vertical), which contains the points verifying
+ * ux * y - uy * x = <c>, at height <z> with spindle value <s> and feed rate
+ * <f>. Lines are hashed by their angle and <c> counted in steps, <ka> and
+ * <kc>. Spans are positions ux * x + uy * y along the line counted in
+ * tolerance steps, sorted and disjoint. The first one is stored in <one>,
+ * and in <spans> once there are several. Slots whose <count> is zero are
+ * free.
+ */
+struct dedup_span {
+	int64_t t0, t1;
+};
+
+struct dedup_line {
+	double z, s, f;
+	double ux, uy, c;
+	int64_t ka, kc;
+	struct dedup_span one;
+	struct dedup_span *spans;
+	uint32_t count, size;
+};
+
+struct dedup {
+	struct pass pass;
+	struct dedup_line *lines; // hash table of <size> slots, power of two
+	size_t nlines, size;
+	int64_t nangles;          // number of angle steps over half a turn
+	unsigned long removed, shortened;
+	double saved;             // length not burnt twice, in mm
+};
+
+/* polyline simplification pass. The pending move goes from the run's anchor
+ * to the last accepted point. <lo> and <hi> delimit the directions from the
+ * anchor, as angles relative to (<rx>,<ry>), which keep all accepted points
+ * within the tolerance. The first SIMPLIFY_MAX_POINTS accepted points are
+ * kept in <pt>, <npts> counting all of them.
+ */
+struct simplify {
+	struct pass pass;
+	struct move cur;          // move being extended
+	int pending;              // non-zero if <cur> is set
+	int has_ref;              // zero while all points are close to the anchor
+	double rx, ry;            // reference direction
+	double lo, hi;            // allowed directions
+	double dmax;              // largest distance from the anchor so far
+	double pt[SIMPLIFY_MAX_POINTS][2];
+	int npts;
+};
+
+/* arc fitting pass. <run> holds the last moves of a run which may still
+ * become an arc. When <count> is 2 or more, they lie on the circle centered
+ * at (<cx>,<cy>), sweeping <sweep> radians, counter-clockwise if <ccw>.
+ */
+struct arcs {
+	struct pass pass;
+	struct move run[ARC_MAX_MOVES];
+	int count;
+	double cx, cy, r, sweep;
+	int ccw;
+	unsigned long arcs;       // number of arcs emitted
+	double wait_in, wait_out; // estimated time waiting for the link
+};
+
+/* raster trimming pass. <row> holds the horizontal moves of the current row,
+ * <gap> the moves burning nothing received since the last row or burning
+ * move, of which <gap_blank> are rows, and <cur> the position the output left
+ * the machine at.
+ */
+struct trim {
+	struct pass pass;
+	struct move *row;
+	size_t count, size;
+	struct move *gap;
+	size_t gap_count, gap_size;
+	unsigned long gap_blank;
+	int raster;               // non-zero if the last burning moves were a raster row
+	struct move cur;          // end of the last forwarded move
+	int cur_known;            // non-zero once <cur> was forwarded
+	struct move last;         // end of the last received move
+	int started;              // non-zero once <cur> and <last> are set
+	double overscan;          // laser-off extension on each end, in mm
+	double accel;             // X acceleration in mm/s^2, 0 if unknown
+	unsigned long rows, blank;
+	double time_in, time_out; // estimated job times, in seconds
+};
+
+/* feed rate optimizing pass. <run> holds the current run of burning moves,
+ * which share the same feed rate.
+ */
+struct speed {
+	struct pass pass;
+	struct move *run;
+	size_t count, size;
+	double max_s;             // highest spindle value runs may be raised to
+	unsigned long runs, faster;
+	double time_in, time_out; // estimated job times, in seconds
+};
+
+/* a path for the reordering pass: <count> moves starting at <first> in the
+ * group's moves, going from (<x0>,<y0>) to (<x1>,<y1>). It runs backwards if
+ * <rev> is set, which is only permitted if <can_rev> is set.
+ */
+struct path {
+	size_t first, count;
+	double x0, y0, x1, y1;
+	int rev, can_rev;
+};
+
+/* path reordering pass. Moves are kept until the next barrier, then the
+ * paths they form are emitted in a new order with new travels in between.
+ */
+struct reorder {
+	struct pass pass;
+	struct move *moves;       // burning moves of the current group
+	size_t nmoves, moves_size;
+	struct path *paths;
+	size_t npaths, paths_size;
+	int in_path;              // non-zero if the last move extends a path
+	int travel_axes;          // axes set by the group's travels
+	int anchored;             // the first path must remain first
+	int started;              // non-zero once the group's start is known
+	struct move start, end;   // machine position at start and end of group
+	double ztop;              // highest Z of the group's start and travels
+	int reverse;              // permit reversing paths
+	double budget;            // time budget of the improvement, in seconds
+	unsigned long groups;
+	double travel_in, travel_out;
+};
+
+/* serial link analysis pass. The last <blocks> moves, i.e. what GRBL's planner
+ * holds, are kept in ring <ring> starting at <head>, with the sums of their
+ * estimated line sizes and durations. When sending these lines takes longer
+ * than running them, the planner empties: the window starves.
+ */
+struct link_move {
+	struct move m;
+	double bytes;             // estimated size of the line
+	double len;               // path length in mm
+	double time;              // duration in seconds without acceleration
+	double time0;             // same at the original feed rate
+};
+
+struct link {
+	struct pass pass;
+	struct link_move *ring;
+	int blocks, head, count;
+	double bytes, time, time0; // sums over the window
+	struct move prev;         // last received move, for line sizes
+	int has_prev;
+	int fix;                  // lower F in starving windows
+	double cap;               // last F applied by link_fix(), 0 if none
+	unsigned long moves;      // number of moves received
+	unsigned long first, last; // moves of the current starving range
+	int starving;             // non-zero while in a starving range
+	double worst;             // highest demand of the range, in bytes/s
+	unsigned long windows, starved, ranges, capped;
+	double wait_in, wait_out; // estimated time waiting for the link
+};
+
+/* transform settings and modal state. Fields that awk initializes to an empty
+ * string have an associated "known" flag.
+ */
+struct fixup {
+	/* settings */
+	double power, gamma, offset;
+	double maxfeed;
+	const char *maxfeed_str;  // printed as-is when clamping, like awk does
+	double scale, xscale, yscale, zscale;
+	double xoff, yoff, zoff;
+	struct curve curve;       // S mapping
+	int passthrough;          // copy words unaffected by the transform as-is
+	int compact;              // shortest output, see emit_compact_coords()
+	int precision;            // decimals in compact mode
+	double units;             // 10^precision
+	int ij_precision;         // decimals of arc centers, at least 3
+	double ij_units;          // 10^ij_precision
+	double quantum;           // coordinates step in compact mode, 0 if none
+	int xsame, ysame, zsame;  // non-zero if scales leave the axis unchanged
+
+	/* modal state */
+	int g;                    // current motion mode (0..3)
+	int g_known;              // non-zero once a line set the motion mode
+	int plane;                // arc plane (17..19)
+	int m, m_known;           // current spindle mode (3, 4)
+	double s;                 // current spindle value
+	double f; int f_known;    // current feed rate
+	double x, y, z;           // current position
+	int xknown, yknown, zknown;
+	double news; int has_news;           // pending spindle value
+	double newf; int has_newf;           // pending feed rate
+	const char *newf_str;                // maxfeed_str if clamped
+	int restore_g;            // emitter left another motion mode than <g>
+	int restore_rel;          // emitter left G91 active
+
+	/* work bounds */
+	double minx, miny, minz, maxx, maxy, maxz;
+	int bounds_known;
+	double maxs; int maxs_known;
+
+	/* output */
+	char *out;
+	size_t out_len, out_size;
+	struct fmt_entry *fmt_cache;
+	struct block *blk;        // lines pending in columnar form
+	struct pass *passes;      // move pipeline, NULL if disabled
+	struct emitter *emitter;  // last stage of <passes>
+	int verbose;              // report statistics on stderr
+	double tolerance;         // geometric tolerance of path passes, in mm
+	int baud;                 // serial link speed, in bits per second
+	unsigned long long in_lines, in_bytes;
+	unsigned long long out_lines, out_bytes;
+
+	/* copy of the current line in passthrough mode */
+	char *orig;
+	size_t orig_size;
+};
+
+
+/* writes the whole pending output */
+static void flush_output(struct fixup *fx)
+{
+	size_t ofs = 0;
+	ssize_t ret;
+
+	if (fx->verbose) {
+		const char *p = fx->out, *end = fx->out + fx->out_len;
+
+		while ((p = memchr(p, '\n', end - p)) != NULL) {
+			fx->out_lines++;
+			p++;
+		}
+		fx->out_bytes += fx->out_len;
+	}
+
+	while (ofs < fx->out_len) {
+		ret = write(1, fx->out + ofs, fx->out_len - ofs);
+		if (ret <= 0)
+			die(1, "write error\n");
+		ofs += ret;
+	}
+	fx->out_len = 0;
+}
+
+/* makes sure at least <room> bytes are available in the output buffer */
+static inline void reserve_output(struct fixup *fx, size_t room)
+{
+	if (fx->out_size - fx->out_len >= room)
+		return;
+
+	flush_output(fx);
+	if (fx->out_size >= room)
+		return;
+
+	free(fx->out);
+	fx->out_size = room;
+	fx->out = malloc(fx->out_size);
+	if (!fx->out)
+		die(1, "out of memory\n");
+}
+
+/* converts the <len> bytes at <str> to a number like awk does for strings,
+ * i.e. using the longest leading part looking like a decimal number, or zero.
+ */
+static double awk_atof(const char *str, size_t len)
+{
+	const char *p = str, *end = str + len;
+	uint64_t mant = 0;
+	int digits = 0, frac = 0, neg = 0;
+	char tmp[64];
+
+	if (p < end && (*p == '+' || *p == '-'))
+		neg = *p++ == '-';
+
+	while (p < end && isdigit((unsigned char)*p)) {
+		if (mant || *p != '0')
+			digits++;
+		mant = mant * 10 + *p++ - '0';
+	}
+
+	if (p < end && *p == '.') {
+		p++;
+		while (p < end && isdigit((unsigned char)*p)) {
+			if (mant || *p != '0')
+				digits++;
+			mant = mant * 10 + *p++ - '0';
+			frac++;
+		}
+	}
+
+	/* no exponent and few digits: the division by an exact power of ten
+	 * is correctly rounded.
+	 */
+	if ((p == end || (*p != 'e' && *p != 'E')) && digits <= 15 && frac <= 22) {
+		double v = (double)mant / pow10_tab[frac];
+		return neg ? -v : v;
+	}
+
+	/* rare cases, let strtod() deal with it, skipping whatever is not part
+	 * of a number like awk does.
+	 */
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		const char *e = p + 1;
+
+		if (e < end && (*e == '+' || *e == '-'))
+			e++;
+		if (e < end && isdigit((unsigned char)*e)) {
+			for (p = e; p < end && isdigit((unsigned char)*p); p++)
+				;
+		}
+	}
+
+	if ((size_t)(p - str) >= sizeof(tmp))
+		p = str + sizeof(tmp) - 1;
+	memcpy(tmp, str, p - str);
+	tmp[p - str] = 0;
+	return strtod(tmp, NULL);
+}
+
+/* appends the decimal representation of <v> at <o> and returns the new end */
+static inline char *fmt_long(char *o, long v)
+{
+	char tmp[24];
+	unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+
+	if (v < 0)
+		*o++ = '-';
+	while (n)
+		*o++ = tmp[--n];
+	return o;
+}
+
+/* writes into <buf> of <size> bytes the shortest fixed-point representation
+ * of <v> which reads back as <v>, or the closest one with 17 decimals. G-code
+ * does not support exponents. Returns the length.
+ */
+static int fmt_shortest(char *buf, size_t size, double v)
+{
+	int prec, len = 0;
+
+	for (prec = 1; prec <= 17; prec++) {
+		len = snprintf(buf, size, "%.*f", prec, v);
+		if (strtod(buf, NULL) == v)
+			break;
+	}
+	return len;
+}
+
+/* appends number <v> at <o> the way awk converts numbers to strings: integral
+ * values are printed as integers, others using CONVFMT ("%.6g"), or with the
+ * shortest exact representation in passthrough mode. Returns the new end.
+ * Non-integral values are cached since raster jobs repeat them a lot.
+ */
+static char *fmt_num(struct fixup *fx, char *o, double v)
+{
+	struct fmt_entry *e;
+	uint64_t bits;
+	double i = trunc(v);
+
+	if (i == v && i > LONG_MIN && i < LONG_MAX)
+		return fmt_long(o, (long)i);
+
+	if (i == v)
+		return o + sprintf(o, "%.0f", v);
+
+	memcpy(&bits, &v, sizeof(bits));
+	e = &fx->fmt_cache[(bits * 0x9E3779B97F4A7C15ULL) >> 52 & (FMT_CACHE_SIZE - 1)];
+	if (!e->len || e->bits != bits) {
+		e->bits = bits;
+		if (fx->passthrough)
+			e->len = fmt_shortest(e->str, sizeof(e->str), v);
+		else
+			e->len = snprintf(e->str, sizeof(e->str), "%.6g", v);
+	}
+	memcpy(o, e->str, e->len);
+	return o + e->len;
+}
+
+/* returns <v> snapped to the quantization step, if any */
+static inline double quantize(const struct fixup *fx, double v)
+{
+	return fx->quantum > 0 ? round(v / fx->quantum) * fx->quantum : v;
+}
+
+/* returns <v> as an integer number of units of the output precision */
+static inline long long to_units(const struct fixup *fx, double v)
+{
+	return llround(v * fx->units);
+}
+
+/* saves curve <c> to file <name> as one "input output" pair per line, after
+ * a "max" line. Returns non-zero on success, 0 on error.
+ */
+int save_curve(const struct curve *c, const char *name)
+{
+	FILE *f;
+	int i;
+
+	f = fopen(name, "w");
+	if (!f)
+		return 0;
+
+	if (c->loaded)
+		fprintf(f, "# gcode-fixup power curve\n");
+	else
+		fprintf(f, "# gcode-fixup power curve, gamma=%g power=%g offset=%g\n",
+		        c->gamma, c->power, c->offset);
+	fprintf(f, "max %d\n", c->max);
+	for (i = 0; i <= c->max; i++)
+		fprintf(f, "%d %.17g\n", i, c->val[i]);
+
+	return fclose(f) == 0;
+}
+
+/* returns non-zero if <c> is one of the chars after which gcode-fixup splits
+ * words when followed by something else, i.e. [-0-9.]
+ */
+static inline int is_num_char(char c)
+{
+	return (c >= '0' && c <= '9') || c == '-' || c == '.';
+}
+
+static inline int is_blank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n';
+}
+
+/* normalizes a word's value the way gcode-fixup does: leading zeroes after an
+ * optional run of minus signs are removed as long as a digit remains, and a
+ * trailing dot followed only by zeroes is removed. The value is at *<val> for
+ * *<len> bytes, both are updated. The operation is made in place.
+ */
+static inline void strip_value(char **val, size_t *len)
+{
+	char *v = *val;
+	size_t l = *len;
+	size_t i, j, k;
+
+	/* ^([-]*)[0]*([0-9]) -> \1\2 */
+	for (i = 0; i < l && v[i] == '-'; i++)
+		;
+	for (j = i; j < l && v[j] == '0'; j++)
+		;
+	if (j < l && isdigit((unsigned char)v[j]))
+		k = j - i;
+	else if (j > i)
+		k = j - i - 1;
+	else
+		k = 0;
+
+	if (k) {
+		/* move the minus signs right before the remaining digits */
+		memset(v + k, '-', i);
+		v += k;
+		l -= k;
+	}
+
+	/* \.0*$ -> "" */
+	for (j = l; j > 0 && v[j - 1] == '0'; j--)
+		;
+	if (j > 0 && v[j - 1] == '.')
+		l = j - 1;
+
+	*val = v;
+	*len = l;
+}
+
+/* removes comments between parenthesis from the <len> bytes at <line>, then
+ * cuts it at the first semi-colon. The line is compacted in place and its new
+ * end is returned.
+ */
+static char *strip_comments(char *line, size_t len)
+{
+	char *p, *w, *end = line + len;
+
+	for (p = w = line; p < end; p++) {
+		if (*p == '(') {
+			char *c = memchr(p, ')', end - p);
+
+			if (c) {
+				p = c;
+				continue;
+			}
+		}
+		else if (*p == ';')
+			break;
+		*w++ = *p;
+	}
+	return w;
+}
+
+/* looks for the next word between <p> and <end>. Words end on blanks or after
+ * a [-0-9.] followed by something else than [-0-9. ]. Returns the word's end
+ * and sets *<word> to its beginning, or returns NULL if there is none.
+ */
+static inline char *next_word(char *p, char *end, char **word)
+{
+	while (p < end && is_blank(*p))
+		p++;
+	if (p >= end)
+		return NULL;
+
+	*word = p++;
+	while (p < end && !is_blank(*p) && !(is_num_char(p[-1]) && !is_num_char(*p)))
+		p++;
+	return p;
+}
+
+/* returns non-zero if the <len> bytes at <v> normalize to "0" */
+static inline int is_zero_str(const char *v, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len && v[i] == '0'; i++)
+		;
+	if (!i)
+		return 0;
+	if (i < len && v[i++] != '.')
+		return 0;
+	while (i < len && v[i] == '0')
+		i++;
+	return i == len;
+}
+
+/* returns the motion mode if the <len> bytes at <v> normalize to a single
+ * digit from 0 to 3, otherwise -1.
+ */
+static inline int simple_g(const char *v, size_t len)
+{
+	size_t i;
+	int g;
+
+	for (i = 0; i + 1 < len && v[i] == '0' && isdigit((unsigned char)v[i + 1]); i++)
+		;
+	if (i >= len || v[i] < '0' || v[i] > '3')
+		return -1;
+	g = v[i++] - '0';
+	if (i < len && v[i++] != '.')
+		return -1;
+	while (i < len && v[i] == '0')
+		i++;
+	return i == len ? g : -1;
+}
+
+/* applies the pending S and F values, if any, the same way the awk script
+ * does after the last word of a line. Returns B_S and/or B_F for the ones
+ * which have to be emitted.
+ */
+static int apply_pending(struct fixup *fx, int move, int send_s)
+{
+	int ret = 0;
+
+	if (fx->has_news && (send_s || (move && fx->g != 0))) {
+		if (fx->news != fx->s || send_s) {
+			ret |= B_S;
+			/* note: reports the previous value, as the awk script */
+			if (!fx->maxs_known || fx->news > fx->maxs) {
+				fx->maxs = fx->s;
+				fx->maxs_known = 1;
+			}
+		}
+		fx->s = fx->news;
+		fx->has_news = 0;
+	}
+
+	if (fx->has_newf && move && fx->g != 0) {
+		if (!fx->f_known || fx->newf != fx->f)
+			ret |= B_F;
+		fx->f = fx->newf;
+		fx->f_known = 1;
+		fx->has_newf = 0;
+	}
+	return ret;
+}
+
+/* applies the pending S and F values and appends the resulting words, if
+ * any, to the line being built at <o> which started at <start>. Sets
+ * *<printed> if something was emitted. Returns the new end.
+ */
+static char *emit_pending(struct fixup *fx, char *o, char *start, int move, int send_s, int *printed)
+{
+	int words = apply_pending(fx, move, send_s);
+
+	if (words & B_S) {
+		if (o != start)
+			*o++ = ' ';
+		*o++ = 'S';
+		o = fmt_num(fx, o, fx->s);
+		*printed = 1;
+	}
+
+	if (words & B_F) {
+		if (o != start)
+			*o++ = ' ';
+		*o++ = 'F';
+		if (fx->newf_str) {
+			size_t l = strlen(fx->newf_str);
+
+			memcpy(o, fx->newf_str, l);
+			o += l;
+		}
+		else
+			o = fmt_num(fx, o, fx->f);
+		*printed = 1;
+	}
+	return o;
+}
+
+/* sends move <m> to the next stage after pass <pass> */
+static inline void pass_forward(struct fixup *fx, struct pass *pass, const struct move *m)
+{
+	pass->out++;
+	pass->next->in++;
+	pass->next->push(fx, pass->next, m);
+}
+
+/* makes all passes forward their pending moves, in pipeline order */
+void flush_passes(struct fixup *fx)
+{
+	struct pass *pass;
+
+	for (pass = fx->passes; pass; pass = pass->next)
+		if (pass->flush)
+			pass->flush(fx, pass);
+}
+
+/* appends word <cmd> with value <v> at <o>, preceded by a space unless it is
+ * the first one after <start> or in compact mode. Returns the new end.
+ */
+static char *put_word(struct fixup *fx, char *o, const char *start, char cmd, double v)
+{
+	if (!fx->compact && o != start)
+		*o++ = ' ';
+	*o++ = cmd;
+	if (fx->compact)
+		return fmt_units(o, to_units(fx, v), fx->precision);
+	return fmt_num(fx, o, v);
+}
+
+/* compact mode: computes in <n> the positions of move <m> as integer numbers
+ * of units at the output precision, so that relative moves never accumulate
+ * rounding errors. Sets <abs_len> and <rel_len> to the length of the changed
+ * coordinates in absolute and relative form, <rel_len> being -1 if a position
+ * is unknown. Returns the B_X/B_Y/B_Z of the changed ones, 0 if none.
+ */
+static int compact_coords(struct fixup *fx, struct emitter *e, const struct move *m,
+                          long long n[3], int *abs_len, int *rel_len)
+{
+	const double *v[3] = { &m->x, &m->y, &m->z };
+	char tmp[32];
+	int i, chg = 0;
+
+	*abs_len = *rel_len = 0;
+	for (i = 0; i < 3; i++) {
+		if (!(m->axes & (B_X << i)))
+			continue;
+		n[i] = to_units(fx, quantize(fx, *v[i]));
+		if ((e->known & (B_X << i)) && e->n[i] == n[i])
+			continue;
+		chg |= B_X << i;
+		*abs_len += 1 + (fmt_units(tmp, n[i], fx->precision) - tmp);
+		if (!(e->known & (B_X << i)))
+			*rel_len = -1;
+		else if (*rel_len >= 0)
+			*rel_len += 1 + (fmt_units(tmp, n[i] - e->n[i], fx->precision) - tmp);
+	}
+	return chg;
+}
+
+/* compact mode: emits at <o> the motion mode if it changed, and the <chg>
+ * coordinates of move <m> from <n> in absolute or relative (<rel>) form.
+ * Returns the new end.
+ */
+static char *put_compact_coords(struct fixup *fx, struct emitter *e, const struct move *m,
+                                char *o, const long long n[3], int chg, int rel)
+{
+	static const char axis[3] = { 'X', 'Y', 'Z' };
+	int i;
+
+	if (!(e->known & B_G) || e->g != m->g) {
+		*o++ = 'G';
+		*o++ = '0' + m->g;
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (!(chg & (B_X << i)))
+			continue;
+		*o++ = axis[i];
+		o = fmt_units(o, rel ? n[i] - e->n[i] : n[i], fx->precision);
+	}
+	return o;
+}
+
+/* compact mode: appends a line of <abs_len> bytes at <abs> and its relative
+ * form of <rel_len> bytes at <rel> to the run held by emitter <e>.
+ */
+static void emitter_hold(struct emitter *e, const char *abs, size_t abs_len,
+                         const char *rel, size_t rel_len)
+{
+	if (e->held_abs_len + abs_len > e->held_size) {
+		e->held_size = (e->held_abs_len + abs_len) * 2;
+		e->held_abs = realloc(e->held_abs, e->held_size);
+		e->held_rel = realloc(e->held_rel, e->held_size);
+		if (!e->held_abs || !e->held_rel)
+			die(1, "out of memory\n");
+	}
+	memcpy(e->held_abs + e->held_abs_len, abs, abs_len);
+	e->held_abs_len += abs_len;
+	memcpy(e->held_rel + e->held_rel_len, rel, rel_len);
+	e->held_rel_len += rel_len;
+	e->held_gain += abs_len - rel_len;
+}
+
+/* compact mode: writes the run held by emitter <e>, in relative form after
+ * a G91 if <rel> is non-zero, otherwise in absolute form.
+ */
+static void emitter_release(struct fixup *fx, struct emitter *e, int rel)
+{
+	const char *src = rel ? e->held_rel : e->held_abs;
+	size_t len = rel ? e->held_rel_len : e->held_abs_len;
+	char *o;
+
+	if (!e->held_abs_len)
+		return;
+
+	reserve_output(fx, len + 3);
+	o = fx->out + fx->out_len;
+	if (rel) {
+		memcpy(o, "G91", 3);
+		o += 3;
+		e->rel = 1;
+	}
+	memcpy(o, src, len);
+	fx->out_len = o + len - fx->out;
+	e->held_abs_len = e->held_rel_len = 0;
+	e->held_gain = 0;
+}
+
+/* final stage of the pipeline: writes moves as G-code lines, only emitting
+ * the words which change the machine's modal state.
+ */
+static void emitter_push(struct fixup *fx, struct pass *pass, const struct move *m)
+{
+	struct emitter *e = (struct emitter *)pass;
+	char *o, *start, *tail = NULL;
+	long long n[3];
+	int abs_len = 0, rel_len = -1, hold = 0;
+	int chg = 0;
+
+	if (fx->compact) {
+		chg = compact_coords(fx, e, m, n, &abs_len, &rel_len);
+		if (!chg)
+			return;
+		/* a line which makes the held run longer in relative form ends it */
+		hold = !e->rel && rel_len >= 0 && e->held_gain + abs_len - rel_len > 0;
+		if (!hold)
+			emitter_release(fx, e, 0);
+	}
+
+	reserve_output(fx, 256);
+	o = start = fx->out + fx->out_len;
+
+	if (fx->compact) {
+		/* leaving G91 now or later costs the same G90, but coming back
+		 * would cost another G91 and G90, so G91 stays over lines up to
+		 * 3 bytes longer.
+		 */
+		int rel = e->rel && rel_len >= 0 && rel_len < abs_len + 3;
+
+		if (e->rel && !rel) {
+			memcpy(o, "G90", 3);
+			o += 3;
+			e->rel = 0;
+		}
+		o = put_compact_coords(fx, e, m, o, n, chg, rel);
+		tail = o;
+	}
+	else {
+		if (!(e->known & B_G) || e->g != m->g) {
+			*o++ = 'G';
+			*o++ = '0' + m->g;
+		}
+
+		if ((m->axes & B_X) && (!(e->known & B_X) || e->x != m->x)) {
+			o = put_word(fx, o, start, 'X', m->x);
+			chg |= B_X;
+		}
+
+		if ((m->axes & B_Y) && (!(e->known & B_Y) || e->y != m->y)) {
+			o = put_word(fx, o, start, 'Y', m->y);
+			chg |= B_Y;
+		}
+
+		if ((m->axes & B_Z) && (!(e->known & B_Z) || e->z != m->z)) {
+			o = put_word(fx, o, start, 'Z', m->z);
+			chg |= B_Z;
+		}
+
+		/* a move which doesn't go anywhere changes nothing */
+		if (!chg)
+			return;
+	}
+
+	if ((m->axes & B_IJ) && fx->compact) {
+		/* rounding moved the ends, so the center is moved to the closest
+		 * point at equal distance from both, or GRBL rejects the arc.
+		 */
+		double sx = e->n[0] / fx->units, sy = e->n[1] / fx->units;
+		double ex = ((chg & B_X) ? n[0] : e->n[0]) / fx->units;
+		double ey = ((chg & B_Y) ? n[1] : e->n[1]) / fx->units;
+		double cx = m->x0 + m->i, cy = m->y0 + m->j;
+		double mx = (sx + ex) / 2, my = (sy + ey) / 2;
+		double dx = sy - ey, dy = ex - sx;
+		double d2 = dx * dx + dy * dy;
+
+		if (d2 > 0) {
+			double k = ((cx - mx) * dx + (cy - my) * dy) / d2;
+
+			cx = mx + k * dx;
+			cy = my + k * dy;
+		}
+		/* GRBL wants the radius to match within 0.005mm, hence at least
+		 * 3 decimals for the center.
+		 */
+		*o++ = 'I';
+		o = fmt_units(o, llround((cx - sx) * fx->ij_units), fx->ij_precision);
+		*o++ = 'J';
+		o = fmt_units(o, llround((cy - sy) * fx->ij_units), fx->ij_precision);
+	}
+	else if (m->axes & B_IJ) {
+		o = put_word(fx, o, start, 'I', m->i);
+		o = put_word(fx, o, start, 'J', m->j);
+	}
+
+	/* like in the awk script, S and F are only sent with burning moves */
+	if (m->g != 0) {
+		if (!(e->known & B_S) || e->s != m->s) {
+			o = put_word(fx, o, start, 'S', m->s);
+			e->s = m->s;
+		}
+
+		if (!(e->known & B_F) || e->f != m->f) {
+			o = put_word(fx, o, start, 'F', m->f);
+			e->f = m->f;
+		}
+		e->known |= B_S | B_F;
+	}
+
+	*o++ = '\n';
+	if (hold) {
+		/* the relative form is the same line with other coordinates */
+		char rel[256], *r;
+
+		r = put_compact_coords(fx, e, m, rel, n, chg, 1);
+		memcpy(r, tail, o - tail);
+		r += o - tail;
+		emitter_hold(e, start, o - start, rel, r - rel);
+	}
+	else
+		fx->out_len = o - fx->out;
+	e->g = m->g;
+	e->x = m->x;
+	e->y = m->y;
+	e->z = m->z;
+	e->known |= B_G | chg;
+	if (chg & B_X) e->n[0] = n[0];
+	if (chg & B_Y) e->n[1] = n[1];
+	if (chg & B_Z) e->n[2] = n[2];
+
+	/* G91 and the G90 it needs later cost 6 bytes */
+	if (hold && e->held_gain > 6)
+		emitter_release(fx, e, 1);
+}
+
+/* writes the run held by the emitter, the switches not being worth it */
+static void emitter_flush(struct fixup *fx, struct pass *pass)
+{
+	emitter_release(fx, (struct emitter *)pass, 0);
+}
+
+/* before a line processed word by word, notes the modal words needed to
+ * bring the machine from the emitter's state to the one the line expects.
+ * The G90 and motion mode are only restored by the next line which moves,
+ * see restore_modes(). S and F values which the passes changed are only
+ * restored by the next words needing them, so they become pending again.
+ */
+void emitter_sync(struct fixup *fx)
+{
+	struct emitter *e = fx->emitter;
+
+	if (!e)
+		return;
+
+	fx->restore_rel = e->rel;
+	fx->restore_g = (e->known & B_G) && e->g != fx->g;
+
+	if ((e->known & B_S) && e->s != fx->s) {
+		if (!fx->has_news) {
+			fx->news = fx->s;
+			fx->has_news = 1;
+		}
+		fx->s = e->s;
+	}
+
+	if ((e->known & B_F) && fx->f_known && e->f != fx->f) {
+		if (!fx->has_newf) {
+			fx->newf = fx->f;
+			fx->newf_str = NULL;
+			fx->has_newf = 1;
+		}
+		fx->f = e->f;
+	}
+}
+
+/* after a line processed word by word, the machine is in the state the awk
+ * logic tracks, so the emitter starts again from there.
+ */
+void emitter_reset(struct fixup *fx)
+{
+	struct emitter *e = fx->emitter;
+
+	if (!e)
+		return;
+
+	/* the machine stays in the emitter's modes until a line moves */
+	if (!fx->restore_g)
+		e->g = fx->g;
+	e->rel = fx->restore_rel;
+	e->x = fx->x;
+	e->y = fx->y;
+	e->z = fx->z;
+	e->s = fx->s;
+	e->f = fx->f;
+	/* the motion mode is unknown until a line or the emitter sets it */
+	e->known = (e->known & B_G) | B_S;
+	e->known |= fx->g_known ? B_G : 0;
+	e->known |= fx->xknown ? B_X : 0;
+	e->known |= fx->yknown ? B_Y : 0;
+	e->known |= fx->zknown ? B_Z : 0;
+	e->known |= fx->f_known ? B_F : 0;
+	if (fx->compact) {
+		e->n[0] = to_units(fx, quantize(fx, fx->x));
+		e->n[1] = to_units(fx, quantize(fx, fx->y));
+		e->n[2] = to_units(fx, quantize(fx, fx->z));
+	}
+}
+
+/* returns non-zero if move <m> doesn't burn anything */
+static inline int move_is_off(const struct move *m)
+{
+	return m->g == 0 || (m->s <= 0 && !(m->axes & B_SCAN));
+}
+
+/* returns non-zero if move <b> continues move <a> in the same direction */
+static inline int moves_aligned(const struct move *a, const struct move *b)
+{
+	double ax = a->x - a->x0, ay = a->y - a->y0, az = a->z - a->z0;
+	double bx = b->x - b->x0, by = b->y - b->y0, bz = b->z - b->z0;
+	double cx = ay * bz - az * by;
+	double cy = az * bx - ax * bz;
+	double cz = ax * by - ay * bx;
+	double la = ax * ax + ay * ay + az * az;
+	double lb = bx * bx + by * by + bz * bz;
+
+	/* relative tolerance for the rounding errors of computed coordinates */
+	return ax * bx + ay * by + az * bz > 0 &&
+	       cx * cx + cy * cy + cz * cz <= 1e-18 * la * lb;
+}
+
+/* raster run merging: collinear consecutive burning G1 moves with the same S
+ * and F become a single move, and runs of consecutive moves which do not burn
+ * anything at a constant Z become a single rapid.
+ */
+static void merge_push(struct fixup *fx, struct pass *pass, const struct move *m)
+{
+	struct merge *mg = (struct merge *)pass;
+	struct move *c = &mg->cur;
+
+	if (mg->pending && c->x == m->x0 && c->y == m->y0 && c->z == m->z0) {
+		if (move_is_off(c) && move_is_off(m) && c->z0 == c->z && m->z0 == m->z) {
+			c->x = m->x;
+			c->y = m->y;
+			c->s = m->s;
+			c->f = m->f;
+			c->g = 0;
+			c->axes |= m->axes;
+			return;
+		}
+
+		if (c->g == 1 && m->g == 1 && c->s == m->s && c->f == m->f && moves_aligned(c, m)) {
+			c->x = m->x;
+			c->y = m->y;
+			c->z = m->z;
+			c->axes |= m->axes;
+			return;
+		}
+	}
+
+	if (mg->pending)
+		pass_forward(fx, pass, c);
+	*c = *m;
+	mg->pending = 1;
+}
+
+static void merge_flush(struct fixup *fx, struct pass *pass)
+{
+	struct merge *mg = (struct merge *)pass;
+
+	if (mg->pending)
+		pass_forward(fx, pass, &mg->cur);
+	mg->pending = 0;
+}
+
+/* returns the hash of the line of angle step <ka> and constant step <kc> at
+ * height <z> with spindle value <s> and feed rate <f>.
+ */
+static inline uint64_t dedup_hash(int64_t ka, int64_t kc, double z, double s, double f)
+{
+	const double v[3] = { z + 0.0, s + 0.0, f + 0.0 };  // -0 hashes like 0
+	uint64_t h, bits;
+	int i;
+
+	h = (uint64_t)ka * 0x9E3779B97F4A7C15ULL;
+	h = (h ^ (uint64_t)kc) * 0x9E3779B97F4A7C15ULL;
+	for (i = 0; i < 3; i++) {
+		memcpy(&bits, &v[i], sizeof(bits));
+		h = (h ^ bits) * 0x9E3779B97F4A7C15ULL;
+	}
+	return h ^ h >> 32;
+}
+
+/* doubles the size of the line table, or allocates it */
+static void dedup_grow(struct dedup *dd)
+{
+	struct dedup_line *old = dd->lines, *ln;
+	size_t i, j, size = dd->size;
+
+	dd->size = size ? size * 2 : DEDUP_MIN_SLOTS;
+	dd->lines = calloc(dd->size, sizeof(*dd->lines));
+	if (!dd->lines)
+		die(1, "out of memory\n");
+
+	for (i = 0; i < size; i++) {
+		ln = &old[i];
+		if (!ln->count)
+			continue;
+		j = dedup_hash(ln->ka, ln->kc, ln->z, ln->s, ln->f) & (dd->size - 1);
+		while (dd->lines[j].count)
+			j = (j + 1) & (dd->size - 1);
+		dd->lines[j] = *ln;
+	}
+	free(old);
+}
+
+/* returns the line of angle step <ka> and constant step <kc> at move <m>'s
+ * height, spindle value and feed rate, which both ends of <m> are within half
+ * of tolerance <q> of, or NULL if there is none. If <slot> is not NULL, it is
+ * set to the free slot ending the lookup.
+ */
+static struct dedup_line *dedup_find(struct dedup *dd, int64_t ka, int64_t kc,
+                                     const struct move *m, double q,
+                                     struct dedup_line **slot)
+{
+	struct dedup_line *ln;
+	size_t i = dedup_hash(ka, kc, m->z, m->s, m->f) & (dd->size - 1);
+
+	while (1) {
+		ln = &dd->lines[i];
+		if (!ln->count)
+			break;
+		if (ln->ka == ka && ln->kc == kc &&
+		    ln->z == m->z && ln->s == m->s && ln->f == m->f &&
+		    fabs(ln->ux * m->y0 - ln->uy * m->x0 - ln->c) <= q / 2 &&
+		    fabs(ln->ux * m->y - ln->uy * m->x - ln->c) <= q / 2)
+			return ln;
+		i = (i + 1) & (dd->size - 1);
+	}
+	if (slot)
+		*slot = ln;
+	return NULL;
+}
+
+static inline struct dedup_span *dedup_spans(struct dedup_line *ln)
+{
+	return ln->size ? ln->spans : &ln->one;
+}
+
+/* replaces spans <i> to <j> excluded of line <ln> with span <sp> */
+static void dedup_insert(struct dedup_line *ln, uint32_t i, uint32_t j, struct dedup_span sp)
+{
+	uint32_t count = ln->count - (j - i) + 1;
+	struct dedup_span *spans;
+
+	if (count > 1 && count > ln->size) {
+		spans = malloc((ln->size ? ln->size * 2 : 4) * sizeof(*spans));
+		if (!spans)
+			die(1, "out of memory\n");
+		memcpy(spans, dedup_spans(ln), ln->count * sizeof(*spans));
+		if (ln->size)
+			free(ln->spans);
+		ln->spans = spans;
+		ln->size = ln->size ? ln->size * 2 : 4;
+	}
+
+	spans = dedup_spans(ln);
+	memmove(&spans[i + 1], &spans[j], (ln->count - j) * sizeof(*spans));
+	spans[i] = sp;
+	ln->count = count;
+}
+
+/* forwards the part of move <m> between positions <p0> and <p1> out of <len>
+ * along it, as a burning move if <burn> is set, otherwise as a rapid.
+ */
+static void dedup_emit(struct fixup *fx, struct dedup *dd, const struct move *m,
+                       int64_t p0, int64_t p1, int64_t len, int burn)
+{
+	double dx = m->x - m->x0, dy = m->y - m->y0;
+	struct move part = *m;
+
+	/* the ends of <m> are kept exact */
+	if (p0) {
+		part.x0 = m->x0 + dx * p0 / len;
+		part.y0 = m->y0 + dy * p0 / len;
+	}
+	if (p1 < len) {
+		part.x = m->x0 + dx * p1 / len;
+		part.y = m->y0 + dy * p1 / len;
+	}
+	if (!burn) {
+		part.g = 0;
+		dd->saved += hypot(part.x - part.x0, part.y - part.y0);
+	}
+	pass_forward(fx, &dd->pass, &part);
+}
+
+/* duplicate segment elimination: burning straight moves at a constant Z are
+ * looked up by the line they lie on, in either direction, together with their
+ * Z, S and F. A move lies on a line when both of its ends are within half of
+ * the tolerance of it. Lines are hashed by their direction and distance to
+ * the origin rounded to steps, so the neighbour steps are looked up too, the
+ * first half turn step being the neighbour of the last one with the line
+ * reversed. Positions along the line are rounded to the tolerance. The parts
+ * of a move which were already burnt on this line since the last barrier
+ * become rapids along the same path, so that the order of the moves and the
+ * path of the head are unchanged, and --merge or --reorder may then drop
+ * them. Each line keeps its burnt spans, merged, so that memory only grows
+ * with the number of distinct paths.
+ */
+static void dedup_push(struct fixup *fx, struct pass *pass, const struct move *m)
+{
+	struct dedup *dd = (struct dedup *)pass;
+	static const int probe[9][2] = {
+		{ 0, 0 }, { 0, -1 }, { 0, 1 }, { -1, 0 }, { 1, 0 },
+		{ -1, -1 }, { -1, 1 }, { 1, -1 }, { 1, 1 },
+	};
+	double q = fx->tolerance;
+	double a = q / DEDUP_ANGLE_LEN;
+	double ux, uy, d, c;
+	int64_t ka, kc, pa, pc, t, lo, hi, pos, p0, p1;
+	struct dedup_span *spans, sp;
+	struct dedup_line *ln, *slot;
+	uint32_t i, j, k, mid;
+	int fwd, covered, burnt;
+
+	if (m->g != 1 || m->s <= 0 || (m->axes & B_IJ) || m->z != m->z0 ||
+	    !(fmax(fmax(fabs(m->x0), fabs(m->y0)), fmax(fabs(m->x), fabs(m->y))) < DEDUP_MAX_STEPS * q)) {
+		pass_forward(fx, pass, m);
+		return;
+	}
+
+	d = hypot(m->x - m->x0, m->y - m->y0);
+	if (d < q) {
+		pass_forward(fx, pass, m);
+		return;
+	}
+
+	/* unit direction, pointing to positive X, or negative Y if vertical, so
+	 * that its angle is in [-pi/2, pi/2[.
+	 */
+	ux = (m->x - m->x0) / d;
+	uy = (m->y - m->y0) / d;
+	if (ux < 0 || (ux == 0 && uy > 0)) {
+		ux = -ux;
+		uy = -uy;
+	}
+	c = ux * m->y0 - uy * m->x0;
+
+	if (!dd->nangles)
+		dd->nangles = ceil(M_PI / a);
+	ka = floor((atan2(uy, ux) + M_PI / 2) / a);
+	if (ka < 0)
+		ka = 0;
+	if (ka >= dd->nangles)
+		ka = dd->nangles - 1;
+	kc = llround(c / q);
+
+	if (dd->nlines * 4 >= dd->size * 3)
+		dedup_grow(dd);
+
+	slot = NULL;
+	for (ln = NULL, k = 0; !ln && k < 9; k++) {
+		pa = ka + probe[k][0];
+		pc = kc + probe[k][1];
+		if (pa < 0 || pa >= dd->nangles) {
+			/* wraps around the half turn: the line is reversed */
+			pa = (pa + dd->nangles) % dd->nangles;
+			pc = -kc + probe[k][1];
+		}
+		ln = dedup_find(dd, pa, pc, m, q, k ? NULL : &slot);
+	}
+
+	if (!ln) {
+		ln = slot;
+		ln->ux = ux;
+		ln->uy = uy;
+		ln->c = c;
+		ln->ka = ka;
+		ln->kc = kc;
+		ln->z = m->z + 0.0;
+		ln->s = m->s + 0.0;
+		ln->f = m->f + 0.0;
+		dd->nlines++;
+	}
+	spans = dedup_spans(ln);
+
+	/* positions along the line, which may be reversed from the move */
+	lo = llround((ln->ux * m->x0 + ln->uy * m->y0) / q);
+	hi = llround((ln->ux * m->x + ln->uy * m->y) / q);
+	fwd = lo < hi;
+	if (!fwd) {
+		t = lo;
+		lo = hi;
+		hi = t;
+	}
+
+	/* spans <i> to <j> excluded overlap or touch the move */
+	for (i = 0, j = ln->count; i < j; ) {
+		mid = i + (j - i) / 2;
+		if (spans[mid].t1 < lo)
+			i = mid + 1;
+		else
+			j = mid;
+	}
+	covered = 0;
+	for (j = i; j < ln->count && spans[j].t0 <= hi; j++)
+		covered |= spans[j].t1 > lo && spans[j].t0 < hi;
+
+	if (!covered)
+		pass_forward(fx, pass, m);
+	else {
+		/* positions from the move's start, visiting spans in its direction */
+		pos = burnt = 0;
+		for (k = i; k < j; k++) {
+			sp = spans[fwd ? k : i + j - 1 - k];
+			p0 = fwd ? sp.t0 - lo : hi - sp.t1;
+			p1 = fwd ? sp.t1 - lo : hi - sp.t0;
+			if (p0 < pos)
+				p0 = pos;
+			if (p1 > hi - lo)
+				p1 = hi - lo;
+			if (p1 <= p0)
+				continue;
+			if (p0 > pos) {
+				dedup_emit(fx, dd, m, pos, p0, hi - lo, 1);
+				burnt = 1;
+			}
+			dedup_emit(fx, dd, m, p0, p1, hi - lo, 0);
+			pos = p1;
+		}
+		if (pos < hi - lo) {
+			dedup_emit(fx, dd, m, pos, hi - lo, hi - lo, 1);
+			burnt = 1;
+		}
+		if (burnt)
+			dd->shortened++;
+		else
+			dd->removed++;
+	}
+
+	/* the move's span absorbs those it overlaps or touches */
+	sp.t0 = i < j && spans[i].t0 < lo ? spans[i].t0 : lo;
+	sp.t1 = i < j && spans[j - 1].t1 > hi ? spans[j - 1].t1 : hi;
+	dedup_insert(ln, i, j, sp);
+}
+
+/* burnt spans are only compared up to the next barrier */
+static void dedup_flush(struct fixup *fx, struct pass *pass)
+{
+	struct dedup *dd = (struct dedup *)pass;
+	size_t i;
+
+	(void)fx;
+
+	if (!dd->nlines)
+		return;
+
+	for (i = 0; i < dd->size; i++)
+		if (dd->lines[i].size)
+			free(dd->lines[i].spans);
+
+	/* don't keep clearing a large table for small groups */
+	if (dd->size > DEDUP_MIN_SLOTS) {
+		free(dd->lines);
+		dd->lines = NULL;
+		dd->size = 0;
+	}
+	else
+		memset(dd->lines, 0, dd->size * sizeof(*dd->lines));
+	dd->nlines = 0;
+}
+
+static void dedup_report(struct fixup *fx, struct pass *pass)
+{
+	struct dedup *dd = (struct dedup *)pass;
+
+	(void)fx;
+
+	fprintf(stderr, "dedup: %lu moves removed, %lu shortened, %.1fmm not burnt twice\n",
+	        dd->removed, dd->shortened, dd->saved);
+}
+
+/* starts a new simplification run with move <m> */
+static void simplify_start(struct fixup *fx, struct simplify *sp, const struct move *m)
+{
+	double dx = m->x - m->x0, dy = m->y - m->y0;
+	double d = sqrt(dx * dx + dy * dy);
+	double w;
+
+	sp->cur = *m;
+	sp->pending = 1;
+	sp->dmax = d;
+	sp->pt[0][0] = m->x;
+	sp->pt[0][1] = m->y;
+	sp->npts = 1;
+	sp->has_ref = d > fx->tolerance;
+	if (sp->has_ref) {
+		sp->rx = dx / d;
+		sp->ry = dy / d;
+		w = asin(fx->tolerance / d);
+		sp->lo = -w;
+		sp->hi = w;
+	}
+}
+
+/* tries to extend the current run up to the end of move <m>, which must
+ * start where the run ends. The segment from the anchor to the new end must
+ * stay within the tolerance of all accepted points, which is the case when
+ * its direction remains within the cones seen from the anchor around each of
+ * them, and when those farther from the anchor than the new end are within
+ * the tolerance of it. Runs with too many points to check this may not go
+ * backwards. Returns non-zero on success.
+ */
+static int simplify_extend(struct fixup *fx, struct simplify *sp, const struct move *m)
+{
+	struct move *c = &sp->cur;
+	double dx = m->x - c->x0, dy = m->y - c->y0;
+	double d = sqrt(dx * dx + dy * dy);
+	double a, w;
+	int i;
+
+	/* going backwards must not drop the turning points */
+	if (d < sp->dmax) {
+		if (sp->npts > SIMPLIFY_MAX_POINTS)
+			return 0;
+		for (i = 0; i < sp->npts; i++)
+			if (hypot(sp->pt[i][0] - c->x0, sp->pt[i][1] - c->y0) > d &&
+			    hypot(sp->pt[i][0] - m->x, sp->pt[i][1] - m->y) > fx->tolerance)
+				return 0;
+	}
+
+	if (d > fx->tolerance) {
+		w = asin(fx->tolerance / d);
+		if (!sp->has_ref) {
+			sp->rx = dx / d;
+			sp->ry = dy / d;
+			sp->lo = -w;
+			sp->hi = w;
+			sp->has_ref = 1;
+		}
+		else {
+			a = atan2(sp->rx * dy - sp->ry * dx, sp->rx * dx + sp->ry * dy);
+			if (a < sp->lo || a > sp->hi)
+				return 0;
+			if (a - w > sp->lo)
+				sp->lo = a - w;
+			if (a + w < sp->hi)
+				sp->hi = a + w;
+		}
+	}
+
+	if (d > sp->dmax)
+		sp->dmax = d;
+	if (sp->npts < SIMPLIFY_MAX_POINTS) {
+		sp->pt[sp->npts][0] = m->x;
+		sp->pt[sp->npts][1] = m->y;
+	}
+	if (sp->npts <= SIMPLIFY_MAX_POINTS)
+		sp->npts++;
+	c->x = m->x;
+	c->y = m->y;
+	c->axes |= m->axes;
+	return 1;
+}
+
+/* polyline simplification: consecutive G1 moves at a constant Z with the same
+ * S and F are replaced with fewer moves keeping every original point within
+ * the tolerance of the new path. This is a streaming variant of the
+ * Douglas-Peucker algorithm working on one run at a time in constant memory.
+ */
+static void simplify_push(struct fixup *fx, struct pass *pass, const struct move *m)
+{
+	struct simplify *sp = (struct simplify *)pass;
+	struct move *c = &sp->cur;
+
+	if (sp->pending && c->g == 1 && m->g == 1 &&
+	    c->s == m->s && c->f == m->f &&
+	    c->x == m->x0 && c->y == m->y0 && c->z == m->z0 && m->z0 == m->z &&
+	    simplify_extend(fx, sp, m))
+		return;
+
+	if (sp->pending)
+		pass_forward(fx, pass, c);
+
+	if (m->g == 1 && m->z0 == m->z)
+		simplify_start(fx, sp, m);
+	else {
+		pass_forward(fx, pass, m);
+		sp->pending = 0;
+	}
+}
+
+static void simplify_flush(struct fixup *fx, struct pass *pass)
+{
+	struct simplify *sp = (struct simplify *)pass;
+
+	if (sp->pending)
+		pass_forward(fx, pass, &sp->cur);
+	sp->pending = 0;
+}
+
+/* estimates how long the planner waits for the serial link during move <m>
+ * of length <len>, which is the time needed to receive the next line minus
+ * the move's duration. Rapids are ignored as their speed is not known.
+ */
+static double link_wait(const struct fixup *fx, const struct move *m, double len)
+{
+	double wait = LINK_LINE_BYTES * 10.0 / fx->baud;
+
+	if (m->g == 0 || m->f <= 0)
+		return 0;
+	wait -= len * 60.0 / m->f;
+	return wait > 0 ? wait : 0;
+}
+
+/* returns the length of the straight move <m> */
+static inline double move_len(const struct move *m)
+{
+	double dx = m->x - m->x0, dy = m->y - m->y0, dz = m->z - m->z0;
+
+	return sqrt(dx * dx + dy * dy + dz * dz);
+}
+
+/* forwards straight move <m> from the arc fitting pass */
+static void arcs_forward(struct fixup *fx, struct arcs *ar, const struct move *m)
+{
+	ar->wait_out += link_wait(fx, m, move_len(m));
+	pass_forward(fx, &ar->pass, m);
+}
+
+/* checks if the <n> moves of the run lie on a single arc, and if so, sets the
+ * arc's center, radius, sweep and direction. The circle passes through the
+ * first, middle and last points, and all points and chord middles must be
+ * within the tolerance of it. The chords must all turn the same way.
+ */
+static int arcs_fit(struct fixup *fx, struct arcs *ar, int n)
+{
+	const struct move *run = ar->run;
+	double ax = run[0].x0, ay = run[0].y0;
+	double bx = run[n / 2].x0, by = run[n / 2].y0;
+	double cx = run[n - 1].x, cy = run[n - 1].y;
+	double tol = fx->tolerance;
+	double d, ux, uy, r, sweep = 0;
+	double px, py, qx, qy, cross, a;
+	int i, ccw = 0;
+
+	/* center from the perpendicular bisectors of AB and AC */
+	bx -= ax; by -= ay;
+	cx -= ax; cy -= ay;
+	d = 2 * (bx * cy - by * cx);
+	if (d == 0)
+		return 0;
+	ux = (cy * (bx * bx + by * by) - by * (cx * cx + cy * cy)) / d;
+	uy = (bx * (cx * cx + cy * cy) - cx * (bx * bx + by * by)) / d;
+	r = sqrt(ux * ux + uy * uy);
+	if (r > ARC_MAX_RADIUS)
+		return 0;
+	ux += ax;
+	uy += ay;
+
+	for (i = 0; i < n; i++) {
+		px = run[i].x0 - ux; py = run[i].y0 - uy;
+		qx = run[i].x - ux;  qy = run[i].y - uy;
+		if (fabs(sqrt(qx * qx + qy * qy) - r) > tol)
+			return 0;
+		if (fabs(hypot((px + qx) / 2, (py + qy) / 2) - r) > tol)
+			return 0;
+
+		cross = px * qy - py * qx;
+		if (i == 0)
+			ccw = cross > 0;
+		else if ((cross > 0) != ccw)
+			return 0;
+		a = atan2(fabs(cross), px * qx + py * qy);
+		if (a <= 0)
+			return 0;
+		sweep += a;
+	}
+
+	if (sweep >= 2 * M_PI)
+		return 0;
+
+	ar->cx = ux;
+	ar->cy = uy;
+	ar->r = r;
+	ar->sweep = sweep;
+	ar->ccw = ccw;
+	return 1;
+}
+
+/* emits the <n> first moves of the run, as an arc if they were fitted to one,
+ * and keeps the remaining ones.
+ */
+static void arcs_emit(struct fixup *fx, struct arcs *ar, int n)
+{
+	struct move arc;
+	int i;
+
+	if (n >= ARC_MIN_MOVES) {
+		arc = ar->run[0];
+		arc.x = ar->run[n - 1].x;
+		arc.y = ar->run[n - 1].y;
+		arc.i = ar->cx - arc.x0;
+		arc.j = ar->cy - arc.y0;
+
+		/* tiny offsets would be printed with an exponent, which GRBL
+		 * does not parse, and are far below the radius tolerance.
+		 */
+		if (fabs(arc.i) < 1e-4)
+			arc.i = 0;
+		if (fabs(arc.j) < 1e-4)
+			arc.j = 0;
+		arc.g = ar->ccw ? 3 : 2;
+		for (i = 1; i < n; i++)
+			arc.axes |= ar->run[i].axes;
+		arc.axes |= B_IJ;
+		ar->arcs++;
+		ar->wait_out += link_wait(fx, &arc, ar->r * ar->sweep);
+		pass_forward(fx, &ar->pass, &arc);
+	}
+	else {
+		for (i = 0; i < n; i++)
+			arcs_forward(fx, ar, &ar->run[i]);
+	}
+
+	ar->count -= n;
+	memmove(ar->run, ar->run + n, ar->count * sizeof(*ar->run));
+}
+
+/* arc fitting: runs of consecutive G1 moves in the XY plane at a constant Z
+ * with the same S and F whose points lie on a circle within the tolerance are
+ * replaced with G2/G3 arcs. Fitting works on transformed coordinates so the
+ * arcs remain exact whatever the scale. The lookahead is bounded to
+ * ARC_MAX_MOVES moves, and each new move costs one fit over the run.
+ */
+static void arcs_push(struct fixup *fx, struct pass *pass, const struct move *m)
+{
+	struct arcs *ar = (struct arcs *)pass;
+	const struct move *last = ar->count ? &ar->run[ar->count - 1] : NULL;
+
+	ar->wait_in += link_wait(fx, m, move_len(m));
+
+	if (m->g != 1 || m->z0 != m->z || fx->plane != 17) {
+		arcs_emit(fx, ar, ar->count);
+		arcs_forward(fx, ar, m);
+		return;
+	}
+
+	if (last && (last->s != m->s || last->f != m->f ||
+	             last->x != m->x0 || last->y != m->y0 || last->z != m->z0))
+		arcs_emit(fx, ar, ar->count);
+
+	ar->run[ar->count++] = *m;
+	while (ar->count >= 2 && !arcs_fit(fx, ar, ar->count)) {
+		/* the new move doesn't continue the arc: emit the arc if it
+		 * is long enough, or drop the run's oldest moves until the
+		 * remaining ones may still be part of one.
+		 */
+		if (ar->count - 1 >= ARC_MIN_MOVES)
+			arcs_emit(fx, ar, ar->count - 1);
+		else
+			arcs_emit(fx, ar, 1);
+	}
+
+	if (ar->count == ARC_MAX_MOVES)
+		arcs_emit(fx, ar, ar->count);
+}
+
+static void arcs_flush(struct fixup *fx, struct pass *pass)
+{
+	struct arcs *ar = (struct arcs *)pass;
+
+	arcs_emit(fx, ar, ar->count);
+}
+
+static void arcs_report(struct fixup *fx, struct pass *pass)
+{
+	struct arcs *ar = (struct arcs *)pass;
+
+	fprintf(stderr, "arcs: %lu arcs, compression %.2f:1, est. planner starvation %.2fs -> %.2fs at %d bps\n",
+	        ar->arcs, pass->out ? (double)pass->in / pass->out : 1.0,
+	        ar->wait_in, ar->wait_out, fx->baud);
+}
+
+/* estimates the duration of straight move <m> in seconds, ignoring the
+ * acceleration. Rapids are assumed to run at the max feed rate.
+ */
+static double move_time(const struct fixup *fx, const struct move *m)
+{
+	double f = m->g == 0 ? fx->maxfeed : m->f;
+
+	return f > 0 ? move_len(m) * 60.0 / f : 0;
+}
+
+/* forwards move <m> from the trimming pass */
+static void trim_forward(struct fixup *fx, struct trim *tr, const struct move *m)
+{
+	tr->time_out += move_time(fx, m);
+	tr->cur = *m;
+	tr->cur_known = 1;
+	pass_forward(fx, &tr->pass, m);
+}
+
+/* brings the machine to (<x>,<y>) at the current height with a rapid. Until
+ * the pass forwarded a move, the start position is only the parser's guess,
+ * so the travel is always sent and the emitter drops it if it is useless.
+ */
+static void trim_travel(struct fixup *fx, struct trim *tr, double x, double y)
+{
+	struct move t = tr->cur;
+
+	if (tr->cur_known && t.x == x && t.y == y)
+		return;
+	t.x0 = t.x;
+	t.y0 = t.y;
+	t.z0 = t.z;
+	t.x = x;
+	t.y = y;
+	t.g = 0;
+	t.axes = B_X | B_Y;
+	trim_forward(fx, tr, &t);
+}
+
+/* appends move <m> to the array <*moves> of <*count> moves out of <*size> */
+static void trim_append(struct move **moves, size_t *count, size_t *size, const struct move *m)
+{
+	if (*count == *size) {
+		*size = *size ? *size * 2 : 1024;
+		*moves = realloc(*moves, *size * sizeof(**moves));
+		if (!*moves)
+			die(1, "out of memory\n");
+	}
+	(*moves)[(*count)++] = *m;
+}
+
+/* forwards the pending moves burning nothing unchanged */
+static void trim_gap_forward(struct fixup *fx, struct trim *tr)
+{
+	size_t i;
+
+	/* moves forwarded unchanged from the start need no travel */
+	if (tr->gap_count && tr->cur_known)
+		trim_travel(fx, tr, tr->gap[0].x0, tr->gap[0].y0);
+	for (i = 0; i < tr->gap_count; i++)
+		trim_forward(fx, tr, &tr->gap[i]);
+	tr->gap_count = 0;
+	tr->gap_blank = 0;
+}
+
+/* drops the pending moves burning nothing, which only led to or from raster
+ * rows, counting their rows as blank ones.
+ */
+static void trim_gap_drop(struct trim *tr)
+{
+	tr->rows += tr->gap_blank;
+	tr->blank += tr->gap_blank;
+	tr->gap_count = 0;
+	tr->gap_blank = 0;
+}
+
+/* forwards the pending moves burning nothing, then the <n> moves at <m>,
+ * all unchanged, as they are not part of a raster job.
+ */
+static void trim_keep(struct fixup *fx, struct trim *tr, const struct move *m, size_t n)
+{
+	size_t i;
+
+	trim_gap_forward(fx, tr);
+	if (tr->cur_known)
+		trim_travel(fx, tr, m[0].x0, m[0].y0);
+	for (i = 0; i < n; i++)
+		trim_forward(fx, tr, &m[i]);
+	tr->raster = 0;
+}
+
+/* emits the pending row. Rows burning nothing are kept with the moves of the
+ * gap. Only runs of at least TRIM_MIN_MOVES moves which change S, or follow a
+ * raster row, are raster rows, other ones are forwarded unchanged. Raster
+ * rows drop the gap, and are emitted without their laser-off ends, in the
+ * direction which starts closest to the current position, and extended with
+ * laser-off moves of the overscan length. When the acceleration is known, the
+ * extensions are made at least as long as the distance needed to reach the
+ * row's highest feed rate from rest, v^2/2a, so that no pixel is burnt while
+ * the head is still accelerating or decelerating.
+ */
+static void trim_row(struct fixup *fx, struct trim *tr)
+{
+	struct move *row = tr->row;
+	double dir, a, b, ov = tr->overscan;
+	struct move m;
+	long first, last, i, count = tr->count;
+	int rev, changes;
+
+	if (!count)
+		return;
+
+	for (first = 0; first < count && row[first].s <= 0; first++)
+		;
+	for (last = count - 1; last >= 0 && row[last].s <= 0; last--)
+		;
+	for (changes = 0, i = 1; i < count; i++)
+		changes += row[i].s != row[i - 1].s;
+	tr->count = 0;
+
+	if (first > last) {
+		for (i = 0; i < count; i++)
+			trim_append(&tr->gap, &tr->gap_count, &tr->gap_size, &row[i]);
+		tr->gap_blank++;
+		return;
+	}
+
+	if (count < TRIM_MIN_MOVES || (!changes && !tr->raster)) {
+		trim_keep(fx, tr, row, count);
+		return;
+	}
+
+	trim_gap_drop(tr);
+	tr->rows++;
+	tr->raster = 1;
+
+	if (tr->accel > 0) {
+		double v = 0;
+
+		for (i = first; i <= last; i++)
+			if (row[i].f > v)
+				v = row[i].f;
+		v /= 60.0;
+		if (v * v / (2 * tr->accel) > ov)
+			ov = v * v / (2 * tr->accel);
+	}
+
+	/* burning span from <a> to <b>, <dir> being the row's direction */
+	dir = row[first].x > row[first].x0 ? 1.0 : -1.0;
+	a = row[first].x0 - dir * ov;
+	b = row[last].x + dir * ov;
+	rev = fabs(tr->cur.x - b) < fabs(tr->cur.x - a);
+	if (rev) {
+		double t = a;
+
+		a = b;
+		b = t;
+		dir = -dir;
+	}
+
+	trim_travel(fx, tr, a, row[first].y);
+
+	m = rev ? row[last] : row[first];
+	m.axes = B_X | B_SCAN;
+	m.s = 0;
+	if (ov > 0) {
+		m.x0 = a;
+		m.x = a + dir * ov;
+		trim_forward(fx, tr, &m);
+	}
+
+	for (i = 0; i <= last - first; i++) {
+		if (!rev) {
+			m = row[first + i];
+		}
+		else {
+			m = row[last - i];
+			m.x0 = row[last - i].x;
+			m.x = row[last - i].x0;
+		}
+		/* keep the speed constant across blank pixels as well */
+		if (ov > 0)
+			m.axes |= B_SCAN;
+		trim_forward(fx, tr, &m);
+	}
+
+	if (ov > 0) {
+		m.x0 = m.x;
+		m.x = b;
+		m.s = 0;
+		m.axes = B_X | B_SCAN;
+		trim_forward(fx, tr, &m);
+	}
+}
+
+/* raster trimming: rows of horizontal moves are trimmed to their burning
+ * span and may run in either direction, and blank rows are skipped. Moves
+ * which do not burn nor change Z are held in the gap, and only matter through
+ * their end position if they lead to or from a raster row: they are then
+ * replaced with a rapid to the start of the next move which needs it.
+ * Otherwise they are forwarded unchanged, like all moves of vector jobs. Only
+ * one row and the following gap are kept in memory.
+ */
+static void trim_push(struct fixup *fx, struct pass *pass, const struct move *m)
+{
+	struct trim *tr = (struct trim *)pass;
+	const struct move *prev = tr->count ? &tr->row[tr->count - 1] : NULL;
+	int horiz = m->g == 1 && m->y0 == m->y && m->z0 == m->z && m->x0 != m->x;
+
+	if (!tr->started) {
+		tr->cur = *m;
+		tr->cur.x = m->x0;
+		tr->cur.y = m->y0;
+		tr->cur.z = m->z0;
+		tr->cur_known = 0;
+		tr->started = 1;
+	}
+	tr->time_in += move_time(fx, m);
+	tr->last = *m;
+
+	if (prev && !(horiz && m->y == prev->y && m->x0 == prev->x &&
+	              (m->x > m->x0) == (prev->x > prev->x0)))
+		trim_row(fx, tr);
+
+	if (horiz) {
+		trim_append(&tr->row, &tr->count, &tr->size, m);
+		return;
+	}
+
+	if ((m->g == 0 || m->s <= 0) && m->z0 == m->z) {
+		trim_append(&tr->gap, &tr->gap_count, &tr->gap_size, m);
+		return;
+	}
+
+	trim_keep(fx, tr, m, 1);
+}
+
+/* emits the pending row and gap, and brings the machine back where the input
+ * left it as the next lines rely on it.
+ */
+static void trim_flush(struct fixup *fx, struct pass *pass)
+{
+	struct trim *tr = (struct trim *)pass;
+
+	trim_row(fx, tr);
+	if (tr->raster)
+		trim_gap_drop(tr);
+	else
+		trim_gap_forward(fx, tr);
+	if (tr->started)
+		trim_travel(fx, tr, tr->last.x, tr->last.y);
+	tr->started = 0;
+	tr->raster = 0;
+}
+
+static void trim_report(struct fixup *fx, struct pass *pass)
+{
+	struct trim *tr = (struct trim *)pass;
+
+	(void)fx;
+
+	fprintf(stderr, "trim: %lu rows, %lu blank, est. time %.1fs -> %.1fs (%.1fs saved)\n",
+	        tr->rows, tr->blank, tr->time_in, tr->time_out, tr->time_in - tr->time_out);
+}
+
+/* emits the pending run. The energy laser-preview models for each pixel is
+ * proportional to S / F, so scaling both S and F by the same ratio leaves
+ * the marking unchanged while the head runs faster. The ratio raises the
+ * run's highest spindle value to the allowed max, unless the max feed rate
+ * is reached first. F is kept integral and S is rounded like the curve does.
+ */
+static void speed_run(struct fixup *fx, struct speed *sp)
+{
+	struct move *run = sp->run;
+	double maxs = 0, f, nf, k;
+	size_t i;
+
+	if (!sp->count)
+		return;
+
+	f = run[0].f;
+	for (i = 0; i < sp->count; i++)
+		if (run[i].s > maxs)
+			maxs = run[i].s;
+
+	nf = fx->maxfeed;
+	if (maxs > 0 && f * sp->max_s / maxs < nf)
+		nf = f * sp->max_s / maxs;
+	nf = floor(nf);
+
+	sp->runs++;
+	if (f > 0 && nf > f) {
+		k = nf / f;
+		sp->faster++;
+		for (i = 0; i < sp->count; i++) {
+			run[i].f = nf;
+			run[i].s = floor(run[i].s * k + 0.5);
+			if (run[i].s > sp->max_s)
+				run[i].s = floor(sp->max_s);
+		}
+	}
+
+	for (i = 0; i < sp->count; i++) {
+		sp->time_out += move_time(fx, &run[i]);
+		pass_forward(fx, &sp->pass, &run[i]);
+	}
+	sp->count = 0;
+}
+
+/* feed rate optimizer: runs of straight or arc moves with the same feed rate
+ * are sped up as much as the spindle headroom permits. Rapids and moves
+ * changing Z, which might be cutting, are left untouched. Only one run is
+ * kept in memory.
+ */
+static void speed_push(struct fixup *fx, struct pass *pass, const struct move *m)
+{
+	struct speed *sp = (struct speed *)pass;
+
+	sp->time_in += move_time(fx, m);
+
+	if (sp->count && (m->f != sp->run[0].f || sp->count == SPEED_RUN_MAX))
+		speed_run(fx, sp);
+
+	if (m->g == 0 || m->z0 != m->z) {
+		speed_run(fx, sp);
+		sp->time_out += move_time(fx, m);
+		pass_forward(fx, pass, m);
+		return;
+	}
+
+	if (sp->count == sp->size) {
+		sp->size = sp->size ? sp->size * 2 : 1024;
+		sp->run = realloc(sp->run, sp->size * sizeof(*sp->run));
+		if (!sp->run)
+			die(1, "out of memory\n");
+	}
+	sp->run[sp->count++] = *m;
+}
+
+static void speed_flush(struct fixup *fx, struct pass *pass)
+{
+	speed_run(fx, (struct speed *)pass);
+}
+
+static void speed_report(struct fixup *fx, struct pass *pass)
+{
+	struct speed *sp = (struct speed *)pass;
+
+	(void)fx;
+
+	fprintf(stderr, "speed: %lu runs, %lu faster, est. time %.1fs -> %.1fs (%.1fs saved)\n",
+	        sp->runs, sp->faster, sp->time_in, sp->time_out, sp->time_in - sp->time_out);
+}
+
+/* returns the time in seconds from an arbitrary origin */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the path entry and exit points, depending on its direction */
+static inline double path_inx(const struct path *p)  { return p->rev ? p->x1 : p->x0; }
+static inline double path_iny(const struct path *p)  { return p->rev ? p->y1 : p->y0; }
+static inline double path_outx(const struct path *p) { return p->rev ? p->x0 : p->x1; }
+static inline double path_outy(const struct path *p) { return p->rev ? p->y0 : p->y1; }
+
+/* Spatial index of path ends for the nearest neighbour searches. Each path
+ * has one or two entries (2 * path + 1 for its end), stored per square cell.
+ * Entries of used paths are removed lazily while scanning.
+ */
+struct grid {
+	double minx, miny, cell;
+	int w, h;
+	size_t *start;            // first entry of each cell, w * h + 1 entries
+	size_t *len;              // entries still present in each cell
+	size_t *ent;
+};
+
+/* returns the coordinates of grid entry <e> */
+static inline void grid_point(const struct path *paths, size_t e, double *x, double *y)
+{
+	const struct path *p = &paths[e / 2];
+
+	*x = (e & 1) ? p->x1 : p->x0;
+	*y = (e & 1) ? p->y1 : p->y0;
+}
+
+/* returns the index of the cell containing (<x>,<y>), clamped to the grid */
+static inline void grid_cell(const struct grid *g, double x, double y, int *cx, int *cy)
+{
+	*cx = (x - g->minx) / g->cell;
+	*cy = (y - g->miny) / g->cell;
+	*cx = *cx < 0 ? 0 : *cx >= g->w ? g->w - 1 : *cx;
+	*cy = *cy < 0 ? 0 : *cy >= g->h ? g->h - 1 : *cy;
+}
+
+/* indexes the ends of the <n> paths, with about two entries per cell */
+static void grid_build(struct grid *g, const struct path *paths, size_t n)
+{
+	double minx = HUGE_VAL, miny = HUGE_VAL, maxx = -HUGE_VAL, maxy = -HUGE_VAL;
+	double x, y;
+	size_t i, e, cells, total = 0;
+	int cx, cy;
+
+	for (i = 0; i < n; i++) {
+		minx = fmin(minx, fmin(paths[i].x0, paths[i].x1));
+		miny = fmin(miny, fmin(paths[i].y0, paths[i].y1));
+		maxx = fmax(maxx, fmax(paths[i].x0, paths[i].x1));
+		maxy = fmax(maxy, fmax(paths[i].y0, paths[i].y1));
+		total += paths[i].can_rev ? 2 : 1;
+	}
+
+	g->minx = minx;
+	g->miny = miny;
+	g->cell = sqrt((maxx - minx) * (maxy - miny) * 2 / total);
+	if (!(g->cell > 0))
+		g->cell = fmax(maxx - minx, maxy - miny) + 1;
+	g->w = (maxx - minx) / g->cell + 1;
+	g->h = (maxy - miny) / g->cell + 1;
+	cells = (size_t)g->w * g->h;
+
+	g->start = calloc(cells + 1, sizeof(*g->start));
+	g->len = calloc(cells, sizeof(*g->len));
+	g->ent = malloc(total * sizeof(*g->ent));
+	if (!g->start || !g->len || !g->ent)
+		die(1, "out of memory\n");
+
+	/* count entries per cell, then place them */
+	for (e = 0; e < 2 * n; e++) {
+		if ((e & 1) && !paths[e / 2].can_rev)
+			continue;
+		grid_point(paths, e, &x, &y);
+		grid_cell(g, x, y, &cx, &cy);
+		g->len[(size_t)cy * g->w + cx]++;
+	}
+
+	for (i = 0; i < cells; i++)
+		g->start[i + 1] = g->start[i] + g->len[i];
+
+	memset(g->len, 0, cells * sizeof(*g->len));
+	for (e = 0; e < 2 * n; e++) {
+		if ((e & 1) && !paths[e / 2].can_rev)
+			continue;
+		grid_point(paths, e, &x, &y);
+		grid_cell(g, x, y, &cx, &cy);
+		i = (size_t)cy * g->w + cx;
+		g->ent[g->start[i] + g->len[i]++] = e;
+	}
+}
+
+static void grid_free(struct grid *g)
+{
+	free(g->start);
+	free(g->len);
+	free(g->ent);
+}
+
+/* finds up to <k> entries nearest to (<x>,<y>) whose path is not marked in
+ * <used> (which may be NULL) nor equal to <skip>, and stores them in <res>
+ * by increasing distance. Entries of used paths met on the way are removed.
+ * Returns the number of entries found.
+ */
+static int grid_nearest(struct grid *g, const struct path *paths, const char *used,
+                        size_t skip, double x, double y, size_t *res, int k)
+{
+	double dist[REORDER_NEIGHBOURS];  // squared
+	double px, py, d;
+	size_t c, i, e;
+	int cx, cy, r, tx, ty, found = 0, j;
+
+	grid_cell(g, x, y, &cx, &cy);
+	for (r = 0; r < g->w || r < g->h; r++) {
+		for (ty = cy - r; ty <= cy + r; ty++) {
+			if (ty < 0 || ty >= g->h)
+				continue;
+			for (tx = cx - r; tx <= cx + r; tx++) {
+				/* only the ring's border is new */
+				if (ty != cy - r && ty != cy + r && tx != cx - r && tx != cx + r)
+					tx = cx + r;
+				if (tx < 0 || tx >= g->w)
+					continue;
+
+				c = (size_t)ty * g->w + tx;
+				for (i = 0; i < g->len[c]; i++) {
+					e = g->ent[g->start[c] + i];
+					if (used && used[e / 2]) {
+						g->ent[g->start[c] + i--] = g->ent[g->start[c] + --g->len[c]];
+						continue;
+					}
+					if (e / 2 == skip)
+						continue;
+					grid_point(paths, e, &px, &py);
+					d = (px - x) * (px - x) + (py - y) * (py - y);
+					if (found == k && d >= dist[k - 1])
+						continue;
+					/* insertion in the sorted results */
+					j = found < k ? found++ : k - 1;
+					for (; j > 0 && dist[j - 1] > d; j--) {
+						dist[j] = dist[j - 1];
+						res[j] = res[j - 1];
+					}
+					dist[j] = d;
+					res[j] = e;
+				}
+			}
+		}
+		/* entries beyond this ring are at least r cells away */
+		if (found == k && dist[k - 1] <= (r * g->cell) * (r * g->cell))
+			break;
+	}
+	return found;
+}
+
+/* returns the travel length from the group's start through all paths in
+ * <order>, to the group's end.
+ */
+static double reorder_travel(const struct reorder *ro, const size_t *order, size_t n)
+{
+	double x = ro->start.x0, y = ro->start.y0, len = 0;
+	const struct path *p;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		p = &ro->paths[order[i]];
+		len += hypot(path_inx(p) - x, path_iny(p) - y);
+		x = path_outx(p);
+		y = path_outy(p);
+	}
+	return len + hypot(ro->end.x - x, ro->end.y - y);
+}
+
+/* builds an initial order by always going to the nearest remaining path */
+static void reorder_nearest(struct reorder *ro, struct grid *g, size_t *order)
+{
+	double x = ro->start.x0, y = ro->start.y0;
+	char *used = calloc(ro->npaths, 1);
+	struct path *p;
+	size_t i, e;
+
+	if (!used)
+		die(1, "out of memory\n");
+
+	i = 0;
+	if (ro->anchored) {
+		p = &ro->paths[0];
+		used[0] = 1;
+		order[i++] = 0;
+		x = p->x1;
+		y = p->y1;
+	}
+
+	for (; i < ro->npaths; i++) {
+		grid_nearest(g, ro->paths, used, SIZE_MAX, x, y, &e, 1);
+		p = &ro->paths[e / 2];
+		p->rev = e & 1;
+		used[e / 2] = 1;
+		order[i] = e / 2;
+		x = path_outx(p);
+		y = path_outy(p);
+	}
+	free(used);
+}
+
+/* travel length between positions <a> and <a> + 1 of <order>, where -1 is
+ * the group's start and <n> its end.
+ */
+static inline double link_len(const struct reorder *ro, const size_t *order, size_t n, long a)
+{
+	double x0, y0, x1, y1;
+
+	if (a < 0) {
+		x0 = ro->start.x0;
+		y0 = ro->start.y0;
+	}
+	else {
+		x0 = path_outx(&ro->paths[order[a]]);
+		y0 = path_outy(&ro->paths[order[a]]);
+	}
+
+	if (a + 1 >= (long)n) {
+		x1 = ro->end.x;
+		y1 = ro->end.y;
+	}
+	else {
+		x1 = path_inx(&ro->paths[order[a + 1]]);
+		y1 = path_iny(&ro->paths[order[a + 1]]);
+	}
+	return hypot(x1 - x0, y1 - y0);
+}
+
+/* improves the order with 2-opt moves (reversing a sequence of paths, only
+ * if they can all be reversed) and Or-opt moves (moving up to 3 consecutive
+ * paths elsewhere), trying only the neighbours of each path, until no move
+ * helps anymore or the time budget is exhausted.
+ */
+static void reorder_improve(struct reorder *ro, struct grid *g, size_t *order)
+{
+	size_t n = ro->npaths;
+	size_t *nbr = malloc(n * REORDER_NEIGHBOURS * sizeof(*nbr));
+	size_t *pos = malloc(n * sizeof(*pos));
+	size_t tmp[3];
+	double deadline;
+	double before, after;
+	long i, j, a, b, k, len, dst;
+	struct path *p;
+	int improved = 1, cnt, c;
+
+	if (!nbr || !pos)
+		die(1, "out of memory\n");
+
+	/* neighbours of both ends as the path may be reversed */
+	for (i = 0; i < (long)n; i++) {
+		size_t *res = nbr + i * REORDER_NEIGHBOURS;
+
+		p = &ro->paths[i];
+		cnt = grid_nearest(g, ro->paths, NULL, i, p->x1, p->y1, res, REORDER_NEIGHBOURS / 2);
+		if (p->can_rev)
+			cnt += grid_nearest(g, ro->paths, NULL, i, p->x0, p->y0, res + cnt, REORDER_NEIGHBOURS / 2);
+		for (c = cnt; c < REORDER_NEIGHBOURS; c++)
+			res[c] = SIZE_MAX;
+		pos[order[i]] = i;
+	}
+
+	deadline = now() + ro->budget;
+	while (improved && now() < deadline) {
+		improved = 0;
+		for (i = 0; i < (long)n; i++) {
+			if (!(i & 255) && now() >= deadline)
+				break;
+
+			for (c = 0; c < REORDER_NEIGHBOURS; c++) {
+				if (nbr[order[i] * REORDER_NEIGHBOURS + c] == SIZE_MAX)
+					break;
+				j = pos[nbr[order[i] * REORDER_NEIGHBOURS + c] / 2];
+
+				/* 2-opt: reverse positions a+1..b, so that the exit
+				 * of a connects to the exit of b.
+				 */
+				a = i < j ? i : j;
+				b = i < j ? j : i;
+				if (ro->reverse && a != b) {
+					double ax = path_outx(&ro->paths[order[a]]), ay = path_outy(&ro->paths[order[a]]);
+					double bx = path_outx(&ro->paths[order[b]]), by = path_outy(&ro->paths[order[b]]);
+					double cx = path_inx(&ro->paths[order[a + 1]]), cy = path_iny(&ro->paths[order[a + 1]]);
+					double nx, ny;
+
+					before = link_len(ro, order, n, a) + link_len(ro, order, n, b);
+					after = hypot(bx - ax, by - ay);
+					if (b + 1 < (long)n) {
+						nx = path_inx(&ro->paths[order[b + 1]]);
+						ny = path_iny(&ro->paths[order[b + 1]]);
+					}
+					else {
+						nx = ro->end.x;
+						ny = ro->end.y;
+					}
+					after += hypot(nx - cx, ny - cy);
+
+					for (k = a + 1; after < before - 1e-9 && k <= b; k++)
+						if (!ro->paths[order[k]].can_rev)
+							break;
+
+					if (after < before - 1e-9 && k > b) {
+						for (k = a + 1, len = b; k < len; k++, len--) {
+							size_t t = order[k];
+							order[k] = order[len];
+							order[len] = t;
+						}
+						for (k = a + 1; k <= b; k++) {
+							ro->paths[order[k]].rev ^= 1;
+							pos[order[k]] = k;
+						}
+						improved = 1;
+						continue;
+					}
+				}
+
+				/* Or-opt: move the <len> paths from position i to
+				 * right after position j.
+				 */
+				for (len = 1; len <= 3 && i + len <= (long)n; len++) {
+					if (j >= i - 1 && j < i + len)
+						continue;
+					if (i == 0 && ro->anchored)
+						break;
+
+					before = link_len(ro, order, n, i - 1) + link_len(ro, order, n, i + len - 1) +
+					         link_len(ro, order, n, j);
+
+					/* links after the move */
+					{
+						double sx = path_inx(&ro->paths[order[i]]), sy = path_iny(&ro->paths[order[i]]);
+						double ex = path_outx(&ro->paths[order[i + len - 1]]), ey = path_outy(&ro->paths[order[i + len - 1]]);
+						double px, py, qx, qy;
+
+						/* gap left behind: i-1 to i+len */
+						px = i > 0 ? path_outx(&ro->paths[order[i - 1]]) : ro->start.x0;
+						py = i > 0 ? path_outy(&ro->paths[order[i - 1]]) : ro->start.y0;
+						if (i + len < (long)n) {
+							qx = path_inx(&ro->paths[order[i + len]]);
+							qy = path_iny(&ro->paths[order[i + len]]);
+						}
+						else {
+							qx = ro->end.x;
+							qy = ro->end.y;
+						}
+						after = hypot(qx - px, qy - py);
+
+						/* insertion between j and j+1 */
+						px = path_outx(&ro->paths[order[j]]);
+						py = path_outy(&ro->paths[order[j]]);
+						after += hypot(sx - px, sy - py);
+						if (j + 1 < (long)n) {
+							qx = path_inx(&ro->paths[order[j + 1]]);
+							qy = path_iny(&ro->paths[order[j + 1]]);
+						}
+						else {
+							qx = ro->end.x;
+							qy = ro->end.y;
+						}
+						after += hypot(qx - ex, qy - ey);
+					}
+
+					if (after >= before - 1e-9)
+						continue;
+
+					memcpy(tmp, order + i, len * sizeof(*order));
+					if (j > i) {
+						memmove(order + i, order + i + len, (j - i - len + 1) * sizeof(*order));
+						dst = j - len + 1;
+						memcpy(order + dst, tmp, len * sizeof(*order));
+						for (k = i; k <= j; k++)
+							pos[order[k]] = k;
+					}
+					else {
+						memmove(order + j + 1 + len, order + j + 1, (i - j - 1) * sizeof(*order));
+						memcpy(order + j + 1, tmp, len * sizeof(*order));
+						for (k = j + 1; k < i + len; k++)
+							pos[order[k]] = k;
+					}
+					improved = 1;
+					break;
+				}
+			}
+		}
+	}
+
+	free(nbr);
+	free(pos);
+}
+
+/* forwards a travel from the position of move <from>'s end to the start of
+ * move <to>. Before moving horizontally, it rises to the highest Z the group
+ * reached out of its paths, so that no retract of the dropped travels is
+ * lost, and it only descends at the end. Axes set by the dropped travels are
+ * always set, as they may not be known by the machine, and the emitter drops
+ * the moves which change nothing.
+ */
+static void reorder_travel_to(struct fixup *fx, struct reorder *ro, const struct move *from, const struct move *to)
+{
+	struct move t = { 0 };
+	double top = to->z0;
+	int axes;
+
+	t.x0 = t.x = from->x;
+	t.y0 = t.y = from->y;
+	t.z0 = t.z = from->z;
+
+	axes = ro->travel_axes & (B_X | B_Y);
+	axes |= to->x0 != t.x0 ? B_X : 0;
+	axes |= to->y0 != t.y0 ? B_Y : 0;
+	if (axes && ro->ztop > top)
+		top = ro->ztop;
+
+	if (top > t.z) {
+		t.z = top;
+		t.axes = B_Z;
+		pass_forward(fx, &ro->pass, &t);
+		t.z0 = t.z;
+	}
+
+	t.x = to->x0;
+	t.y = to->y0;
+	t.axes = axes;
+	if (t.axes)
+		pass_forward(fx, &ro->pass, &t);
+	t.x0 = t.x;
+	t.y0 = t.y;
+
+	t.z = to->z0;
+	t.axes = ro->travel_axes & B_Z;
+	t.axes |= t.z != t.z0 ? B_Z : 0;
+	if (t.axes)
+		pass_forward(fx, &ro->pass, &t);
+}
+
+/* emits path <p>, backwards if it is reversed, after a travel from <cur>
+ * unless <travel> is zero.
+ */
+static void reorder_emit_path(struct fixup *fx, struct reorder *ro, const struct path *p,
+                              struct move *cur, int travel)
+{
+	const struct move *o;
+	struct move m;
+	size_t i;
+
+	for (i = 0; i < p->count; i++) {
+		if (!p->rev) {
+			m = ro->moves[p->first + i];
+		}
+		else {
+			o = &ro->moves[p->first + p->count - 1 - i];
+			m = *o;
+			m.x0 = o->x; m.x = o->x0;
+			m.y0 = o->y; m.y = o->y0;
+			m.z0 = o->z; m.z = o->z0;
+			if (m.axes & B_IJ) {
+				/* same center seen from the other end */
+				m.i = o->i + o->x0 - o->x;
+				m.j = o->j + o->y0 - o->y;
+				m.g = m.g == 2 ? 3 : 2;
+			}
+			/* the axes the move didn't change may change backwards */
+			m.axes |= B_X | B_Y;
+		}
+
+		if (i == 0 && travel)
+			reorder_travel_to(fx, ro, cur, &m);
+		pass_forward(fx, &ro->pass, &m);
+		*cur = m;
+	}
+}
+
+/* reorders and emits the current group */
+static void reorder_flush(struct fixup *fx, struct pass *pass)
+{
+	struct reorder *ro = (struct reorder *)pass;
+	struct move cur = ro->start;
+	struct grid g;
+	size_t *order;
+	size_t i;
+
+	if (ro->npaths) {
+		order = malloc(ro->npaths * sizeof(*order));
+		if (!order)
+			die(1, "out of memory\n");
+
+		for (i = 0; i < ro->npaths; i++)
+			order[i] = i;
+		ro->travel_in += reorder_travel(ro, order, ro->npaths);
+
+		grid_build(&g, ro->paths, ro->npaths);
+		reorder_nearest(ro, &g, order);
+		grid_free(&g);
+		grid_build(&g, ro->paths, ro->npaths);
+		reorder_improve(ro, &g, order);
+		grid_free(&g);
+		ro->travel_out += reorder_travel(ro, order, ro->npaths);
+
+		for (i = 0; i < ro->npaths; i++)
+			reorder_emit_path(fx, ro, &ro->paths[order[i]], &cur, i || !ro->anchored);
+		free(order);
+		ro->groups++;
+	}
+
+	/* next lines expect the machine where the group left it */
+	if (ro->started) {
+		ro->end.x0 = ro->end.x;
+		ro->end.y0 = ro->end.y;
+		ro->end.z0 = ro->end.z;
+		reorder_travel_to(fx, ro, &cur, &ro->end);
+	}
+
+	ro->nmoves = ro->npaths = 0;
+	ro->in_path = ro->started = 0;
+	ro->travel_axes = 0;
+}
+
+/* path reordering: moves up to the next barrier (any line which is not a
+ * plain move) are split into paths made of consecutive burning moves, and
+ * travels between them are dropped. On the next barrier, the paths are
+ * emitted in the order minimizing the travels, starting from the nearest
+ * one then improving the order for a limited time, with new travels.
+ * Paths changing Z are never reversed so that the tool never plunges in a
+ * rapid, and travels rise before and descend after moving horizontally.
+ */
+static void reorder_push(struct fixup *fx, struct pass *pass, const struct move *m)
+{
+	struct reorder *ro = (struct reorder *)pass;
+	struct path *p;
+
+	(void)fx;
+
+	if (!ro->started) {
+		ro->start = *m;
+		ro->start.x = m->x0;
+		ro->start.y = m->y0;
+		ro->start.z = m->z0;
+		ro->ztop = m->z0;
+		ro->started = 1;
+
+		/* after a barrier, the position is only certain after a travel
+		 * (e.g. G92 is not tracked), otherwise the first path stays.
+		 */
+		ro->anchored = m->g != 0;
+	}
+
+	ro->end = *m;
+	if (m->g == 0) {
+		/* travels are replaced, only the last position and the highest
+		 * Z matter.
+		 */
+		ro->travel_axes |= m->axes;
+		if (m->z > ro->ztop)
+			ro->ztop = m->z;
+		ro->in_path = 0;
+		return;
+	}
+
+	if (ro->nmoves == ro->moves_size) {
+		ro->moves_size = ro->moves_size ? ro->moves_size * 2 : 1024;
+		ro->moves = realloc(ro->moves, ro->moves_size * sizeof(*ro->moves));
+		if (!ro->moves)
+			die(1, "out of memory\n");
+	}
+	ro->moves[ro->nmoves] = *m;
+
+	if (!ro->in_path) {
+		if (ro->npaths == ro->paths_size) {
+			ro->paths_size = ro->paths_size ? ro->paths_size * 2 : 256;
+			ro->paths = realloc(ro->paths, ro->paths_size * sizeof(*ro->paths));
+			if (!ro->paths)
+				die(1, "out of memory\n");
+		}
+		p = &ro->paths[ro->npaths++];
+		p->first = ro->nmoves;
+		p->count = 0;
+		p->x0 = m->x0;
+		p->y0 = m->y0;
+		p->rev = 0;
+		p->can_rev = ro->reverse;
+		ro->in_path = 1;
+	}
+
+	p = &ro->paths[ro->npaths - 1];
+	p->count++;
+	p->x1 = m->x;
+	p->y1 = m->y;
+	if (m->z != m->z0)
+		p->can_rev = 0;
+	ro->nmoves++;
+}
+
+static void reorder_report(struct fixup *fx, struct pass *pass)
+{
+	struct reorder *ro = (struct reorder *)pass;
+
+	(void)fx;
+
+	fprintf(stderr, "reorder: %lu groups, travel %.1fmm -> %.1fmm (%.1f%% saved)\n",
+	        ro->groups, ro->travel_in, ro->travel_out,
+	        ro->travel_in > 0 ? 100.0 * (ro->travel_in - ro->travel_out) / ro->travel_in : 0.0);
+}
+
+/* returns the length of the path followed by move <m>, which may be an arc */
+static double path_len(const struct move *m)
+{
+	double a0, a1, sweep;
+
+	if (!(m->axes & B_IJ))
+		return move_len(m);
+
+	a0 = atan2(-m->j, -m->i);
+	a1 = atan2(m->y - (m->y0 + m->j), m->x - (m->x0 + m->i));
+	sweep = a1 - a0;
+	if (m->g == 3 && sweep <= 0)
+		sweep += 2 * M_PI;
+	if (m->g == 2 && sweep >= 0)
+		sweep -= 2 * M_PI;
+	return fabs(sweep) * hypot(m->i, m->j);
+}
+
+/* returns the length of a word of value <v> once emitted */
+static int word_len(struct fixup *fx, double v)
+{
+	char tmp[40];
+
+	if (fx->compact)
+		return 1 + (fmt_units(tmp, to_units(fx, v), fx->precision) - tmp);
+	return 1 + (fmt_num(fx, tmp, v) - tmp);
+}
+
+/* estimates the size of the line the emitter produces for move <m> following
+ * move <prev>, including the line feed. <prev> is NULL after a barrier.
+ */
+static int move_bytes(struct fixup *fx, const struct move *prev, const struct move *m)
+{
+	int words = 0, len = 1;
+
+	if (!prev || prev->g != m->g) {
+		len += 2;
+		words++;
+	}
+	if ((m->axes & B_X) && (!prev || prev->x != m->x)) {
+		len += word_len(fx, m->x);
+		words++;
+	}
+	if ((m->axes & B_Y) && (!prev || prev->y != m->y)) {
+		len += word_len(fx, m->y);
+		words++;
+	}
+	if ((m->axes & B_Z) && (!prev || prev->z != m->z)) {
+		len += word_len(fx, m->z);
+		words++;
+	}
+	if (m->axes & B_IJ) {
+		len += word_len(fx, m->i) + word_len(fx, m->j);
+		words += 2;
+	}
+	if (m->g != 0 && (!prev || prev->s != m->s)) {
+		len += word_len(fx, m->s);
+		words++;
+	}
+	if (m->g != 0 && (!prev || prev->f != m->f)) {
+		len += word_len(fx, m->f);
+		words++;
+	}
+	if (!fx->compact && words > 1)
+		len += words - 1;
+	return len;
+}
+
+/* returns the duration of link move <lm> at its current feed rate */
+static double link_time(const struct fixup *fx, const struct link_move *lm)
+{
+	double f = lm->m.g == 0 ? fx->maxfeed : lm->m.f;
+
+	return f > 0 ? lm->len * 60.0 / f : 0;
+}
+
+/* reports the pending starving range, if any */
+static void link_range_end(struct fixup *fx, struct link *lk)
+{
+	if (!lk->starving)
+		return;
+	fprintf(stderr, "link: moves %lu-%lu starve the planner, up to %.0f bytes/s needed, %.0f available\n",
+	        lk->first, lk->last, lk->worst, fx->baud / 10.0);
+	lk->starving = 0;
+	lk->ranges++;
+}
+
+/* forwards the oldest move of the window */
+static void link_forward(struct fixup *fx, struct link *lk)
+{
+	struct link_move *lm = &lk->ring[lk->head];
+	double wait = lm->bytes * 10.0 / fx->baud - lm->time;
+
+	if (wait > 0)
+		lk->wait_out += wait;
+	lk->bytes -= lm->bytes;
+	lk->time -= lm->time;
+	lk->time0 -= lm->time0;
+	lk->head = (lk->head + 1) % lk->blocks;
+	lk->count--;
+	pass_forward(fx, &lk->pass, &lm->m);
+}
+
+/* lowers the feed rate of the burning moves of the window so that the link
+ * can deliver its lines while they run. The sum of the lengths divided by the
+ * needed time is enough since moves already slower only take longer. Since
+ * each change of F adds a word, the last rate applied is reused as long as
+ * it is neither too fast nor much too slow. Otherwise a new one is picked
+ * with a margin, rounded down to two significant digits.
+ */
+static void link_fix(struct fixup *fx, struct link *lk, double need)
+{
+	double len = 0, rapids = 0, cap, step;
+	int i, idx;
+
+	for (i = 0; i < lk->count; i++) {
+		idx = (lk->head + i) % lk->blocks;
+		if (lk->ring[idx].m.g == 0)
+			rapids += lk->ring[idx].time;
+		else
+			len += lk->ring[idx].len;
+	}
+
+	/* count the F words entering and leaving the slowed down range */
+	need += 2 * (word_len(fx, lk->cap > 0 ? lk->cap : fx->maxfeed) + !fx->compact) * 10.0 / fx->baud;
+	if (len <= 0 || need <= rapids)
+		return;
+	cap = len * 60.0 / (need - rapids);
+	if (lk->cap > 0 && lk->cap <= cap && lk->cap >= cap * LINK_FIX_MARGIN * LINK_FIX_MARGIN)
+		cap = lk->cap;
+	else {
+		cap *= LINK_FIX_MARGIN;
+		step = pow(10, floor(log10(cap)) - 1);
+		cap = floor(cap / step) * step;
+		if (cap <= 0)
+			return;
+		lk->cap = cap;
+	}
+
+	for (i = 0; i < lk->count; i++) {
+		struct link_move *lm = &lk->ring[(lk->head + i) % lk->blocks];
+
+		if (lm->m.g == 0 || lm->m.f <= cap)
+			continue;
+		lm->m.f = cap;
+		lk->time -= lm->time;
+		lm->time = link_time(fx, lm);
+		lk->time += lm->time;
+		lk->capped++;
+	}
+}
+
+/* adds move <m> to the window, forwarding the oldest one once the window is
+ * full, then checks if the window starves.
+ */
+static void link_push(struct fixup *fx, struct pass *pass, const struct move *m)
+{
+	struct link *lk = (struct link *)pass;
+	struct link_move *lm;
+	double need, wait;
+
+	if (lk->count == lk->blocks)
+		link_forward(fx, lk);
+
+	lm = &lk->ring[(lk->head + lk->count) % lk->blocks];
+	lm->m = *m;
+	lm->bytes = move_bytes(fx, lk->has_prev ? &lk->prev : NULL, m);
+	lm->len = path_len(m);
+	lm->time = lm->time0 = link_time(fx, lm);
+	lk->bytes += lm->bytes;
+	lk->time += lm->time;
+	lk->time0 += lm->time0;
+	lk->count++;
+	lk->moves++;
+	lk->prev = *m;
+	lk->has_prev = 1;
+
+	wait = lm->bytes * 10.0 / fx->baud - lm->time;
+	if (wait > 0)
+		lk->wait_in += wait;
+
+	if (lk->count < lk->blocks)
+		return;
+
+	/* ranges are reported for the original feed rates */
+	lk->windows++;
+	need = lk->bytes * 10.0 / fx->baud;
+	if (need <= lk->time0) {
+		link_range_end(fx, lk);
+		return;
+	}
+
+	lk->starved++;
+	if (!lk->starving) {
+		lk->starving = 1;
+		lk->first = lk->moves - lk->count + 1;
+		lk->worst = 0;
+	}
+	lk->last = lk->moves;
+	if (lk->time0 > 0 && lk->bytes / lk->time0 > lk->worst)
+		lk->worst = lk->bytes / lk->time0;
+
+	if (lk->fix && need > lk->time)
+		link_fix(fx, lk, need);
+}
+
+static void link_flush(struct fixup *fx, struct pass *pass)
+{
+	struct link *lk = (struct link *)pass;
+
+	link_range_end(fx, lk);
+	while (lk->count)
+		link_forward(fx, lk);
+	/* the next barrier changes the emitter's state */
+	lk->has_prev = 0;
+}
+
+static void link_report(struct fixup *fx, struct pass *pass)
+{
+	struct link *lk = (struct link *)pass;
+
+	fprintf(stderr, "link: %lu of %lu windows of %d moves starve in %lu ranges, %lu moves slowed down, est. planner starvation %.2fs -> %.2fs at %d bps\n",
+	        lk->starved, lk->windows, lk->blocks, lk->ranges, lk->capped,
+	        lk->wait_in, lk->wait_out, fx->baud);
+}
+
+/* The following passes operate on block columns and are written without
+ * branches and with non-aliasing arguments so that compilers can vectorize
+ * them. Selections are made using integer masks since compilers do not
+ * if-convert floating point operations which may trap. With gcc, -O3 is
+ * needed, and -march=x86-64-v2 or above for the bounds.
+ */
+
+/* scales column <v> of <n> entries by <scale> * <ratio> and adds <off>,
+ * except for lines having <zero> in their <flags>, which are set to zero.
+ */
+static void transform_axis(double *restrict v, const uint16_t *restrict flags, int n,
+                           uint16_t zero, double scale, double ratio, double off)
+{
+	uint64_t bits;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		double t = v[i] * scale * ratio + off;
+
+		memcpy(&bits, &t, sizeof(bits));
+		bits &= ((flags[i] & zero) != 0) - 1ULL;
+		memcpy(&v[i], &bits, sizeof(bits));
+	}
+}
+
+/* truncates the <n> feed rates in column <f> and clamps them to <maxfeed>,
+ * setting B_FMAX in <flags> for clamped ones.
+ */
+static void clamp_feed(double *restrict f, uint16_t *restrict flags, int n, double maxfeed)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		double t = trunc(f[i]);
+		int over = t > maxfeed;
+
+		f[i] = over ? maxfeed : t;
+		flags[i] |= over ? B_FMAX : 0;
+	}
+}
+
+/* returns an integer which compares like double <v> does, as long as <v> is
+ * not a NaN. It's its own inverse.
+ */
+static inline int64_t order_key(int64_t v)
+{
+	return v ^ (int64_t)((uint64_t)(v >> 63) >> 1);
+}
+
+/* extends *<min> and *<max> with the <n> entries of column <v> whose motion
+ * mode in <g> is not G0. The comparisons are performed on integer keys since
+ * floating point ones are not vectorized without -ffast-math.
+ */
+static void reduce_bounds(const double *restrict v, const uint8_t *restrict g, int n,
+                          double *min, double *max)
+{
+	int64_t lo, hi, seen, k, m;
+	int i;
+
+	memcpy(&lo, min, sizeof(lo));
+	memcpy(&hi, max, sizeof(hi));
+	lo = seen = order_key(lo);
+	hi = order_key(hi);
+
+	for (i = 0; i < n; i++) {
+		memcpy(&k, &v[i], sizeof(k));
+		k = order_key(k);
+
+		/* G0 lines are replaced with a value already seen */
+		m = -(int64_t)(g[i] != 0);
+		k = (k & m) | (seen & ~m);
+
+		lo = k < lo ? k : lo;
+		hi = k > hi ? k : hi;
+	}
+
+	lo = order_key(lo);
+	hi = order_key(hi);
+	memcpy(min, &lo, sizeof(lo));
+	memcpy(max, &hi, sizeof(hi));
+}
+
+/* applies the transform to the pending block lines, emits them and updates
+ * the work bounds, then empties the block.
+ */
+void flush_block(struct fixup *fx)
+{
+	struct block *b = fx->blk;
+	const double scale = fx->scale, maxfeed = fx->maxfeed;
+	const double xs = fx->xscale, ys = fx->yscale, zs = fx->zscale;
+	const double xo = fx->xoff, yo = fx->yoff, zo = fx->zoff;
+	int n = b->count;
+	int i, move, printed;
+	char *o, *start;
+
+	if (!n)
+		return;
+
+	transform_axis(b->x, b->flags, n, B_XZERO, scale, xs, xo);
+	transform_axis(b->y, b->flags, n, B_YZERO, scale, ys, yo);
+	transform_axis(b->z, b->flags, n, B_ZZERO, scale, zs, zo);
+
+	/* power mapping */
+	for (i = 0; i < n; i++)
+		b->s[i] = trunc(map_power(&fx->curve, b->s[i]));
+
+	clamp_feed(b->f, b->flags, n, maxfeed);
+
+	/* serialization, which also resolves the positions. The largest line is
+	 * "Gx" followed by 5 words of at most 34 bytes. When the move pipeline
+	 * is enabled, moves are sent there instead.
+	 */
+	if (!fx->passes)
+		reserve_output(fx, (size_t)n * 180);
+	o = fx->out + fx->out_len;
+	for (i = 0; i < n; i++) {
+		uint16_t fl = b->flags[i];
+		struct move m;
+		int chg = 0;
+
+		m.x0 = fx->x;
+		m.y0 = fx->y;
+		m.z0 = fx->z;
+		fx->g = b->g[i];
+
+		if ((fl & B_X) && !(fx->xknown && b->x[i] == fx->x)) {
+			fx->x = b->x[i];
+			fx->xknown = 1;
+			chg |= B_X;
+		}
+
+		if ((fl & B_Y) && !(fx->yknown && b->y[i] == fx->y)) {
+			fx->y = b->y[i];
+			fx->yknown = 1;
+			chg |= B_Y;
+		}
+
+		if ((fl & B_Z) && !(fx->zknown && b->z[i] == fx->z)) {
+			fx->z = b->z[i];
+			fx->zknown = 1;
+			chg |= B_Z;
+		}
+
+		if (fl & B_F) {
+			fx->newf = b->f[i];
+			fx->newf_str = (fl & B_FMAX) ? fx->maxfeed_str : NULL;
+			fx->has_newf = 1;
+		}
+
+		if (fl & B_S) {
+			fx->news = b->s[i];
+			fx->has_news = 1;
+		}
+
+		move = chg != 0;
+
+		if (fx->passes) {
+			apply_pending(fx, move, 0);
+			if (move) {
+				m.x = fx->x;
+				m.y = fx->y;
+				m.z = fx->z;
+				m.s = fx->s;
+				m.f = fx->f;
+				m.g = fx->g;
+				m.axes = chg;
+				fx->passes->in++;
+				fx->passes->push(fx, fx->passes, &m);
+			}
+			goto next;
+		}
+
+		start = o;
+		printed = move;
+
+		if (fl & B_G) {
+			*o++ = 'G';
+			*o++ = '0' + b->g[i];
+		}
+
+		if (chg & B_X) {
+			if (o != start)
+				*o++ = ' ';
+			*o++ = 'X';
+			o = fmt_num(fx, o, fx->x);
+		}
+
+		if (chg & B_Y) {
+			if (o != start)
+				*o++ = ' ';
+			*o++ = 'Y';
+			o = fmt_num(fx, o, fx->y);
+		}
+
+		if (chg & B_Z) {
+			if (o != start)
+				*o++ = ' ';
+			*o++ = 'Z';
+			o = fmt_num(fx, o, fx->z);
+		}
+
+		o = emit_pending(fx, o, start, move, 0, &printed);
+		if (printed)
+			*o++ = '\n';
+		else
+			o = start;
+	next:
+		b->x[i] = fx->x;
+		b->y[i] = fx->y;
+		b->z[i] = fx->z;
+	}
+
+	if (!fx->passes)
+		fx->out_len = o - fx->out;
+
+	/* bounds, over the positions reached by lines in G1..G3 modes */
+	if (!fx->bounds_known) {
+		for (i = 0; i < n && !b->g[i]; i++)
+			;
+		if (i == n)
+			goto done;
+		fx->minx = fx->maxx = b->x[i];
+		fx->miny = fx->maxy = b->y[i];
+		fx->minz = fx->maxz = b->z[i];
+		fx->bounds_known = 1;
+	}
+
+	reduce_bounds(b->x, b->g, n, &fx->minx, &fx->maxx);
+	reduce_bounds(b->y, b->g, n, &fx->miny, &fx->maxy);
+	reduce_bounds(b->z, b->g, n, &fx->minz, &fx->maxz);
+ done:
+	b->count = 0;
+}
+
+/* tries to append the line between <line> and <end> to the block. Returns
+ * non-zero on success, or 0 if the line doesn't have the block's simple form,
+ * in which case nothing is changed.
+ */
+int block_line(struct fixup *fx, char *line, char *end)
+{
+	struct block *b = fx->blk;
+	int i = b->count;
+	uint16_t flags = 0;
+	char *p, *w, *val;
+	size_t vlen;
+	int g = fx->g;
+	double v;
+
+	for (p = line; (p = next_word(p, end, &w)) != NULL; ) {
+		val = w + 1;
+		vlen = p - val;
+
+		switch (toupper((unsigned char)*w)) {
+		case 'G':
+			if (flags || (g = simple_g(val, vlen)) < 0)
+				return 0;
+			flags |= B_G;
+			break;
+
+		case 'X':
+			if (flags & (B_X | B_Y | B_Z))
+				return 0;
+			b->x[i] = awk_atof(val, vlen);
+			flags |= B_X;
+			if (!g && is_zero_str(val, vlen))
+				flags |= B_XZERO;
+			break;
+
+		case 'Y':
+			if (flags & (B_Y | B_Z))
+				return 0;
+			b->y[i] = awk_atof(val, vlen);
+			flags |= B_Y;
+			if (!g && is_zero_str(val, vlen))
+				flags |= B_YZERO;
+			break;
+
+		case 'Z':
+			if (flags & B_Z)
+				return 0;
+			b->z[i] = awk_atof(val, vlen);
+			flags |= B_Z;
+			if (!g && is_zero_str(val, vlen))
+				flags |= B_ZZERO;
+			break;
+
+		case 'S':
+			if (flags & B_S)
+				return 0;
+			v = awk_atof(val, vlen);
+			b->s[i] = v;
+			flags |= B_S;
+			break;
+
+		case 'F':
+			if (flags & B_F)
+				return 0;
+			b->f[i] = awk_atof(val, vlen);
+			flags |= B_F;
+			break;
+
+		default:
+			return 0;
+		}
+	}
+
+	/* absent words still go through the passes */
+	if (!(flags & B_X)) b->x[i] = 0;
+	if (!(flags & B_Y)) b->y[i] = 0;
+	if (!(flags & B_Z)) b->z[i] = 0;
+	if (!(flags & B_S)) b->s[i] = 0;
+	if (!(flags & B_F)) b->f[i] = 0;
+
+	b->flags[i] = flags;
+	b->g[i] = g;
+	fx->g = g;
+	if (++b->count == BLOCK_SIZE)
+		flush_block(fx);
+	return 1;
+}
+
+/* inserts at <start> the G90 and motion mode that emitter_sync() found left
+ * over by the move pipeline, before the words of a line which moves and does
+ * not set them itself. Returns the new end of the line ending at <o>.
+ */
+static char *restore_modes(struct fixup *fx, char *start, char *o)
+{
+	char pfx[8];
+	size_t len = 0;
+
+	if (fx->restore_rel) {
+		memcpy(pfx, "G90 ", 4);
+		len += 4;
+	}
+	if (fx->restore_g) {
+		pfx[len++] = 'G';
+		pfx[len++] = '0' + fx->g;
+		pfx[len++] = ' ';
+	}
+	fx->restore_rel = fx->restore_g = 0;
+	if (!len)
+		return o;
+
+	memmove(start + len, start, o - start);
+	memcpy(start, pfx, len);
+	return o + len;
+}
+
+/* processes the words of the line between <line> and <end>, and appends the
+ * resulting line, if any, to the output buffer. The line's contents are
+ * modified. In passthrough mode, words that the transform does not affect are
+ * emitted with their original bytes instead of normalized.
+ */
+void fixup_words(struct fixup *fx, char *line, char *end)
+{
+	char *p, *w, *o, *start;
+	char *orig = NULL;
+	char *val;
+	size_t vlen;
+	char cmd;
+	double v;
+	int ng = 0, ng_set = 0;   // ng_set=0 means ng == ""
+	int nx_set = 0, ny_set = 0, nz_set = 0;
+	int move = 0, printed = 0, send_s = 0;
+	int nm;
+
+	if (fx->passthrough) {
+		/* words are normalized in place, keep the original ones */
+		if (fx->orig_size < (size_t)(end - line)) {
+			free(fx->orig);
+			fx->orig_size = (end - line) * 2;
+			fx->orig = malloc(fx->orig_size);
+			if (!fx->orig)
+				die(1, "out of memory\n");
+		}
+		memcpy(fx->orig, line, end - line);
+		orig = fx->orig;
+	}
+
+	/* each word uses at most 34 bytes (separator, cmd, number), and
+	 * G92 may add a few more.
+	 */
+	reserve_output(fx, (end - line) * 34 + 64);
+	o = start = fx->out + fx->out_len;
+
+	for (p = line; (p = next_word(p, end, &w)) != NULL; ) {
+		cmd = toupper((unsigned char)*w);
+		val = w + 1;
+		vlen = p - val;
+		strip_value(&val, &vlen);
+
+		if (cmd == 'G') {
+			ng = (int)awk_atof(val, vlen);
+			ng_set = 1;
+			if (ng >= 0 && ng <= 3) {
+				fx->g = ng;
+				fx->g_known = 1;
+				fx->restore_g = 0;
+				ng_set = 0;
+			}
+			else if (ng == 90 || ng == 91)
+				fx->restore_rel = 0;
+			else if (ng >= 17 && ng <= 19)
+				fx->plane = ng;
+		}
+		else if (cmd == 'M') {
+			nm = (int)awk_atof(val, vlen);
+			if (nm >= 3 && nm <= 5) {
+				if (fx->m_known && nm == fx->m)
+					continue;
+				if (nm == 5)
+					continue;
+				if (!fx->m_known)
+					send_s = 1;
+				fx->m = nm;
+				fx->m_known = 1;
+			}
+		}
+		else if ((cmd == 'X' || cmd == 'Y' || cmd == 'Z') && !ng_set) {
+			double *cur, off, ratio;
+			int *known, same;
+
+			if (cmd == 'X') {
+				cur = &fx->x; known = &fx->xknown; nx_set = 1;
+				off = fx->xoff; ratio = fx->xscale; same = fx->xsame;
+			} else if (cmd == 'Y') {
+				cur = &fx->y; known = &fx->yknown; ny_set = 1;
+				off = fx->yoff; ratio = fx->yscale; same = fx->ysame;
+			} else {
+				cur = &fx->z; known = &fx->zknown; nz_set = 1;
+				off = fx->zoff; ratio = fx->zscale; same = fx->zsame;
+			}
+
+			/* awk compares the string to "0" to decide on the offset */
+			if (vlen == 1 && *val == '0' && fx->g == 0)
+				off = 0;
+			v = awk_atof(val, vlen) * fx->scale * ratio + off;
+			if (*known && v == *cur)
+				continue;
+			*cur = v;
+			*known = 1;
+			move = 1;
+
+			if (o != start)
+				*o++ = ' ';
+			if (orig && same && off == 0) {
+				memcpy(o, orig + (w - line), p - w);
+				o += p - w;
+			}
+			else {
+				*o++ = cmd;
+				o = fmt_num(fx, o, v);
+			}
+			printed = 1;
+			continue;
+		}
+		else if ((cmd == 'I' || cmd == 'J' || cmd == 'K') && !ng_set) {
+			double ratio;
+
+			if (cmd == 'I') {
+				ratio = fx->xscale;
+				fx->xknown = 0;
+			} else if (cmd == 'J') {
+				ratio = fx->yscale;
+				fx->yknown = 0;
+			} else {
+				ratio = fx->zscale;
+				fx->zknown = 0;
+			}
+			v = awk_atof(val, vlen) * fx->scale * ratio;
+			move = 1;
+
+			if (o != start)
+				*o++ = ' ';
+			if (orig && fx->scale == 1.0 && ratio == 1.0) {
+				memcpy(o, orig + (w - line), p - w);
+				o += p - w;
+			}
+			else {
+				*o++ = cmd;
+				o = fmt_num(fx, o, v);
+			}
+			printed = 1;
+			continue;
+		}
+		else if (cmd == 'F') {
+			fx->newf = trunc(awk_atof(val, vlen));
+			fx->newf_str = NULL;
+			if (fx->newf > fx->maxfeed) {
+				fx->newf = fx->maxfeed;
+				fx->newf_str = fx->maxfeed_str;
+			}
+			fx->has_newf = 1;
+			continue;
+		}
+		else if (cmd == 'S') {
+			v = awk_atof(val, vlen);
+			fx->news = trunc(map_power(&fx->curve, v));
+			fx->has_news = 1;
+			continue;
+		}
+		else if (cmd != 'P' && cmd != 'N') {
+			/* consider that everything we do not know is a potential move */
+			move = 1;
+			fx->xknown = fx->yknown = fx->zknown = 0;
+		}
+
+		/* copy the word as normalized, or as-is in passthrough mode */
+		if (o != start)
+			*o++ = ' ';
+		if (orig) {
+			memcpy(o, orig + (w - line), p - w);
+			o += p - w;
+		}
+		else {
+			*o++ = cmd;
+			memcpy(o, val, vlen);
+			o += vlen;
+		}
+
+		/* do not send empty G[0-3] commands */
+		if (cmd != 'G' || (int)awk_atof(val, vlen) > 3)
+			printed = 1;
+	}
+
+	o = emit_pending(fx, o, start, move, send_s, &printed);
+	if (move && printed)
+		o = restore_modes(fx, start, o);
+
+	if (!ng_set && fx->g > 0) {
+		if (!fx->bounds_known) {
+			fx->minx = fx->maxx = fx->x;
+			fx->miny = fx->maxy = fx->y;
+			fx->minz = fx->maxz = fx->z;
+			fx->bounds_known = 1;
+		}
+		if (fx->x < fx->minx) fx->minx = fx->x;
+		if (fx->x > fx->maxx) fx->maxx = fx->x;
+		if (fx->y < fx->miny) fx->miny = fx->y;
+		if (fx->y > fx->maxy) fx->maxy = fx->y;
+		if (fx->z < fx->minz) fx->minz = fx->z;
+		if (fx->z > fx->maxz) fx->maxz = fx->z;
+	}
+
+	if (ng_set && ng == 92 && !nx_set && !ny_set && !nz_set) {
+		if (o != start)
+			*o++ = ' ';
+		memcpy(o, "X0 Y0 Z0", 8);
+		o += 8;
+		printed = 1;
+	}
+
+	if (printed) {
+		if (fx->compact) {
+			char *r;
+
+			for (r = w = start; r < o; r++)
+				if (*r != ' ')
+					*w++ = *r;
+			o = w;
+		}
+		*o++ = '\n';
+		fx->out_len = o - fx->out;
+	}
+}
+
+/* processes one input line of <len> bytes at <line> (without the LF) and
+ * appends the resulting line, if any, to the output buffer. Lines of the
+ * simple form are queued into the columnar block, others are processed word
+ * by word once the block is flushed. The line's contents are modified.
+ */
+void fixup_line(struct fixup *fx, char *line, size_t len)
+{
+	char *end;
+
+	/* the move pipeline rewrites lines anyway, so it ignores line endings */
+	if (fx->passes && len && line[len - 1] == '\r')
+		len--;
+
+	end = strip_comments(line, len);
+
+	/* passthrough needs the original words, which the block doesn't keep */
+	if (!fx->passthrough && block_line(fx, line, end))
+		return;
+
+	flush_block(fx);
+	if (fx->passes) {
+		flush_passes(fx);
+		emitter_sync(fx);
+	}
+	fixup_words(fx, line, end);
+	if (fx->passes)
+		emitter_reset(fx);
+}
+
+/* processes the whole contents of file descriptor <fd>, line by line. Lines
+ * are processed directly in the input buffer which only grows when a single
+ * line does not fit. Returns non-zero on success, 0 on read error.
+ */
+int fixup_fd(struct fixup *fx, int fd)
+{
+	static char *buf;
+	static size_t size;
+	size_t len = 0;
+	char *p, *nl, *end;
+	ssize_t ret;
+
+	if (!buf) {
+		size = INPUT_BUFFER_SIZE;
+		buf = malloc(size);
+		if (!buf)
+			die(1, "out of memory\n");
+	}
+
+	while (1) {
+		if (len == size) {
+			/* a single line fills the buffer */
+			size *= 2;
+			buf = realloc(buf, size);
+			if (!buf)
+				die(1, "out of memory\n");
+		}
+
+		ret = read(fd, buf + len, size - len);
+		if (ret < 0)
+			return 0;
+
+		if (ret == 0) {
+			/* last line without LF */
+			if (len) {
+				fixup_line(fx, buf, len);
+				fx->in_lines++;
+			}
+			return 1;
+		}
+
+		fx->in_bytes += ret;
+		len += ret;
+		end = buf + len;
+		for (p = buf; (nl = memchr(p, '\n', end - p)) != NULL; p = nl + 1) {
+			fixup_line(fx, p, nl - p);
+			fx->in_lines++;
+		}
+
+		len = end - p;
+		memmove(buf, p, len);
+	}
+}
+
+/* emits the trailer with the work bounds */
+void fixup_end(struct fixup *fx)
+{
+	struct pass *pass;
+	double in_bpl, out_bpl;
+	char *o;
+
+	flush_block(fx);
+	if (fx->passes) {
+		flush_passes(fx);
+		emitter_sync(fx);
+	}
+
+	reserve_output(fx, 512);
+	o = fx->out + fx->out_len;
+	if (fx->compact)
+		o += sprintf(o, "M5\n%sG0X0Y0Z0\n", fx->restore_rel ? "G90" : "");
+	else
+		o += sprintf(o, "M05\n%sG0 X0 Y0 Z0\n", fx->restore_rel ? "G90 " : "");
+	o += sprintf(o, "(minx=%f miny=%f minz=%f maxx=%f maxy=%f maxz=%f maxs=%ju)\n",
+	             fx->minx, fx->miny, fx->minz, fx->maxx, fx->maxy, fx->maxz,
+	             (uintmax_t)(intmax_t)fx->maxs);
+	fx->out_len = o - fx->out;
+	flush_output(fx);
+
+	if (fx->verbose) {
+		for (pass = fx->passes; pass; pass = pass->next)
+			fprintf(stderr, "%s: %lu moves in, %lu out\n",
+			        pass->name, pass->in, pass->next ? pass->out : pass->in);
+		for (pass = fx->passes; pass; pass = pass->next)
+			if (pass->report)
+				pass->report(fx, pass);
+		fprintf(stderr, "lines: %llu in, %llu out (%.1f%%)\n",
+		        fx->in_lines, fx->out_lines,
+		        fx->in_lines ? 100.0 * fx->out_lines / fx->in_lines : 100.0);
+		fprintf(stderr, "bytes: %llu in, %llu out (%.1f%%)\n",
+		        fx->in_bytes, fx->out_bytes,
+		        fx->in_bytes ? 100.0 * fx->out_bytes / fx->in_bytes : 100.0);
+		in_bpl = fx->in_lines ? (double)fx->in_bytes / fx->in_lines : 0.0;
+		out_bpl = fx->out_lines ? (double)fx->out_bytes / fx->out_lines : 0.0;
+		fprintf(stderr, "bytes/line: %.1f in, %.1f out, %.0f vs %.0f lines/s at %d bauds\n",
+		        in_bpl, out_bpl,
+		        in_bpl > 0 ? fx->baud / 10.0 / in_bpl : 0.0,
+		        out_bpl > 0 ? fx->baud / 10.0 / out_bpl : 0.0,
+		        fx->baud);
+	}
+}
+
+/* allocates a pass of <size> bytes named <name> using callbacks <push> and
+ * <flush>, and appends it to the pipeline whose last next pointer is at
+ * *<tail>, which is then updated. Dies on allocation error.
+ */
+void *add_pass(struct pass ***tail, size_t size, const char *name,
+               void (*push)(struct fixup *, struct pass *, const struct move *),
+               void (*flush)(struct fixup *, struct pass *))
+{
+	struct pass *pass = calloc(1, size);
+
+	if (!pass)
+		die(1, "out of memory\n");
+	pass->name = name;
+	pass->push = push;
+	pass->flush = flush;
+	**tail = pass;
+	*tail = &pass->next;
+	return pass;
+}
+
+/* last stage of the self-check pipeline, collecting the moves */
+struct collect {
+	struct pass pass;
+	struct move out[SELF_CHECK_MAX_POINTS];
+	int count;
+};
+
+static void collect_push(struct fixup *fx, struct pass *pass, const struct move *m)
+{
+	struct collect *cl = (struct collect *)pass;
+
+	(void)fx;
+
+	if (cl->count < SELF_CHECK_MAX_POINTS)
+		cl->out[cl->count++] = *m;
+}
+
+/* returns the distance from point (<x>,<y>) to segment <m> */
+static double segment_dist(const struct move *m, double x, double y)
+{
+	double dx = m->x - m->x0, dy = m->y - m->y0;
+	double l2 = dx * dx + dy * dy;
+	double t = l2 > 0 ? ((x - m->x0) * dx + (y - m->y0) * dy) / l2 : 0.0;
+
+	t = t < 0.0 ? 0.0 : t > 1.0 ? 1.0 : t;
+	return hypot(x - (m->x0 + t * dx), y - (m->y0 + t * dy));
+}
+
+/* runs polylines drawn by hand through the simplification pass, and checks
+ * that all of their points remain within the tolerance of the result, and
+ * that it has the expected number of moves.
+ */
+int self_check(void)
+{
+	static const struct {
+		double tolerance;
+		int moves;            // expected number of moves
+		int count;            // number of points
+		double pt[SELF_CHECK_MAX_POINTS][2];
+	} cases[] = {
+		/* a slightly wavy line becomes a single move */
+		{ 0.05, 1, 5, { { 0, 0 }, { 1, 0.01 }, { 2, 0 }, { 3, -0.01 }, { 4, 0 } } },
+		/* a corner is kept */
+		{ 0.05, 2, 4, { { 0, 0 }, { 5, 0 }, { 10, 0 }, { 10, 5 } } },
+		/* a turn-back within the cone must keep the turning point, which
+		 * is 0.57 away from the new end
+		 */
+		{ 0.5, 2, 4, { { 0, 0 }, { 10, 0 }, { 9.55, 0.35 }, { 9.55, 5 } } },
+		/* a turn-back to within the tolerance of the turning point may drop it */
+		{ 0.5, 2, 4, { { 0, 0 }, { 10, 0 }, { 9.8, 0.1 }, { 9.8, 5 } } },
+		/* going back along the line keeps the turning point */
+		{ 0.05, 2, 3, { { 0, 0 }, { 10, 0 }, { 5, 0 } } },
+		/* so does a point before the farthest one, 0.503 away from the
+		 * new end while the farthest one is only 0.47 away
+		 */
+		{ 0.5, 2, 5, { { 0, 0 }, { 0.138, -0.789 }, { 0.715, -1.692 },
+		               { 0.979, -1.769 }, { 1.033, -1.302 } } },
+	};
+	struct fixup fx;
+	struct simplify sp;
+	struct collect cl;
+	struct move m;
+	double d, dev, max;
+	int i, j, k, fail = 0;
+
+	for (i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++) {
+		memset(&fx, 0, sizeof(fx));
+		memset(&sp, 0, sizeof(sp));
+		memset(&cl, 0, sizeof(cl));
+		fx.tolerance = cases[i].tolerance;
+		sp.pass.push = simplify_push;
+		sp.pass.next = &cl.pass;
+		cl.pass.push = collect_push;
+
+		memset(&m, 0, sizeof(m));
+		m.g = 1;
+		m.s = 100;
+		m.f = 1000;
+		m.axes = B_X | B_Y;
+		for (j = 1; j < cases[i].count; j++) {
+			m.x0 = cases[i].pt[j - 1][0];
+			m.y0 = cases[i].pt[j - 1][1];
+			m.x = cases[i].pt[j][0];
+			m.y = cases[i].pt[j][1];
+			simplify_push(&fx, &sp.pass, &m);
+		}
+		simplify_flush(&fx, &sp.pass);
+
+		for (max = 0.0, j = 0; j < cases[i].count; j++) {
+			for (dev = HUGE_VAL, k = 0; k < cl.count; k++) {
+				d = segment_dist(&cl.out[k], cases[i].pt[j][0], cases[i].pt[j][1]);
+				if (d < dev)
+					dev = d;
+			}
+			if (dev > max)
+				max = dev;
+		}
+
+		printf("case %d: expected %d moves within %.3f, got %d within %.3f: %s\n",
+		       i + 1, cases[i].moves, cases[i].tolerance, cl.count, max,
+		       cl.count == cases[i].moves && max <= cases[i].tolerance ? "OK" : "FAIL");
+		fail |= cl.count != cases[i].moves || max > cases[i].tolerance;
+	}
+	return !fail;
+}
+
+void usage(int code, const char *cmd)
+{
+	die(code,
+	    "Usage: %s [args*] file.gcode > newfile.gcode\n"
+	    "Arguments:\n"
+	    "  -h | --help             display this help message\n"
+	    "  -p | --power <ratio>    set this power ratio (def: 1.0)\n"
+	    "  -o | --offset <ofs>     add this offset to output power (def: 0)\n"
+	    "  -g | --gamma <ratio>    adjust the signal gamma (def: 1.0)\n"
+	    "  -f | --feed   <rate>    fix feed rate limit to <rate> mm/min (def: 5000)\n"
+	    "  -s | --scale <ratio>    scale all dimensions by <ratio> (def: 1.0)\n"
+	    "  -x | --xscale <ratio>   scale X dimensions by <ratio> (def: 1.0)\n"
+	    "  -y | --yscale <ratio>   scale Y dimensions by <ratio> (def: 1.0)\n"
+	    "  -z | --zscale <ratio>   scale Z dimensions by <ratio> (def: 1.0)\n"
+	    "  -X | --xoff  <offset>   add <offset> to all X coordinates (def: 0.0)\n"
+	    "  -Y | --yoff  <offset>   add <offset> to all Y coordinates (def: 0.0)\n"
+	    "  -Z | --zoff  <offset>   add <offset> to all Z coordinates (def: 0.0)\n"
+	    "  -m | --max-s <value>    max spindle value, GRBL's $30 (def: %d)\n"
+	    "     --save-curve <file>  save the power curve to <file>, then exit if no\n"
+	    "                          file to process was given\n"
+	    "     --load-curve <file>  map spindle values using this curve instead of\n"
+	    "                          -p/-o/-g\n"
+	    "     --passthrough        copy words unaffected by the transform as-is, and\n"
+	    "                          print modified coordinates with full precision\n"
+	    "     --trim               trim raster rows to their burning span, skip blank\n"
+	    "                          rows and run rows in the closest direction\n"
+	    "     --overscan <mm>      extend trimmed rows by this length on each end\n"
+	    "                          with the laser off (def: %g)\n"
+	    "     --accel <mm/s2>      X acceleration ($120): make the overscan long\n"
+	    "                          enough to reach the row's speed. Implies --trim.\n"
+	    "     --speed-up           raise S and F in the same ratio on runs of burning\n"
+	    "                          moves, up to -f and --max-power, keeping the\n"
+	    "                          energy per pixel unchanged\n"
+	    "     --max-power <ratio>  highest spindle ratio for --speed-up (def: %g)\n"
+	    "     --dedup              turn the parts of moves burning again what was\n"
+	    "                          burnt since the last non-move line into rapids\n"
+	    "     --merge              merge collinear moves of equal power, and turn runs\n"
+	    "                          of moves not burning anything into single rapids\n"
+	    "     --arcs               turn runs of moves lying on a circle within the\n"
+	    "                          tolerance into G2/G3 arcs\n"
+	    "     --simplify           simplify polylines within the tolerance\n"
+	    "     --reorder            reorder paths between non-move lines to minimize\n"
+	    "                          travels. Keeps whole jobs in memory.\n"
+	    "     --reverse            permit reordered paths to run backwards\n"
+	    "     --reorder-time <sec> time spent improving the order (def: %g)\n"
+	    "     --tolerance <mm>     max deviation of modified paths (def: %g)\n"
+	    "     --compact            shortest output: no spaces, fixed precision without\n"
+	    "                          useless zeros, relative moves when shorter\n"
+	    "     --precision <digits> decimals of compact coordinates (def: %d)\n"
+	    "     --quantize <mm>      round compact coordinates to multiples of <mm>,\n"
+	    "                          e.g. the machine's step size (def: off)\n"
+	    "     --link-check         report the moves the serial link cannot deliver\n"
+	    "                          as fast as GRBL's planner runs them\n"
+	    "     --link-fix           also lower F on these moves so that the planner\n"
+	    "                          never empties\n"
+	    "     --baud <bps>         serial link speed (def: %d)\n"
+	    "     --planner <blocks>   GRBL's planner buffer size (def: %d)\n"
+	    "  -v | --verbose          report statistics on stderr\n"
+	    "     --self-check         check --simplify on hand-drawn paths, then exit\n"
+	    "\n", cmd, DEFAULT_MAX_S, DEFAULT_OVERSCAN, DEFAULT_MAX_POWER, DEFAULT_TOLERANCE, DEFAULT_REORDER_TIME,
+	    DEFAULT_PRECISION, DEFAULT_BAUD_RATE, DEFAULT_PLANNER_BLOCKS);
+}
+
+int main(int argc, char **argv)
+{
+	const char *save_file = NULL, *load_file = NULL;
+	int max_s = DEFAULT_MAX_S;
+	struct pass **tail;
+	int merge = 0, simplify = 0, arcs = 0, reorder = 0, reverse = 0;
+	double reorder_time = DEFAULT_REORDER_TIME;
+	double overscan = DEFAULT_OVERSCAN;
+	double accel = DEFAULT_ACCEL;
+	double max_power = DEFAULT_MAX_POWER;
+	int speed = 0;
+	struct speed *sp;
+	int dedup = 0;
+	struct dedup *dd;
+	int trim = 0;
+	int link = 0, planner = DEFAULT_PLANNER_BLOCKS;
+	struct link *lk;
+	struct trim *tr;
+	struct reorder *ro;
+	struct arcs *ar;
+	struct fixup fx;
+	int arg, fd;
+
+	memset(&fx, 0, sizeof(fx));
+
+	fx.power = DEFAULT_POWER;
+	fx.gamma = DEFAULT_GAMMA;
+	fx.offset = DEFAULT_OFFSET;
+	fx.maxfeed_str = DEFAULT_FEED;
+	fx.scale = fx.xscale = fx.yscale = fx.zscale = DEFAULT_SCALE;
+	fx.xoff = fx.yoff = fx.zoff = DEFAULT_OFF;
+	fx.tolerance = DEFAULT_TOLERANCE;
+	fx.plane = 17;
+	fx.precision = DEFAULT_PRECISION;
+	fx.baud = DEFAULT_BAUD_RATE;
+
+	while (1) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "hp:o:g:f:m:s:vx:y:z:X:Y:Z:", long_options, &option_index);
+		double arg_f = optarg ? awk_atof(optarg, strlen(optarg)) : 0.0;
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			usage(0, argv[0]);
+			break;
+
+		case 'p':
+			fx.power = arg_f;
+			break;
+
+		case 'o':
+			fx.offset = arg_f;
+			break;
+
+		case 'g':
+			fx.gamma = arg_f;
+			break;
+
+		case 'f':
+			fx.maxfeed_str = optarg;
+			break;
+
+		case 'm':
+			max_s = arg_f;
+			if (max_s < 1 || max_s > MAX_CURVE_SIZE)
+				die(1, "max spindle value must be between 1 and %d\n", MAX_CURVE_SIZE);
+			break;
+
+		case 's':
+			fx.scale = arg_f;
+			break;
+
+		case 'x':
+			fx.xscale = arg_f;
+			break;
+
+		case 'y':
+			fx.yscale = arg_f;
+			break;
+
+		case 'z':
+			fx.zscale = arg_f;
+			break;
+
+		case 'X':
+			fx.xoff = arg_f;
+			break;
+
+		case 'Y':
+			fx.yoff = arg_f;
+			break;
+
+		case 'Z':
+			fx.zoff = arg_f;
+			break;
+
+		case OPT_SAVE_CURVE:
+			save_file = optarg;
+			break;
+
+		case OPT_LOAD_CURVE:
+			load_file = optarg;
+			break;
+
+		case OPT_PASSTHROUGH:
+			fx.passthrough = 1;
+			break;
+
+		case OPT_MERGE:
+			merge = 1;
+			break;
+
+		case OPT_TRIM:
+			trim = 1;
+			break;
+
+		case OPT_OVERSCAN:
+			overscan = arg_f;
+			if (overscan < 0)
+				die(1, "overscan must not be negative\n");
+			break;
+
+		case OPT_ACCEL:
+			accel = arg_f;
+			if (accel <= 0)
+				die(1, "acceleration must be positive\n");
+			trim = 1;
+			break;
+
+		case OPT_SPEED_UP:
+			speed = 1;
+			break;
+
+		case OPT_MAX_POWER:
+			max_power = arg_f;
+			if (max_power <= 0 || max_power > 1)
+				die(1, "max power must be within ]0, 1]\n");
+			break;
+
+		case OPT_SIMPLIFY:
+			simplify = 1;
+			break;
+
+		case OPT_ARCS:
+			arcs = 1;
+			break;
+
+		case OPT_REORDER:
+			reorder = 1;
+			break;
+
+		case OPT_REVERSE:
+			reverse = 1;
+			break;
+
+		case OPT_REORDER_TIME:
+			reorder_time = arg_f;
+			break;
+
+		case OPT_TOLERANCE:
+			fx.tolerance = arg_f;
+			if (fx.tolerance <= 0)
+				die(1, "tolerance must be positive\n");
+			break;
+
+		case OPT_COMPACT:
+			fx.compact = 1;
+			break;
+
+		case OPT_PRECISION:
+			fx.precision = arg_f;
+			if (fx.precision < 0 || fx.precision > MAX_PRECISION)
+				die(1, "precision must be between 0 and %d\n", MAX_PRECISION);
+			break;
+
+		case OPT_QUANTIZE:
+			fx.quantum = arg_f;
+			if (fx.quantum <= 0)
+				die(1, "quantization step must be positive\n");
+			break;
+
+		case OPT_LINK_CHECK:
+			if (!link)
+				link = 1;
+			break;
+
+		case OPT_LINK_FIX:
+			link = 2;
+			break;
+
+		case OPT_BAUD:
+			fx.baud = arg_f;
+			if (fx.baud <= 0)
+				die(1, "baud rate must be positive\n");
+			break;
+
+		case OPT_PLANNER:
+			planner = arg_f;
+			if (planner < 1)
+				die(1, "planner size must be at least one block\n");
+			break;
+
+		case OPT_DEDUP:
+			dedup = 1;
+			break;
+
+		case OPT_SELF_CHECK:
+			return self_check() ? 0 : 1;
+
+		case 'v':
+			fx.verbose = 1;
+			break;
+
+		case ':': /* missing argument */
+		case '?': /* unknown option */
+			usage(1, argv[0]);
+		}
+	}
+
+	fx.maxfeed = awk_atof(fx.maxfeed_str, strlen(fx.maxfeed_str));
+	fx.xsame = fx.scale == 1.0 && fx.xscale == 1.0;
+	fx.ysame = fx.scale == 1.0 && fx.yscale == 1.0;
+	fx.zsame = fx.scale == 1.0 && fx.zscale == 1.0;
+
+	if (load_file) {
+		if (!load_curve(&fx.curve, load_file))
+			die(1, "cannot load power curve from '%s'\n", load_file);
+	}
+	else if (!build_curve(&fx.curve, max_s, fx.gamma, fx.power, fx.offset))
+		die(1, "out of memory\n");
+
+	if (save_file) {
+		if (!save_curve(&fx.curve, save_file))
+			die(1, "cannot save power curve to '%s'\n", save_file);
+		if (optind >= argc)
+			return 0;
+	}
+
+	fx.out_size = OUTPUT_BUFFER_SIZE;
+	fx.out = malloc(fx.out_size);
+	fx.fmt_cache = calloc(FMT_CACHE_SIZE, sizeof(*fx.fmt_cache));
+	fx.blk = calloc(1, sizeof(*fx.blk));
+	if (!fx.out || !fx.fmt_cache || !fx.blk)
+		die(1, "out of memory\n");
+
+	/* move pipeline, passes in processing order */
+	tail = &fx.passes;
+	if (dedup) {
+		dd = add_pass(&tail, sizeof(struct dedup), "dedup", dedup_push, dedup_flush);
+		dd->pass.report = dedup_report;
+	}
+	if (speed) {
+		sp = add_pass(&tail, sizeof(struct speed), "speed", speed_push, speed_flush);
+		sp->pass.report = speed_report;
+		sp->max_s = max_power * fx.curve.max;
+	}
+	if (trim) {
+		tr = add_pass(&tail, sizeof(struct trim), "trim", trim_push, trim_flush);
+		tr->pass.report = trim_report;
+		tr->overscan = overscan;
+		tr->accel = accel;
+	}
+	if (merge)
+		add_pass(&tail, sizeof(struct merge), "merge", merge_push, merge_flush);
+	if (arcs) {
+		ar = add_pass(&tail, sizeof(struct arcs), "arcs", arcs_push, arcs_flush);
+		ar->pass.report = arcs_report;
+	}
+	if (simplify)
+		add_pass(&tail, sizeof(struct simplify), "simplify", simplify_push, simplify_flush);
+	if (reorder) {
+		ro = add_pass(&tail, sizeof(struct reorder), "reorder", reorder_push, reorder_flush);
+		ro->pass.report = reorder_report;
+		ro->reverse = reverse;
+		ro->budget = reorder_time;
+	}
+	if (link) {
+		lk = add_pass(&tail, sizeof(struct link), "link", link_push, link_flush);
+		lk->pass.report = link_report;
+		lk->fix = link == 2;
+		lk->blocks = planner;
+		lk->ring = calloc(planner, sizeof(*lk->ring));
+		if (!lk->ring)
+			die(1, "out of memory\n");
+	}
+
+	/* the compact mode is implemented by the emitter */
+	fx.units = pow(10, fx.precision);
+	fx.ij_precision = fx.precision < 3 ? 3 : fx.precision;
+	fx.ij_units = pow(10, fx.ij_precision);
+	if (fx.compact && fx.passthrough)
+		die(1, "--passthrough cannot be combined with --compact\n");
+	if (fx.passes || fx.compact) {
+		if (fx.passthrough)
+			die(1, "--passthrough cannot be combined with move passes\n");
+		fx.emitter = add_pass(&tail, sizeof(struct emitter), "emit", emitter_push, emitter_flush);
+	}
+
+	if (optind >= argc) {
+		if (!fixup_fd(&fx, 0))
+			die(1, "read error\n");
+	}
+
+	for (arg = optind; arg < argc; arg++) {
+		fd = open(argv[arg], O_RDONLY);
+		if (fd < 0)
+			die(2, "cannot open file '%s'\n", argv[arg]);
+		if (!fixup_fd(&fx, fd))
+			die(1, "read error on '%s'\n", argv[arg]);
+		close(fd);
+	}
+
+	fixup_end(&fx);
+	return 0;
+}
@@ -0,0 +1,750 @@
+/* Nests many small G-CODE jobs on the machine's bed and merges them into a
+ * single job, so that a batch of small items runs at once. Each job is placed
+ * at the position of the bounding box of its feed moves found by a skyline
+ * bin packing, optionally rotated by 90 degrees, and the jobs are then ordered
+ * to shorten the travels between them.
+ *
+ * Each input is read only once: it is parsed into a temporary binary file of
+ * moves in absolute machine coordinates while its bounds are measured, and the
+ * merged job is written by replaying the moves of each job in its place. Each
+ * move sets the modal state it needs, and moves between jobs are rapids which
+ * rise to the highest Z reached in between.
+ */
+#include <ctype.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gcode-common.h"
+
+/* default settings */
+#define DEFAULT_BED_WIDTH        400.0   // mm
+#define DEFAULT_BED_HEIGHT       300.0   // mm
+#define DEFAULT_GAP              2.0     // mm between jobs
+#define DEFAULT_PRECISION        3
+#define MAX_PRECISION            8
+
+/* output buffer size */
+#define OUTPUT_BUFFER_SIZE       (1 << 20)
+
+/* the ordering stops improving after this many passes over all jobs */
+#define ORDER_PASSES             20
+
+/* tolerance of the packing's comparisons, in mm */
+#define PACK_EPSILON             1e-9
+
+/* long options without a short equivalent */
+enum {
+	OPT_PRECISION = 256,
+};
+
+const struct option long_options[] = {
+	{"help",        no_argument,       0, 'h'              },
+	{"width",       required_argument, 0, 'W'              },
+	{"height",      required_argument, 0, 'H'              },
+	{"gap",         required_argument, 0, 'g'              },
+	{"rotate",      no_argument,       0, 'r'              },
+	{"xoff",        required_argument, 0, 'X'              },
+	{"yoff",        required_argument, 0, 'Y'              },
+	{"precision",   required_argument, 0, OPT_PRECISION    },
+	{"verbose",     no_argument,       0, 'v'              },
+	{0,             0,                 0, 0                }
+};
+
+/* one input job. Its bounds, entry and exit points are in its own machine
+ * coordinates, and it is placed with the lower left corner of its bounds at
+ * <px>,<py> on the bed, after a rotation by 90 degrees counter-clockwise if
+ * <rot> is set.
+ */
+struct item {
+	const char *name;
+	off_t start;              // offset of its first record in the temporary file
+	unsigned long records;
+	unsigned long feed_moves;
+	double min[2], max[2];    // bounds of the feed moves, mm
+	double entry[2], exit[2]; // start of the first feed move, end of the last
+	double feed_time;         // seconds
+	double px, py;
+	int rot;
+};
+
+/* a segment of the skyline: the packing's top edge is at <y> from <x> to
+ * <x> + <w>.
+ */
+struct seg {
+	double x, y, w;
+};
+
+/* state of the merged job's output. Positions are in output units, i.e.
+ * including the offsets and multiplied by 10^precision.
+ */
+struct out {
+	FILE *file;
+	long long x, y, z;        // head position, X and Y valid if <known>
+	long long ztop;           // highest Z the input reached since our last move
+	int known;
+	int g, spindle;           // -1 when not set yet
+	int sf_known;             // <s> and <f> were set
+	double s, f;
+
+	/* statistics */
+	unsigned long lines, moves;
+	double feed_time, burn_time;  // seconds
+	double travel;            // mm of rapids between feed moves
+};
+
+/* the whole job */
+struct nest {
+	struct recfile rf;        // temporary file of records, must be first
+	struct item *items;
+	int count;                // items parsed so far
+	double width, height;     // bed size, mm
+	double gap;               // mm between jobs
+	int rotate;               // jobs may be rotated
+	double xoff, yoff;        // mm, added to the bed coordinates
+	int precision;
+	double units;             // 10^precision
+	struct out out;
+
+	/* statistics */
+	double used_w, used_h;    // extent of the placed jobs
+};
+
+/* returns the time in seconds from an arbitrary origin */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* accounts for move <r> from machine position <a> in the current item's
+ * bounds, entry and exit points, and feed time, while it is parsed.
+ */
+static void nest_move(struct recfile *rf, const struct rec *r, const double a[3])
+{
+	struct nest *nt = (struct nest *)rf;
+	struct item *it = &nt->items[nt->count];
+	double lo, hi, len = 0;
+	int ax;
+
+	if (!r->g)
+		return;
+	for (ax = 0; ax < 2; ax++) {
+		len = move_range(r, a, ax, &lo, &hi);
+		if (lo < it->min[ax])
+			it->min[ax] = lo;
+		if (hi > it->max[ax])
+			it->max[ax] = hi;
+	}
+	if (!it->feed_moves) {
+		it->entry[0] = a[0];
+		it->entry[1] = a[1];
+	}
+	it->exit[0] = r->x;
+	it->exit[1] = r->y;
+	it->feed_time += len * 60.0 / r->f;
+	it->feed_moves++;
+}
+
+/* returns the lowest Y at which a box of <w> x <h> mm may rest on the skyline
+ * of <n> segments <sky> with its left edge at the start of segment <i>, or
+ * HUGE_VAL if it would not be within the <bw> x <bh> mm area.
+ */
+static double sky_fit(const struct seg *sky, int n, int i, double w, double h,
+                      double bw, double bh)
+{
+	double x = sky[i].x, y = 0;
+	int j;
+
+	if (x + w > bw + PACK_EPSILON)
+		return HUGE_VAL;
+	for (j = i; j < n && sky[j].x < x + w - PACK_EPSILON; j++)
+		if (sky[j].y > y)
+			y = sky[j].y;
+	if (y + h > bh + PACK_EPSILON)
+		return HUGE_VAL;
+	return y;
+}
+
+/* raises the skyline of *<n> segments <sky> to <y> over <w> mm from the start
+ * of segment <i>, and merges the neighbours at the same height. The array must
+ * have room for one more segment.
+ */
+static void sky_add(struct seg *sky, int *n, int i, double w, double y)
+{
+	double x = sky[i].x, end = x + w;
+	int j = i;
+
+	/* the segments fully below the box are replaced, the last one shortened */
+	while (j < *n && sky[j].x + sky[j].w <= end + PACK_EPSILON)
+		j++;
+	if (j < *n && sky[j].x < end) {
+		sky[j].w -= end - sky[j].x;
+		sky[j].x = end;
+	}
+	memmove(&sky[i + 1], &sky[j], (*n - j) * sizeof(*sky));
+	*n -= j - i - 1;
+	sky[i].x = x;
+	sky[i].y = y;
+	sky[i].w = w;
+
+	if (i + 1 < *n && fabs(sky[i + 1].y - y) < PACK_EPSILON) {
+		sky[i].w += sky[i + 1].w;
+		memmove(&sky[i + 1], &sky[i + 2], (*n - i - 2) * sizeof(*sky));
+		(*n)--;
+	}
+	if (i > 0 && fabs(sky[i - 1].y - y) < PACK_EPSILON) {
+		sky[i - 1].w += sky[i].w;
+		memmove(&sky[i], &sky[i + 1], (*n - i - 1) * sizeof(*sky));
+		(*n)--;
+	}
+}
+
+/* sorts items by decreasing height, then area, then input order */
+static int cmp_items(const void *a, const void *b)
+{
+	const struct item *ia = *(const struct item **)a, *ib = *(const struct item **)b;
+	double ha = ia->max[1] - ia->min[1], hb = ib->max[1] - ib->min[1];
+	double sa = (ia->max[0] - ia->min[0]) * ha, sb = (ib->max[0] - ib->min[0]) * hb;
+
+	if (ha != hb)
+		return ha < hb ? 1 : -1;
+	if (sa != sb)
+		return sa < sb ? 1 : -1;
+	return ia < ib ? -1 : ia > ib;
+}
+
+/* places the items on the bed with the skyline bottom-left heuristic: taking
+ * the tallest first, each item goes where its top is the lowest, then the
+ * leftmost, in either orientation if rotations are allowed. Each item takes
+ * <gap> more mm on its right and top. Items without feed moves are left out.
+ * Returns the number of items which do not fit, sets *<order> to the <placed>
+ * ones.
+ */
+int pack_items(struct nest *nt, struct item ***order, int *placed)
+{
+	double bw = nt->width + nt->gap, bh = nt->height + nt->gap;
+	double w, h, y, top, best_top, best_x = 0;
+	struct item **sorted, *it;
+	int best_i = 0, best_rot = 0;
+	int n = 1, i, k, rot, count = 0, unfit = 0;
+	struct seg *sky;
+
+	sorted = calloc(nt->count + 1, sizeof(*sorted));
+	sky = calloc(nt->count + 2, sizeof(*sky));
+	if (!sorted || !sky)
+		die(1, "out of memory\n");
+
+	for (k = 0; k < nt->count; k++)
+		if (nt->items[k].feed_moves)
+			sorted[count++] = &nt->items[k];
+	qsort(sorted, count, sizeof(*sorted), cmp_items);
+
+	sky[0].w = bw;
+	for (*placed = 0, k = 0; k < count; k++) {
+		it = sorted[k];
+		best_top = HUGE_VAL;
+		for (rot = 0; rot <= nt->rotate; rot++) {
+			w = (rot ? it->max[1] - it->min[1] : it->max[0] - it->min[0]) + nt->gap;
+			h = (rot ? it->max[0] - it->min[0] : it->max[1] - it->min[1]) + nt->gap;
+			for (i = 0; i < n; i++) {
+				y = sky_fit(sky, n, i, w, h, bw, bh);
+				if (y == HUGE_VAL)
+					continue;
+				top = y + h;
+				if (top < best_top - PACK_EPSILON ||
+				    (top < best_top + PACK_EPSILON && sky[i].x < best_x)) {
+					best_top = top;
+					best_x = sky[i].x;
+					best_i = i;
+					best_rot = rot;
+				}
+			}
+		}
+
+		if (best_top == HUGE_VAL) {
+			if (!unfit++)
+				fprintf(stderr, "'%s' does not fit on the bed\n", it->name);
+			continue;
+		}
+
+		it->rot = best_rot;
+		w = (it->rot ? it->max[1] - it->min[1] : it->max[0] - it->min[0]) + nt->gap;
+		h = (it->rot ? it->max[0] - it->min[0] : it->max[1] - it->min[1]) + nt->gap;
+		it->px = best_x;
+		it->py = best_top - h;
+		sky_add(sky, &n, best_i, w, best_top);
+		if (it->px + w - nt->gap > nt->used_w)
+			nt->used_w = it->px + w - nt->gap;
+		if (best_top - nt->gap > nt->used_h)
+			nt->used_h = best_top - nt->gap;
+		sorted[(*placed)++] = it;
+	}
+
+	free(sky);
+	*order = sorted;
+	return unfit;
+}
+
+/* converts position <a> of item <it> to bed coordinates in <p> */
+static void item_point(const struct item *it, const double a[2], double p[2])
+{
+	if (it->rot) {
+		p[0] = it->px + it->max[1] - a[1];
+		p[1] = it->py + a[0] - it->min[0];
+	}
+	else {
+		p[0] = it->px + a[0] - it->min[0];
+		p[1] = it->py + a[1] - it->min[1];
+	}
+}
+
+/* returns the length of the travel from the exit of item <a> to the entry of
+ * item <b>, either being the bed's origin when NULL.
+ */
+static double item_travel(const struct item *a, const struct item *b)
+{
+	double p[2] = { 0, 0 }, q[2] = { 0, 0 };
+
+	if (a)
+		item_point(a, a->exit, p);
+	if (b)
+		item_point(b, b->entry, q);
+	return hypot(q[0] - p[0], q[1] - p[1]);
+}
+
+/* returns the length of the travels along the <n> items of <order>, from and
+ * back to the origin.
+ */
+static double order_travel(struct item **order, int n)
+{
+	double len = 0;
+	int i;
+
+	for (i = 0; i <= n; i++)
+		len += item_travel(i ? order[i - 1] : NULL, i < n ? order[i] : NULL);
+	return len;
+}
+
+/* orders the <n> items of <order> to shorten the travels between them, from
+ * and back to the origin. The nearest item is always picked next, then items
+ * are moved where they shorten the path the most until no move helps.
+ */
+void order_items(struct item **order, int n)
+{
+	struct item *it, *prev = NULL;
+	double d, best, gain;
+	int i, j, k, pass, moved;
+
+	for (i = 0; i < n; i++) {
+		for (best = HUGE_VAL, k = j = i; j < n; j++) {
+			d = item_travel(prev, order[j]);
+			if (d < best) {
+				best = d;
+				k = j;
+			}
+		}
+		it = order[k];
+		order[k] = order[i];
+		order[i] = it;
+		prev = it;
+	}
+
+	for (pass = 0; pass < ORDER_PASSES; pass++) {
+		for (moved = 0, i = 0; i < n; i++) {
+			it = order[i];
+			gain = item_travel(i ? order[i - 1] : NULL, it) +
+			       item_travel(it, i + 1 < n ? order[i + 1] : NULL) -
+			       item_travel(i ? order[i - 1] : NULL, i + 1 < n ? order[i + 1] : NULL);
+
+			/* look for the best place between the other items */
+			memmove(&order[i], &order[i + 1], (n - i - 1) * sizeof(*order));
+			for (best = HUGE_VAL, k = i, j = 0; j < n; j++) {
+				struct item *a = j ? order[j - 1] : NULL, *b = j < n - 1 ? order[j] : NULL;
+
+				d = item_travel(a, it) + item_travel(it, b) - item_travel(a, b);
+				if (d < best) {
+					best = d;
+					k = j;
+				}
+			}
+			if (best >= gain - 1e-6)
+				k = i;
+			else
+				moved++;
+			memmove(&order[k + 1], &order[k], (n - k - 1) * sizeof(*order));
+			order[k] = it;
+		}
+		if (!moved)
+			break;
+	}
+}
+
+/* converts position <a> of item <it> to output units */
+static void to_units(const struct nest *nt, const struct item *it, const double a[3],
+                     long long u[3])
+{
+	double p[2];
+
+	item_point(it, a, p);
+	u[0] = llround((p[0] + nt->xoff) * nt->units);
+	u[1] = llround((p[1] + nt->yoff) * nt->units);
+	u[2] = llround(a[2] * nt->units);
+}
+
+/* appends word <c> with a value of <n> units at <o>, returns the new end */
+static char *put_word(const struct nest *nt, char *o, int c, long long n)
+{
+	*o++ = c;
+	return fmt_units(o, n, nt->precision);
+}
+
+/* writes the line from <buf> to <end> to the output */
+static void put_line(struct out *out, const char *buf, const char *end)
+{
+	if (fwrite(buf, 1, end - buf, out->file) != (size_t)(end - buf))
+		die(1, "write error\n");
+	out->lines++;
+}
+
+/* writes the lines in string <str> to the output */
+static void put_str(struct out *out, const char *str)
+{
+	put_line(out, str, str + strlen(str));
+}
+
+/* moves the head to <u> with rapids. It first rises to the highest Z the input
+ * reached since the last feed move and only descends at the end, so that it
+ * remains safe for milling.
+ */
+static void travel(const struct nest *nt, struct out *out, const long long u[3])
+{
+	long long top = out->ztop;
+	char buf[128], *o;
+
+	if (out->z > top)
+		top = out->z;
+	if (u[2] > top)
+		top = u[2];
+
+	if (top != out->z) {
+		o = put_word(nt, buf + sprintf(buf, "G0"), 'Z', top);
+		*o++ = '\n';
+		put_line(out, buf, o);
+	}
+	if (!out->known || u[0] != out->x || u[1] != out->y) {
+		o = put_word(nt, buf + sprintf(buf, "G0"), 'X', u[0]);
+		o = put_word(nt, o, 'Y', u[1]);
+		*o++ = '\n';
+		put_line(out, buf, o);
+		if (out->known)
+			out->travel += hypot(u[0] - out->x, u[1] - out->y) / nt->units;
+	}
+	if (u[2] != top) {
+		o = put_word(nt, buf + sprintf(buf, "G0"), 'Z', u[2]);
+		*o++ = '\n';
+		put_line(out, buf, o);
+	}
+	out->x = u[0];
+	out->y = u[1];
+	out->z = u[2];
+	out->g = 0;
+	out->known = 1;
+}
+
+/* writes move <r> of item <it> from <a> to <b>, of length <len>. Modal words
+ * are only written when they differ from the output's state.
+ */
+static void burn(const struct nest *nt, struct out *out, const struct item *it,
+                 const struct rec *r, const double a[3], const double b[3], double len)
+{
+	long long ua[3], ub[3], uc[3];
+	char buf[256], *o = buf;
+	double t;
+
+	to_units(nt, it, a, ua);
+	to_units(nt, it, b, ub);
+	if (r->g < 2 && ua[0] == ub[0] && ua[1] == ub[1] && ua[2] == ub[2])
+		return;
+
+	if (!out->known || ua[0] != out->x || ua[1] != out->y || ua[2] != out->z)
+		travel(nt, out, ua);
+
+	if (r->spindle != out->spindle) {
+		o += sprintf(o, "M%d\n", r->spindle);
+		out->spindle = r->spindle;
+	}
+	if (r->g != out->g) {
+		*o++ = 'G';
+		*o++ = '0' + r->g;
+		out->g = r->g;
+	}
+	if (r->g >= 2 || ub[0] != out->x)
+		o = put_word(nt, o, 'X', ub[0]);
+	if (r->g >= 2 || ub[1] != out->y)
+		o = put_word(nt, o, 'Y', ub[1]);
+	if (ub[2] != out->z)
+		o = put_word(nt, o, 'Z', ub[2]);
+	if (r->g >= 2) {
+		to_units(nt, it, (double[3]){ r->cx, r->cy, 0 }, uc);
+		o = put_word(nt, o, 'I', uc[0] - ua[0]);
+		o = put_word(nt, o, 'J', uc[1] - ua[1]);
+	}
+	if (!out->sf_known || r->s != out->s)
+		o = put_word(nt, o, 'S', llround(r->s * nt->units));
+	if (!out->sf_known || r->f != out->f)
+		o = put_word(nt, o, 'F', llround(r->f * nt->units));
+	*o++ = '\n';
+	put_line(out, buf, o);
+
+	out->x = ub[0];
+	out->y = ub[1];
+	out->z = ub[2];
+	out->ztop = ub[2];
+	out->s = r->s;
+	out->f = r->f;
+	out->sf_known = 1;
+
+	t = len * 60.0 / r->f;
+	out->feed_time += t;
+	if (r->spindle != 5 && r->s > 0)
+		out->burn_time += t;
+	out->moves++;
+}
+
+/* writes item <it> in its place by replaying its records */
+void write_item(struct nest *nt, const struct item *it)
+{
+	struct out *out = &nt->out;
+	double a[3] = { 0, 0, 0 }, b[3], lo, hi, len;
+	unsigned long n;
+	long long z;
+	struct rec r;
+
+	if (fseeko(nt->rf.tmp, it->start, SEEK_SET) != 0)
+		die(1, "cannot read the temporary file\n");
+
+	for (n = 0; n < it->records && get_rec(&nt->rf, &r); n++) {
+		if (r.kind != REC_MOVE) {
+			nt->rf.text[r.len] = '\n';
+			put_line(out, nt->rf.text, nt->rf.text + r.len + 1);
+			if (r.homing)
+				out->known = 0;
+			continue;
+		}
+
+		b[0] = r.x;
+		b[1] = r.y;
+		b[2] = r.z;
+		if (r.g) {
+			len = move_range(&r, a, 0, &lo, &hi);
+			burn(nt, out, it, &r, a, b, len);
+		}
+		if (b[2] != a[2]) {
+			z = llround(b[2] * nt->units);
+			if (z > out->ztop)
+				out->ztop = z;
+		}
+		memcpy(a, b, sizeof(a));
+	}
+}
+
+void report(const struct nest *nt, struct item **order, int placed, double in_order,
+            double start)
+{
+	const struct item *it;
+	int i;
+
+	for (i = 0; i < placed; i++) {
+		it = order[i];
+		fprintf(stderr, "%s: %.1f x %.1f mm at X%.3f Y%.3f%s, %.1fs feeding\n", it->name,
+		        it->max[0] - it->min[0], it->max[1] - it->min[1],
+		        it->px + nt->xoff, it->py + nt->yoff, it->rot ? " rotated" : "",
+		        it->feed_time);
+	}
+	fprintf(stderr, "input: %d jobs, %lu moves, %lu lines kept as text\n",
+	        nt->count, nt->rf.moves, nt->rf.texts);
+	fprintf(stderr, "bed: %d jobs within %.1f x %.1f mm, %.1f%% of %g x %g mm\n",
+	        placed, nt->used_w, nt->used_h,
+	        100.0 * nt->used_w * nt->used_h / (nt->width * nt->height),
+	        nt->width, nt->height);
+	fprintf(stderr, "travels between jobs: %.0f mm, %.0f mm in input order\n",
+	        order_travel(order, placed), in_order);
+	fprintf(stderr, "output: %lu lines, %lu moves, %.1fs feeding, %.1fs burning, "
+	        "%.0f mm of rapids\n", nt->out.lines, nt->out.moves, nt->out.feed_time,
+	        nt->out.burn_time, nt->out.travel);
+	fprintf(stderr, "nested in %.3fs\n", now() - start);
+}
+
+void usage(int code, const char *cmd)
+{
+	die(code,
+	    "Usage: %s [args*] file.gcode... > merged.gcode\n"
+	    "Places the jobs on the bed without overlapping and merges them.\n"
+	    "Arguments:\n"
+	    "  -h | --help             display this help message\n"
+	    "  -W | --width <mm>       bed width (def: %g)\n"
+	    "  -H | --height <mm>      bed height (def: %g)\n"
+	    "  -g | --gap <mm>         space between jobs (def: %g)\n"
+	    "  -r | --rotate           permit to rotate jobs by 90 degrees\n"
+	    "  -X | --xoff <offset>    X of the bed's left edge (def: 0.0)\n"
+	    "  -Y | --yoff <offset>    Y of the bed's bottom edge (def: 0.0)\n"
+	    "     --precision <digits> decimals of coordinates (def: %d)\n"
+	    "  -v | --verbose          report the jobs' places on stderr\n"
+	    "\n", cmd, DEFAULT_BED_WIDTH, DEFAULT_BED_HEIGHT, DEFAULT_GAP,
+	    DEFAULT_PRECISION);
+}
+
+int main(int argc, char **argv)
+{
+	struct item **order, *it;
+	struct gcode gc;
+	struct nest nt;
+	int verbose = 0, placed, unfit, fd, i, n;
+	double start, in_order;
+	unsigned long records;
+
+	memset(&nt, 0, sizeof(nt));
+	nt.width = DEFAULT_BED_WIDTH;
+	nt.height = DEFAULT_BED_HEIGHT;
+	nt.gap = DEFAULT_GAP;
+	nt.precision = DEFAULT_PRECISION;
+
+	while (1) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "hW:H:g:rX:Y:v", long_options, &option_index);
+		double arg_f = optarg ? atof(optarg) : 0.0;
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			usage(0, argv[0]);
+			break;
+
+		case 'W':
+			nt.width = arg_f;
+			if (nt.width <= 0)
+				die(1, "bed width must be positive\n");
+			break;
+
+		case 'H':
+			nt.height = arg_f;
+			if (nt.height <= 0)
+				die(1, "bed height must be positive\n");
+			break;
+
+		case 'g':
+			nt.gap = arg_f;
+			if (nt.gap < 0)
+				die(1, "gap must not be negative\n");
+			break;
+
+		case 'r':
+			nt.rotate = 1;
+			break;
+
+		case 'X':
+			nt.xoff = arg_f;
+			break;
+
+		case 'Y':
+			nt.yoff = arg_f;
+			break;
+
+		case OPT_PRECISION:
+			nt.precision = atoi(optarg);
+			if (nt.precision < 0 || nt.precision > MAX_PRECISION)
+				die(1, "precision must be within 0..%d\n", MAX_PRECISION);
+			break;
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		case ':': /* missing argument */
+		case '?': /* unknown option */
+			usage(1, argv[0]);
+		}
+	}
+
+	if (optind >= argc)
+		usage(1, argv[0]);
+
+	start = now();
+	nt.units = pow(10, nt.precision);
+	nt.items = calloc(argc - optind, sizeof(*nt.items));
+	if (!nt.items)
+		die(1, "out of memory\n");
+	recfile_init(&nt.rf, nest_move);
+
+	for (i = optind; i < argc; i++) {
+		it = &nt.items[nt.count];
+		it->name = argv[i];
+		it->start = ftello(nt.rf.tmp);
+		it->min[0] = it->min[1] = HUGE_VAL;
+		it->max[0] = it->max[1] = -HUGE_VAL;
+		records = nt.rf.moves + nt.rf.texts;
+		gcode_init(&gc);
+
+		fd = open(argv[i], O_RDONLY);
+		if (fd < 0)
+			die(1, "cannot open '%s'\n", argv[i]);
+		if (!parse_fd(&nt.rf, &gc, fd))
+			die(1, "read error on '%s'\n", argv[i]);
+		close(fd);
+		it->records = nt.rf.moves + nt.rf.texts - records;
+
+		if (gc.rejected || gc.dropped)
+			fprintf(stderr, "warning: '%s': %lu moves without a feed rate skipped, other "
+			        "words and comments dropped from %lu motion lines\n",
+			        argv[i], gc.rejected, gc.dropped);
+		if (!it->feed_moves)
+			fprintf(stderr, "warning: '%s' has no feed move, skipped\n", argv[i]);
+		nt.count++;
+	}
+
+	unfit = pack_items(&nt, &order, &placed);
+	if (unfit)
+		die(1, "%d jobs do not fit on the bed\n", unfit);
+
+	/* measure the travels in the inputs' order for the report */
+	for (n = 0, i = 0; i < nt.count; i++)
+		if (nt.items[i].feed_moves)
+			order[n++] = &nt.items[i];
+	in_order = order_travel(order, n);
+	order_items(order, placed);
+
+	nt.out.file = stdout;
+	nt.out.g = -1;
+	nt.out.spindle = -1;
+	setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+	put_str(&nt.out, "G21\n");
+	put_str(&nt.out, "G90\n");
+	for (i = 0; i < placed; i++)
+		write_item(&nt, order[i]);
+	put_str(&nt.out, "M5\n");
+	if (placed) {
+		long long u[3] = { llround(nt.xoff * nt.units), llround(nt.yoff * nt.units), nt.out.z };
+
+		travel(&nt, &nt.out, u);
+	}
+	if (fflush(stdout) != 0)
+		die(1, "write error\n");
+
+	if (verbose)
+		report(&nt, order, placed, in_order, start);
+	return 0;
+}
@@ -0,0 +1,791 @@
+/* Streams a G-CODE file to GRBL using its character counting protocol: lines
+ * are sent as long as the bytes not yet acknowledged fit in GRBL's serial RX
+ * buffer, so that the buffer never runs empty while the planner has room,
+ * unlike with the send-and-wait-for-ok method. Status reports are polled
+ * with the '?' real time command.
+ *
+ * With --simulate, the file is streamed to a fake GRBL running in a child
+ * process over a pseudo-terminal, which emulates the link speed, the RX
+ * buffer and the planner's block durations, and reports the link usage. It
+ * fails if the link idled while the parser waited or the RX buffer overflowed.
+ */
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+/* default settings, GRBL 1.1's serial link */
+#define DEFAULT_BAUD_RATE        115200
+#define DEFAULT_RX_SIZE          128     // RX_BUFFER_SIZE
+#define DEFAULT_STATUS_MS        200     // status polling interval, 0=none
+
+/* time to wait for GRBL's welcome message after opening the port, since
+ * opening it usually resets the board.
+ */
+#define STARTUP_TIMEOUT_MS       2500
+
+/* fake GRBL: planner blocks (BLOCK_BUFFER_SIZE - 1) and rate of rapids */
+#define SIM_PLANNER_BLOCKS       15
+#define SIM_RAPID_RATE           5000.0  // mm/min
+
+/* fake GRBL: longest time the link may idle while the parser waits for a
+ * line, which only covers the scheduling jitter of the simulation.
+ */
+#define SIM_MAX_GAP              0.005   // seconds
+
+/* I/O buffer sizes. The input buffer grows if a line does not fit. */
+#define INPUT_BUFFER_SIZE        (1 << 20)
+#define RESPONSE_SIZE            256
+
+/* long options without a short equivalent */
+enum {
+	OPT_SIMULATE = 256,
+};
+
+const struct option long_options[] = {
+	{"help",        no_argument,       0, 'h'              },
+	{"baud",        required_argument, 0, 'b'              },
+	{"rx-size",     required_argument, 0, 'r'              },
+	{"status",      required_argument, 0, 's'              },
+	{"verbose",     no_argument,       0, 'v'              },
+	{"simulate",    no_argument,       0, OPT_SIMULATE     },
+	{0,             0,                 0, 0                }
+};
+
+/* buffered reader of the G-CODE input */
+struct input {
+	int fd;
+	char *buf;
+	size_t size, start, len;  // pending data at buf+start
+	int eof;
+	unsigned long line;       // number of the last line returned
+};
+
+/* the sender's state. <pending> holds the lengths of the lines sent and not
+ * acknowledged yet, in sending order, in a ring of <rx_size> entries since
+ * each line takes at least one byte.
+ */
+struct sender {
+	int fd;                   // serial port
+	int rx_size;
+	int verbose;
+	int *pending;
+	unsigned long *pending_line;
+	int head, count;          // ring of pending lines
+	int inflight;             // bytes sent and not acknowledged
+	char *out;                // bytes to write to the port
+	size_t out_len, out_size;
+	int want_status;          // a '?' could not be written yet
+	char resp[RESPONSE_SIZE]; // partial response line
+	size_t resp_len;
+	int banner;               // GRBL's welcome message was seen
+	int idle;                 // Idle was reported after the last ok
+	int queries;              // '?' sent and not answered yet
+	int end_query;            // reports expected until the one answering
+	                          // the first '?' sent after the last ok
+	int alarm;
+	unsigned long lines, bytes, errors, statuses;
+};
+
+/* state of the fake GRBL */
+struct fake {
+	int fd;
+	double rate;              // link speed, bytes per second
+	int rx_size;
+	char *rx;                 // RX buffer
+	int rx_len;
+	double block_end[SIM_PLANNER_BLOCKS]; // end times of queued blocks
+	int blocks;
+	double pos[3], feed;
+	int motion;
+	double start;             // time of the first byte received
+	double last;              // time of the last byte received
+	unsigned long received;   // bytes received, real time commands included
+	double gap;               // time the link idled while the parser waited
+	double wait;              // current such idle time, only counted as a
+	                          // gap once another line's bytes arrive
+	double starved;           // time the planner was empty while streaming
+	unsigned long lines, overflows;
+};
+
+__attribute__((noreturn)) void die(int code, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	exit(code);
+}
+
+/* returns the time in seconds from an arbitrary origin */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* returns the termios speed for <baud>, or 0 if unsupported */
+static speed_t baud_speed(int baud)
+{
+	switch (baud) {
+	case 9600:    return B9600;
+	case 19200:   return B19200;
+	case 38400:   return B38400;
+	case 57600:   return B57600;
+	case 115200:  return B115200;
+	case 230400:  return B230400;
+	case 460800:  return B460800;
+	case 500000:  return B500000;
+	case 921600:  return B921600;
+	case 1000000: return B1000000;
+	case 2000000: return B2000000;
+	}
+	return 0;
+}
+
+/* sets <fd> to raw mode at <baud> bauds, 8N1. Returns 0 on error. */
+static int setup_port(int fd, int baud)
+{
+	struct termios tio;
+	speed_t speed = baud_speed(baud);
+
+	if (!speed || tcgetattr(fd, &tio) < 0)
+		return 0;
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+	return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+/* returns the next line to send from <in> in *<line> with its length, without
+ * the line feed, or 0 at the end. Empty lines are skipped. Dies on error.
+ */
+static int next_line(struct input *in, char **line, size_t *len)
+{
+	char *p, *nl, *end;
+	ssize_t ret;
+
+	while (1) {
+		p = in->buf + in->start;
+		end = p + in->len;
+		nl = memchr(p, '\n', in->len);
+		if (!nl && in->eof && in->len)
+			nl = end;
+
+		if (nl) {
+			in->line++;
+			in->start += nl - p + (nl < end);
+			in->len -= nl - p + (nl < end);
+			while (nl > p && isspace((unsigned char)nl[-1]))
+				nl--;
+			while (p < nl && isspace((unsigned char)*p))
+				p++;
+			if (p == nl)
+				continue;
+			*line = p;
+			*len = nl - p;
+			return 1;
+		}
+
+		if (in->eof)
+			return 0;
+
+		/* make room and read more */
+		memmove(in->buf, in->buf + in->start, in->len);
+		in->start = 0;
+		if (in->len == in->size) {
+			in->size *= 2;
+			in->buf = realloc(in->buf, in->size);
+			if (!in->buf)
+				die(1, "out of memory\n");
+		}
+		ret = read(in->fd, in->buf + in->len, in->size - in->len);
+		if (ret < 0)
+			die(1, "read error\n");
+		if (ret == 0)
+			in->eof = 1;
+		in->len += ret;
+	}
+}
+
+/* appends <len> bytes at <data> to the sender's output */
+static void queue_output(struct sender *sd, const char *data, size_t len)
+{
+	if (sd->out_len + len > sd->out_size) {
+		sd->out_size = (sd->out_len + len) * 2;
+		sd->out = realloc(sd->out, sd->out_size);
+		if (!sd->out)
+			die(1, "out of memory\n");
+	}
+	memcpy(sd->out + sd->out_len, data, len);
+	sd->out_len += len;
+}
+
+/* writes as much pending output as the port accepts, the real time status
+ * request first. Returns 0 on error.
+ */
+static int write_output(struct sender *sd)
+{
+	ssize_t ret;
+
+	/* real time commands are picked out of the stream by GRBL and do not
+	 * use the RX buffer, so they may be sent at any time.
+	 */
+	if (sd->want_status) {
+		ret = write(sd->fd, "?", 1);
+		if (ret == 1) {
+			sd->want_status = 0;
+			sd->statuses++;
+			sd->queries++;
+			/* only a report to this one may tell the job is over */
+			if (!sd->count && !sd->out_len && !sd->end_query)
+				sd->end_query = sd->queries;
+		}
+		else if (ret < 0 && errno != EAGAIN)
+			return 0;
+	}
+
+	while (sd->out_len) {
+		ret = write(sd->fd, sd->out, sd->out_len);
+		if (ret < 0)
+			return errno == EAGAIN;
+		memmove(sd->out, sd->out + ret, sd->out_len - ret);
+		sd->out_len -= ret;
+	}
+	return 1;
+}
+
+/* sends lines from <in> as long as they fit in GRBL's RX buffer. Returns 0
+ * once the input is exhausted.
+ */
+static int fill_rx(struct sender *sd, struct input *in)
+{
+	static char *line;
+	static size_t len;
+	static int have;
+	int idx;
+
+	while (1) {
+		if (!have) {
+			if (!next_line(in, &line, &len))
+				return 0;
+			if (len + 1 > (size_t)sd->rx_size)
+				die(1, "line %lu is longer than GRBL's RX buffer\n", in->line);
+			have = 1;
+		}
+		if (sd->inflight + len + 1 > (size_t)sd->rx_size)
+			return 1;
+
+		/* the line stays valid until the next call to next_line() */
+		queue_output(sd, line, len);
+		queue_output(sd, "\n", 1);
+		idx = (sd->head + sd->count) % sd->rx_size;
+		sd->pending[idx] = len + 1;
+		sd->pending_line[idx] = in->line;
+		sd->count++;
+		sd->inflight += len + 1;
+		sd->idle = sd->end_query = 0;
+		sd->lines++;
+		sd->bytes += len + 1;
+		have = 0;
+	}
+}
+
+/* processes response line <resp> from GRBL */
+static void handle_response(struct sender *sd, const char *resp)
+{
+	int ok = strcmp(resp, "ok") == 0;
+
+	if (ok || strncmp(resp, "error:", 6) == 0) {
+		if (!sd->count) {
+			fprintf(stderr, "unexpected response '%s'\n", resp);
+			return;
+		}
+		if (!ok) {
+			fprintf(stderr, "line %lu: %s\n", sd->pending_line[sd->head], resp);
+			sd->errors++;
+		}
+		sd->inflight -= sd->pending[sd->head];
+		sd->head = (sd->head + 1) % sd->rx_size;
+		sd->count--;
+		sd->idle = sd->end_query = 0;
+	}
+	else if (*resp == '<') {
+		/* reports come in the order of the requests */
+		if (sd->queries)
+			sd->queries--;
+		if (sd->end_query && !--sd->end_query)
+			sd->idle = strncmp(resp, "<Idle", 5) == 0;
+		if (sd->verbose)
+			fprintf(stderr, "%s\n", resp);
+	}
+	else if (strncmp(resp, "ALARM:", 6) == 0) {
+		fprintf(stderr, "%s, aborting\n", resp);
+		sd->alarm = 1;
+	}
+	else if (strncmp(resp, "Grbl ", 5) == 0) {
+		sd->banner = 1;
+		if (sd->verbose)
+			fprintf(stderr, "%s\n", resp);
+	}
+	else if (*resp)
+		fprintf(stderr, "%s\n", resp);
+}
+
+/* reads and processes the responses available on the port. Returns 0 if the
+ * port was closed or failed.
+ */
+static int read_responses(struct sender *sd)
+{
+	char buf[4096];
+	ssize_t ret;
+	int i;
+
+	while (1) {
+		ret = read(sd->fd, buf, sizeof(buf));
+		if (ret < 0)
+			return errno == EAGAIN;
+		if (ret == 0)
+			return 0;
+		for (i = 0; i < ret; i++) {
+			if (buf[i] == '\n') {
+				sd->resp[sd->resp_len] = 0;
+				handle_response(sd, sd->resp);
+				sd->resp_len = 0;
+			}
+			else if (buf[i] != '\r' && sd->resp_len < RESPONSE_SIZE - 1)
+				sd->resp[sd->resp_len++] = buf[i];
+		}
+	}
+}
+
+/* streams <in> to the port in <sd>. Once everything was acknowledged, waits
+ * for GRBL to report the Idle state if status polling is enabled. Returns 0
+ * on error.
+ */
+int stream(struct sender *sd, struct input *in, int status_ms)
+{
+	struct epoll_event ev, events[4];
+	struct itimerspec its;
+	double start, elapsed, deadline;
+	int ep, tfd, n, i, more = 1, ret = 0;
+	uint64_t ticks;
+
+	ep = epoll_create1(0);
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (ep < 0 || tfd < 0)
+		return 0;
+
+	ev.events = EPOLLIN;
+	ev.data.fd = sd->fd;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, sd->fd, &ev) < 0)
+		goto out;
+	ev.data.fd = tfd;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &ev) < 0)
+		goto out;
+
+	/* wait for the welcome message of the board we probably reset */
+	deadline = now() + STARTUP_TIMEOUT_MS / 1000.0;
+	while (!sd->banner && now() < deadline) {
+		n = epoll_wait(ep, events, 4, (int)((deadline - now()) * 1000) + 1);
+		if (n > 0 && !read_responses(sd))
+			goto out;
+	}
+
+	if (status_ms) {
+		its.it_interval.tv_sec = status_ms / 1000;
+		its.it_interval.tv_nsec = status_ms % 1000 * 1000000L;
+		its.it_value = its.it_interval;
+		timerfd_settime(tfd, 0, &its, NULL);
+	}
+
+	start = now();
+	while (!sd->alarm) {
+		if (more)
+			more = fill_rx(sd, in);
+		if (!write_output(sd))
+			goto out;
+
+		/* done once everything was acknowledged and the machine stopped */
+		if (!more && !sd->count && !sd->out_len && (!status_ms || sd->idle))
+			break;
+
+		ev.events = EPOLLIN | (sd->out_len || sd->want_status ? EPOLLOUT : 0);
+		ev.data.fd = sd->fd;
+		epoll_ctl(ep, EPOLL_CTL_MOD, sd->fd, &ev);
+
+		n = epoll_wait(ep, events, 4, -1);
+		if (n < 0 && errno != EINTR)
+			goto out;
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == tfd) {
+				if (read(tfd, &ticks, sizeof(ticks)) > 0)
+					sd->want_status = 1;
+			}
+			else if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !read_responses(sd))
+				goto out;
+		}
+	}
+	ret = !sd->alarm;
+
+	elapsed = now() - start;
+	fprintf(stderr, "%lu lines, %lu bytes in %.2fs, %.0f bytes/s, %lu errors, %lu status reports\n",
+	        sd->lines, sd->bytes, elapsed, elapsed > 0 ? sd->bytes / elapsed : 0.0,
+	        sd->errors, sd->statuses);
+out:
+	close(tfd);
+	close(ep);
+	return ret;
+}
+
+/* updates the fake GRBL's parser state with line <line> and returns the time
+ * its motion takes without acceleration, or 0 if none.
+ */
+static double fake_parse(struct fake *fk, const char *line)
+{
+	const char *p = line;
+	double target[3], dist = 0, rate;
+	int moved = 0, i;
+
+	memcpy(target, fk->pos, sizeof(target));
+	while (*p) {
+		int c = toupper((unsigned char)*p++);
+		char *e;
+		double v;
+
+		if (c < 'A' || c > 'Z')
+			continue;
+		v = strtod(p, &e);
+		p = e;
+		if (c == 'G' && v >= 0 && v <= 3)
+			fk->motion = (int)v;
+		else if (c == 'F')
+			fk->feed = v;
+		else if (c >= 'X' && c <= 'Z') {
+			target[c - 'X'] = v;
+			moved = 1;
+		}
+	}
+
+	if (!moved)
+		return 0;
+	for (i = 0; i < 3; i++) {
+		dist += (target[i] - fk->pos[i]) * (target[i] - fk->pos[i]);
+		fk->pos[i] = target[i];
+	}
+	rate = fk->motion == 0 ? SIM_RAPID_RATE : fk->feed;
+	return rate > 0 ? sqrt(dist) * 60.0 / rate : 0;
+}
+
+/* retires the fake planner's blocks completed at time <t> */
+static void fake_run(struct fake *fk, double t)
+{
+	int i = 0;
+
+	while (i < fk->blocks && fk->block_end[i] <= t)
+		i++;
+	memmove(fk->block_end, fk->block_end + i, (fk->blocks - i) * sizeof(double));
+	fk->blocks -= i;
+}
+
+/* moves complete lines from the RX buffer to the planner while it has room,
+ * and acknowledges them.
+ */
+static void fake_parse_rx(struct fake *fk, double t)
+{
+	char *nl, line[256];
+	double dur, begin;
+	int len;
+
+	while (fk->blocks < SIM_PLANNER_BLOCKS && (nl = memchr(fk->rx, '\n', fk->rx_len))) {
+		len = nl - fk->rx;
+		if (len >= (int)sizeof(line))
+			len = sizeof(line) - 1;
+		memcpy(line, fk->rx, len);
+		line[len] = 0;
+		fk->rx_len -= nl + 1 - fk->rx;
+		memmove(fk->rx, nl + 1, fk->rx_len);
+		fk->lines++;
+
+		dur = fake_parse(fk, line);
+		if (dur > 0) {
+			begin = t;
+			if (fk->blocks)
+				begin = fk->block_end[fk->blocks - 1];
+			fk->block_end[fk->blocks++] = begin + dur;
+		}
+		if (write(fk->fd, "ok\r\n", 4) < 0)
+			return;
+	}
+}
+
+/* runs the fake GRBL on pty master <fd> until the other side closes it, then
+ * reports how well the link was used on stderr. Returns non-zero if the
+ * streaming was gap-free, i.e. the link never idled more than SIM_MAX_GAP
+ * while the parser waited for a line, and the RX buffer never overflowed.
+ */
+int fake_grbl(int fd, int baud, int rx_size)
+{
+	struct fake fk;
+	char buf[256];
+	double t, prev, allowed;
+	ssize_t ret;
+	int want, waiting = 0, i;
+
+	memset(&fk, 0, sizeof(fk));
+	fk.fd = fd;
+	fk.rate = baud / 10.0;
+	fk.rx_size = rx_size;
+	fk.rx = malloc(rx_size + sizeof(buf));
+	if (!fk.rx)
+		die(1, "out of memory\n");
+
+	if (write(fd, "\r\nGrbl 1.1h ['$' for help]\r\n", 28) < 0)
+		return 0;
+
+	prev = now();
+	allowed = 0;
+	while (1) {
+		usleep(200);
+		t = now();
+
+		/* the link delivers at most <rate> bytes per second. Credit is
+		 * not kept while idle, like on a real link.
+		 */
+		allowed += (t - prev) * fk.rate;
+		if (allowed > sizeof(buf))
+			allowed = sizeof(buf);
+
+		if (fk.start && !fk.blocks && t > fk.start)
+			fk.starved += t - prev;
+		fake_run(&fk, t);
+
+		want = (int)allowed;
+		ret = want ? read(fd, buf, want) : 0;
+		if (ret < 0 && errno == EIO)
+			break;          // the sender closed its side
+		if (ret < 0 && errno != EAGAIN)
+			break;
+
+		if (ret > 0) {
+			if (!fk.start)
+				fk.start = t;
+			fk.last = t;
+			fk.received += ret;
+			allowed -= ret;
+			for (i = 0; i < ret; i++) {
+				if (buf[i] == '?') {
+					char st[96];
+					int len;
+
+					len = snprintf(st, sizeof(st), "<%s|MPos:%.3f,%.3f,%.3f|Bf:%d,%d>\r\n",
+					               fk.blocks ? "Run" : "Idle", fk.pos[0], fk.pos[1], fk.pos[2],
+					               SIM_PLANNER_BLOCKS - fk.blocks, fk.rx_size - fk.rx_len);
+					if (write(fd, st, len) < 0)
+						break;
+					continue;
+				}
+				fk.gap += fk.wait;
+				fk.wait = 0;
+				if (fk.rx_len == fk.rx_size) {
+					fk.overflows++;
+					continue;
+				}
+				fk.rx[fk.rx_len++] = buf[i];
+			}
+		}
+
+		/* lost bytes leave lines unacknowledged and the sender would
+		 * wait forever, so the simulation stops there.
+		 */
+		if (fk.overflows)
+			break;
+		if (ret <= 0 && fk.start && waiting && want) {
+			/* the parser was waiting for a line since the previous
+			 * round, but nothing arrived: the link idled.
+			 */
+			fk.wait += t - prev;
+		}
+
+		fake_parse_rx(&fk, t);
+		waiting = fk.blocks < SIM_PLANNER_BLOCKS;
+		prev = t;
+	}
+
+	/* the last idle period after the end of the stream is not a gap */
+	fprintf(stderr, "fake grbl: %lu lines, %lu bytes in %.2fs, link %.1f%% busy, "
+	        "idle while waiting for lines %.3fs, planner empty %.3fs, %lu overflows\n",
+	        fk.lines, fk.received, fk.last - fk.start,
+	        fk.last > fk.start ? 100.0 * fk.received / ((fk.last - fk.start) * fk.rate) : 0.0,
+	        fk.gap, fk.starved, fk.overflows);
+	free(fk.rx);
+	return fk.lines && fk.gap <= SIM_MAX_GAP && !fk.overflows;
+}
+
+/* creates a pseudo-terminal, starts the fake GRBL on its master side in a
+ * child process and returns the slave side's file descriptor, non-blocking.
+ */
+int start_simulator(int baud, int rx_size, pid_t *pid)
+{
+	int master, slave;
+	char *name;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+		die(1, "cannot create a pseudo-terminal\n");
+	name = ptsname(master);
+	slave = name ? open(name, O_RDWR | O_NOCTTY | O_NONBLOCK) : -1;
+	if (slave < 0)
+		die(1, "cannot open the pseudo-terminal\n");
+	if (!setup_port(slave, baud))
+		die(1, "cannot set up the pseudo-terminal\n");
+
+	*pid = fork();
+	if (*pid < 0)
+		die(1, "fork failed\n");
+	if (*pid == 0) {
+		close(slave);
+		fcntl(master, F_SETFL, O_NONBLOCK);
+		exit(fake_grbl(master, baud, rx_size) ? 0 : 2);
+	}
+	close(master);
+	return slave;
+}
+
+void usage(int code, const char *cmd)
+{
+	die(code,
+	    "Usage: %s [args*] <device> [file.gcode]\n"
+	    "       %s [args*] --simulate [file.gcode]\n"
+	    "Streams the file, or stdin, to GRBL on serial port <device>.\n"
+	    "Arguments:\n"
+	    "  -h | --help             display this help message\n"
+	    "  -b | --baud <rate>      serial link speed (def: %d)\n"
+	    "  -r | --rx-size <bytes>  GRBL's RX buffer size (def: %d)\n"
+	    "  -s | --status <ms>      status polling interval, 0 to disable (def: %d)\n"
+	    "  -v | --verbose          print status reports and messages\n"
+	    "     --simulate           stream to a fake GRBL over a pseudo-terminal,\n"
+	    "                          report how busy the link was and fail if it\n"
+	    "                          idled or the RX buffer overflowed\n"
+	    "\n", cmd, cmd, DEFAULT_BAUD_RATE, DEFAULT_RX_SIZE, DEFAULT_STATUS_MS);
+}
+
+int main(int argc, char **argv)
+{
+	int baud = DEFAULT_BAUD_RATE, rx_size = DEFAULT_RX_SIZE, status_ms = DEFAULT_STATUS_MS;
+	int simulate = 0, ret, status;
+	const char *device = NULL, *file = NULL;
+	struct sender sd;
+	struct input in;
+	pid_t pid = 0;
+
+	memset(&sd, 0, sizeof(sd));
+	memset(&in, 0, sizeof(in));
+
+	while (1) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "hb:r:s:v", long_options, &option_index);
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			usage(0, argv[0]);
+			break;
+
+		case 'b':
+			baud = atoi(optarg);
+			if (!baud_speed(baud))
+				die(1, "unsupported baud rate %d\n", baud);
+			break;
+
+		case 'r':
+			rx_size = atoi(optarg);
+			if (rx_size < 2)
+				die(1, "RX buffer size must be at least 2\n");
+			break;
+
+		case 's':
+			status_ms = atoi(optarg);
+			if (status_ms < 0)
+				die(1, "status interval must not be negative\n");
+			break;
+
+		case 'v':
+			sd.verbose = 1;
+			break;
+
+		case OPT_SIMULATE:
+			simulate = 1;
+			break;
+
+		case ':': /* missing argument */
+		case '?': /* unknown option */
+			usage(1, argv[0]);
+		}
+	}
+
+	if (!simulate) {
+		if (optind >= argc)
+			usage(1, argv[0]);
+		device = argv[optind++];
+	}
+	if (optind < argc)
+		file = argv[optind];
+
+	in.fd = 0;
+	if (file) {
+		in.fd = open(file, O_RDONLY);
+		if (in.fd < 0)
+			die(1, "cannot open '%s'\n", file);
+	}
+	in.size = INPUT_BUFFER_SIZE;
+	in.buf = malloc(in.size);
+
+	sd.rx_size = rx_size;
+	sd.pending = calloc(rx_size, sizeof(*sd.pending));
+	sd.pending_line = calloc(rx_size, sizeof(*sd.pending_line));
+	if (!in.buf || !sd.pending || !sd.pending_line)
+		die(1, "out of memory\n");
+
+	if (simulate)
+		sd.fd = start_simulator(baud, rx_size, &pid);
+	else {
+		sd.fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if (sd.fd < 0)
+			die(1, "cannot open '%s'\n", device);
+		if (!setup_port(sd.fd, baud))
+			die(1, "cannot set up '%s'\n", device);
+	}
+
+	ret = stream(&sd, &in, status_ms);
+	close(sd.fd);
+	if (pid) {
+		/* the fake GRBL's verdict is the result of the simulation */
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "simulation failed: the link idled or the RX buffer overflowed\n");
+			ret = 0;
+		}
+	}
+	return ret ? 0 : 1;
+}
@@ -0,0 +1,689 @@
+/* Splits a G-CODE job into several jobs, each one covering a strip of the work
+ * area, for example to run it on multiple machines at once or on a panel too
+ * large for a single one. The strips are chosen so that each job takes about
+ * the same time at the programmed feed rates, instead of having the same size.
+ *
+ * Moves crossing a border are cut there, so that the parts put together burn
+ * the exact same paths as the original job. Each part only contains the moves
+ * within its strip, joined by rapid moves, and sets its own modal state (G
+ * mode, spindle mode, S and F) so that it runs on its own. Arcs crossing a
+ * border are turned into straight moves within GRBL's arc tolerance.
+ *
+ * The input is read only once: it is parsed into a temporary binary file of
+ * moves in absolute machine coordinates, which is replayed once to measure the
+ * time spent along the split axis and once more to write the parts.
+ */
+#include <ctype.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gcode-common.h"
+
+/* default settings */
+#define DEFAULT_PARTS            2
+#define DEFAULT_OUTPUT           "part-%d.gcode"
+#define DEFAULT_PRECISION        3
+#define MAX_PRECISION            8
+#define MAX_PARTS                1000
+
+/* output buffer size of each part */
+#define OUTPUT_BUFFER_SIZE       (1 << 16)
+
+/* number of bins of the feed time distribution along the split axis */
+#define HISTO_BINS               8192
+
+/* long options without a short equivalent */
+enum {
+	OPT_KEEP_ORIGIN = 256,
+	OPT_PRECISION,
+};
+
+const struct option long_options[] = {
+	{"help",        no_argument,       0, 'h'              },
+	{"parts",       required_argument, 0, 'n'              },
+	{"axis",        required_argument, 0, 'a'              },
+	{"output",      required_argument, 0, 'o'              },
+	{"xoff",        required_argument, 0, 'X'              },
+	{"yoff",        required_argument, 0, 'Y'              },
+	{"keep-origin", no_argument,       0, OPT_KEEP_ORIGIN  },
+	{"precision",   required_argument, 0, OPT_PRECISION    },
+	{"verbose",     no_argument,       0, 'v'              },
+	{0,             0,                 0, 0                }
+};
+
+/* one output job, covering [border[k], border[k+1]) along the split axis.
+ * Positions are in output units, i.e. including the offsets and multiplied by
+ * 10^precision.
+ */
+struct part {
+	FILE *out;
+	char *name;
+	long long x, y, z;        // head position, X and Y valid if <known>
+	long long ztop;           // highest Z the input reached since our last move
+	int known;
+	int g, spindle;           // -1 when not set yet
+	int sf_known;             // <s> and <f> were set
+	double s, f;
+	double xoff, yoff;        // mm, added to the input coordinates
+
+	/* statistics */
+	unsigned long moves, lines;
+	double feed_time, burn_time;  // seconds
+	double lo, hi;            // range of the moves along the split axis
+};
+
+/* the whole job */
+struct split {
+	struct recfile rf;        // temporary file of records, must be first
+	struct part *parts;
+	double *border;           // <n>+1 borders, the first and last are infinite
+	int n;
+	int axis;                 // 0 for X, 1 for Y
+	int precision;
+	double units;             // 10^precision
+	double pos[3];            // input head position during replays, mm
+
+	/* feed moves' bounds and time along each axis, from the parsing */
+	double min[2], max[2];
+	double feed_time;
+	unsigned long feed_moves;
+};
+
+/* accounts for move <r> from machine position <a> in the bounds and the feed
+ * time, while the input is parsed.
+ */
+static void split_move(struct recfile *rf, const struct rec *r, const double a[3])
+{
+	struct split *sp = (struct split *)rf;
+	double lo, hi, len = 0;
+	int ax;
+
+	if (!r->g)
+		return;
+	for (ax = 0; ax < 2; ax++) {
+		len = move_range(r, a, ax, &lo, &hi);
+		if (lo < sp->min[ax])
+			sp->min[ax] = lo;
+		if (hi > sp->max[ax])
+			sp->max[ax] = hi;
+	}
+	sp->feed_time += len * 60.0 / r->f;
+	sp->feed_moves++;
+}
+
+/* places the borders between the parts so that each one gets the same share
+ * of the feed time. The moves are replayed into a distribution of the feed
+ * time along the split axis, each one spreading its time evenly over the range
+ * it covers, using a difference array for the bins it fully covers.
+ */
+void place_borders(struct split *sp)
+{
+	double min = sp->min[sp->axis], max = sp->max[sp->axis];
+	double *bin, *diff, lo, hi, len, t, d, width, total, cum, target;
+	long i, i0, i1;
+	struct rec r;
+	int k;
+
+	bin = calloc(HISTO_BINS, sizeof(*bin));
+	diff = calloc(HISTO_BINS + 1, sizeof(*diff));
+	if (!bin || !diff)
+		die(1, "out of memory\n");
+
+	if (!(max > min)) {
+		/* nothing to split, or everything on a single line */
+		min = sp->feed_moves ? min - 0.5 : 0;
+		max = min + 1;
+	}
+	width = (max - min) / HISTO_BINS;
+
+	rewind(sp->rf.tmp);
+	memset(sp->pos, 0, sizeof(sp->pos));
+	while (get_rec(&sp->rf, &r)) {
+		if (r.kind != REC_MOVE)
+			continue;
+		if (r.g) {
+			len = move_range(&r, sp->pos, sp->axis, &lo, &hi);
+			t = len * 60.0 / r.f;
+			i0 = (lo - min) / width;
+			i1 = (hi - min) / width;
+			i0 = i0 < 0 ? 0 : i0 >= HISTO_BINS ? HISTO_BINS - 1 : i0;
+			i1 = i1 < 0 ? 0 : i1 >= HISTO_BINS ? HISTO_BINS - 1 : i1;
+			if (i0 == i1)
+				bin[i0] += t;
+			else {
+				d = t / (hi - lo);
+				bin[i0] += d * (min + (i0 + 1) * width - lo);
+				bin[i1] += d * (hi - min - i1 * width);
+				diff[i0 + 1] += d * width;
+				diff[i1] -= d * width;
+			}
+		}
+		sp->pos[0] = r.x;
+		sp->pos[1] = r.y;
+		sp->pos[2] = r.z;
+	}
+
+	for (d = 0, total = 0, i = 0; i < HISTO_BINS; i++) {
+		d += diff[i];
+		bin[i] += d;
+		total += bin[i];
+	}
+
+	sp->border[0] = -HUGE_VAL;
+	sp->border[sp->n] = HUGE_VAL;
+	for (k = 1, i = 0, cum = 0; k < sp->n; k++) {
+		if (total <= 0) {
+			/* no feed time at all, split the area */
+			sp->border[k] = min + (max - min) * k / sp->n;
+			continue;
+		}
+		target = total * k / sp->n;
+		while (i < HISTO_BINS - 1 && cum + bin[i] < target)
+			cum += bin[i++];
+		t = bin[i] > 0 ? (target - cum) / bin[i] : 0;
+		sp->border[k] = min + width * (i + (t < 1 ? t : 1));
+	}
+	free(diff);
+	free(bin);
+}
+
+/* returns the part containing position <u> along the split axis */
+static int part_of(const struct split *sp, double u)
+{
+	int lo = 0, hi = sp->n - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (u >= sp->border[mid])
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+/* converts machine position <a> to output units of part <p> */
+static void to_units(const struct split *sp, const struct part *p, const double a[3],
+                     long long u[3])
+{
+	u[0] = llround((a[0] + p->xoff) * sp->units);
+	u[1] = llround((a[1] + p->yoff) * sp->units);
+	u[2] = llround(a[2] * sp->units);
+}
+
+/* appends word <c> with a value of <n> units at <o>, returns the new end */
+static char *put_word(const struct split *sp, char *o, int c, long long n)
+{
+	*o++ = c;
+	return fmt_units(o, n, sp->precision);
+}
+
+/* writes the line from <buf> to <end> to part <p> */
+static void put_line(struct part *p, const char *buf, const char *end)
+{
+	if (fwrite(buf, 1, end - buf, p->out) != (size_t)(end - buf))
+		die(1, "write error on '%s'\n", p->name);
+	p->lines++;
+}
+
+/* writes the lines in string <str> to part <p> */
+static void put_str(struct part *p, const char *str)
+{
+	put_line(p, str, str + strlen(str));
+}
+
+/* moves the head of part <p> to <u> with rapids. It first rises to the highest
+ * Z the input reached since this part's last move and only descends at the
+ * end, so that it remains safe for milling.
+ */
+static void travel(const struct split *sp, struct part *p, const long long u[3])
+{
+	long long top = p->ztop;
+	char buf[128], *o;
+
+	if (p->z > top)
+		top = p->z;
+	if (u[2] > top)
+		top = u[2];
+
+	if (top != p->z) {
+		o = put_word(sp, buf + sprintf(buf, "G0"), 'Z', top);
+		*o++ = '\n';
+		put_line(p, buf, o);
+	}
+	if (!p->known || u[0] != p->x || u[1] != p->y) {
+		o = put_word(sp, buf + sprintf(buf, "G0"), 'X', u[0]);
+		o = put_word(sp, o, 'Y', u[1]);
+		*o++ = '\n';
+		put_line(p, buf, o);
+	}
+	if (u[2] != top) {
+		o = put_word(sp, buf + sprintf(buf, "G0"), 'Z', u[2]);
+		*o++ = '\n';
+		put_line(p, buf, o);
+	}
+	p->x = u[0];
+	p->y = u[1];
+	p->z = u[2];
+	p->g = 0;
+	p->known = 1;
+}
+
+/* writes the part of move <r> from <a> to <b>, of length <len>, to part <p>.
+ * <c> is the center of arcs and is NULL for straight moves. Modal words are
+ * only written when they differ from the part's own state.
+ */
+static void burn(const struct split *sp, struct part *p, const struct rec *r,
+                 const double a[3], const double b[3], const double *c, double len)
+{
+	long long ua[3], ub[3], uc[3];
+	char buf[256], *o = buf;
+	double t;
+
+	to_units(sp, p, a, ua);
+	to_units(sp, p, b, ub);
+	if (!c && ua[0] == ub[0] && ua[1] == ub[1] && ua[2] == ub[2])
+		return;
+
+	if (!p->known || ua[0] != p->x || ua[1] != p->y || ua[2] != p->z)
+		travel(sp, p, ua);
+
+	if (r->spindle != p->spindle) {
+		o += sprintf(o, "M%d\n", r->spindle);
+		p->spindle = r->spindle;
+	}
+	if (r->g != p->g) {
+		*o++ = 'G';
+		*o++ = '0' + r->g;
+		p->g = r->g;
+	}
+	if (c || ub[0] != p->x)
+		o = put_word(sp, o, 'X', ub[0]);
+	if (c || ub[1] != p->y)
+		o = put_word(sp, o, 'Y', ub[1]);
+	if (ub[2] != p->z)
+		o = put_word(sp, o, 'Z', ub[2]);
+	if (c) {
+		to_units(sp, p, (double[3]){ c[0], c[1], 0 }, uc);
+		o = put_word(sp, o, 'I', uc[0] - ua[0]);
+		o = put_word(sp, o, 'J', uc[1] - ua[1]);
+	}
+	if (!p->sf_known || r->s != p->s)
+		o = put_word(sp, o, 'S', llround(r->s * sp->units));
+	if (!p->sf_known || r->f != p->f)
+		o = put_word(sp, o, 'F', llround(r->f * sp->units));
+	*o++ = '\n';
+	put_line(p, buf, o);
+
+	p->x = ub[0];
+	p->y = ub[1];
+	p->z = ub[2];
+	p->ztop = ub[2];
+	p->s = r->s;
+	p->f = r->f;
+	p->sf_known = 1;
+
+	t = len * 60.0 / r->f;
+	p->feed_time += t;
+	if (r->spindle != 5 && r->s > 0)
+		p->burn_time += t;
+	p->moves++;
+	if (a[sp->axis] < p->lo)
+		p->lo = a[sp->axis];
+	if (a[sp->axis] > p->hi)
+		p->hi = a[sp->axis];
+	if (b[sp->axis] < p->lo)
+		p->lo = b[sp->axis];
+	if (b[sp->axis] > p->hi)
+		p->hi = b[sp->axis];
+}
+
+/* cuts the straight move <r> from <a> to <b> at the borders it crosses and
+ * writes each piece to its part.
+ */
+static void clip_line(const struct split *sp, const struct rec *r, const double a[3],
+                      const double b[3])
+{
+	int ax = sp->axis, ka = part_of(sp, a[ax]), kb = part_of(sp, b[ax]);
+	int k, step = kb > ka ? 1 : -1;
+	double len = sqrt((b[0] - a[0]) * (b[0] - a[0]) + (b[1] - a[1]) * (b[1] - a[1]) +
+	                  (b[2] - a[2]) * (b[2] - a[2]));
+	double p[3], q[3], t, tp = 0;
+	int i;
+
+	memcpy(p, a, sizeof(p));
+	for (k = ka; k != kb; k += step) {
+		double border = sp->border[step > 0 ? k + 1 : k];
+
+		t = (border - a[ax]) / (b[ax] - a[ax]);
+		for (i = 0; i < 3; i++)
+			q[i] = a[i] + (b[i] - a[i]) * t;
+		q[ax] = border;
+		burn(sp, &sp->parts[k], r, p, q, NULL, len * (t - tp));
+		memcpy(p, q, sizeof(p));
+		tp = t;
+	}
+	burn(sp, &sp->parts[kb], r, p, b, NULL, len * (1 - tp));
+}
+
+/* writes arc <r> from <a> to <b> to the part containing it, or cuts it into
+ * straight moves within the arc tolerance when it crosses a border.
+ */
+static void clip_arc(const struct split *sp, const struct rec *r, const double a[3],
+                     const double b[3])
+{
+	const double c[2] = { r->cx, r->cy };
+	double lo, hi, len, travel, p[3], q[3];
+	struct rec seg = *r;
+	long segments, n;
+	int k;
+
+	len = move_range(r, a, sp->axis, &lo, &hi);
+	k = part_of(sp, lo);
+	if (k == part_of(sp, hi)) {
+		burn(sp, &sp->parts[k], r, a, b, c, len);
+		return;
+	}
+
+	travel = arc_travel(r->g, a[0] - c[0], a[1] - c[1], b[0] - c[0], b[1] - c[1]);
+	segments = arc_segments(hypot(a[0] - c[0], a[1] - c[1]), travel, ARC_TOLERANCE);
+	seg.g = 1;
+	memcpy(p, a, sizeof(p));
+	for (n = 1; n <= segments; n++) {
+		arc_point(q, a, b, c, travel, n, segments, 0, 1, 2);
+		clip_line(sp, &seg, p, q);
+		memcpy(p, q, sizeof(p));
+	}
+}
+
+/* writes the parts by replaying the temporary file */
+void write_parts(struct split *sp)
+{
+	long long z;
+	double b[3];
+	struct rec r;
+	int k;
+
+	rewind(sp->rf.tmp);
+	memset(sp->pos, 0, sizeof(sp->pos));
+	while (get_rec(&sp->rf, &r)) {
+		if (r.kind == REC_TEXT) {
+			sp->rf.text[r.len] = '\n';
+			for (k = 0; k < sp->n; k++) {
+				put_line(&sp->parts[k], sp->rf.text, sp->rf.text + r.len + 1);
+				if (r.homing)
+					sp->parts[k].known = 0;
+			}
+			continue;
+		}
+		if (r.kind == REC_DWELL) {
+			sp->rf.text[r.len] = '\n';
+			put_line(&sp->parts[part_of(sp, sp->pos[sp->axis])], sp->rf.text,
+			         sp->rf.text + r.len + 1);
+			continue;
+		}
+
+		b[0] = r.x;
+		b[1] = r.y;
+		b[2] = r.z;
+		if (r.g == 1)
+			clip_line(sp, &r, sp->pos, b);
+		else if (r.g)
+			clip_arc(sp, &r, sp->pos, b);
+
+		if (b[2] != sp->pos[2]) {
+			z = llround(b[2] * sp->units);
+			for (k = 0; k < sp->n; k++)
+				if (z > sp->parts[k].ztop)
+					sp->parts[k].ztop = z;
+		}
+		memcpy(sp->pos, b, sizeof(b));
+	}
+}
+
+/* returns non-zero if <pattern> contains exactly one %d conversion, possibly
+ * with a width, and no other one except "%%".
+ */
+static int check_pattern(const char *pattern)
+{
+	int count = 0;
+
+	for (; *pattern; pattern++) {
+		if (*pattern != '%')
+			continue;
+		if (*++pattern == '%')
+			continue;
+		while (isdigit((unsigned char)*pattern))
+			pattern++;
+		if (*pattern != 'd')
+			return 0;
+		count++;
+	}
+	return count == 1;
+}
+
+/* creates the <n> parts' files named after <pattern> and writes their header.
+ * Unless <keep_origin> is set, each part but the first one is moved so that
+ * its strip starts at zero, in addition to the <xoff>,<yoff> offsets.
+ */
+void open_parts(struct split *sp, const char *pattern, double xoff, double yoff,
+                int keep_origin)
+{
+	struct part *p;
+	int k, len;
+
+	sp->parts = calloc(sp->n, sizeof(*sp->parts));
+	if (!sp->parts)
+		die(1, "out of memory\n");
+
+	for (k = 0; k < sp->n; k++) {
+		p = &sp->parts[k];
+		len = snprintf(NULL, 0, pattern, k + 1);
+		p->name = malloc(len + 1);
+		if (!p->name)
+			die(1, "out of memory\n");
+		snprintf(p->name, len + 1, pattern, k + 1);
+
+		p->out = fopen(p->name, "w");
+		if (!p->out)
+			die(1, "cannot create '%s'\n", p->name);
+		setvbuf(p->out, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+
+		p->xoff = xoff;
+		p->yoff = yoff;
+		if (k && !keep_origin) {
+			if (sp->axis)
+				p->yoff -= sp->border[k];
+			else
+				p->xoff -= sp->border[k];
+		}
+		p->g = -1;
+		p->spindle = -1;
+		p->lo = HUGE_VAL;
+		p->hi = -HUGE_VAL;
+		put_str(p, "G21\n");
+		put_str(p, "G90\n");
+	}
+}
+
+/* writes the parts' trailer, which stops the spindle and moves the head to
+ * where the input ends, and closes them.
+ */
+void close_parts(struct split *sp)
+{
+	struct part *p;
+	long long u[3];
+	int k;
+
+	for (k = 0; k < sp->n; k++) {
+		p = &sp->parts[k];
+		put_str(p, "M5\n");
+		if (sp->rf.moves) {
+			to_units(sp, p, sp->pos, u);
+			travel(sp, p, u);
+		}
+		if (fclose(p->out) != 0)
+			die(1, "write error on '%s'\n", p->name);
+	}
+}
+
+void report(const struct split *sp, const struct gcode *gc)
+{
+	const struct part *p;
+	int k;
+
+	fprintf(stderr, "input: %lu lines, %lu moves, %.1fs feeding, %lu lines kept as text\n",
+	        gc->line, sp->rf.moves, sp->feed_time, sp->rf.texts);
+	if (gc->rejected || gc->dropped)
+		fprintf(stderr, "warning: %lu moves without a feed rate skipped, other words "
+		        "and comments dropped from %lu motion lines\n", gc->rejected, gc->dropped);
+
+	for (k = 0; k < sp->n; k++) {
+		p = &sp->parts[k];
+		fprintf(stderr, "%s: ", p->name);
+		if (p->lo <= p->hi)
+			fprintf(stderr, "%c %.3f..%.3f, ", "XY"[sp->axis], p->lo, p->hi);
+		fprintf(stderr, "%lu lines, %lu moves, %.1fs feeding (%.1f%%), %.1fs burning\n",
+		        p->lines, p->moves, p->feed_time,
+		        sp->feed_time > 0 ? 100.0 * p->feed_time / sp->feed_time : 0.0,
+		        p->burn_time);
+	}
+}
+
+void usage(int code, const char *cmd)
+{
+	die(code,
+	    "Usage: %s [args*] [file.gcode]\n"
+	    "Splits the file, or stdin, into jobs of about the same duration, each\n"
+	    "covering a strip of the work area.\n"
+	    "Arguments:\n"
+	    "  -h | --help             display this help message\n"
+	    "  -n | --parts <n>        number of parts (def: %d)\n"
+	    "  -a | --axis <x|y>       split along this axis (def: the longest side)\n"
+	    "  -o | --output <pattern> name of the parts, %%d being the part number\n"
+	    "                          from 1 (def: %s)\n"
+	    "  -X | --xoff <offset>    add this offset to X coordinates (def: 0.0)\n"
+	    "  -Y | --yoff <offset>    add this offset to Y coordinates (def: 0.0)\n"
+	    "     --keep-origin        do not move the strips to start at zero\n"
+	    "     --precision <digits> decimals of coordinates (def: %d)\n"
+	    "  -v | --verbose          report the parts' durations on stderr\n"
+	    "\n", cmd, DEFAULT_PARTS, DEFAULT_OUTPUT, DEFAULT_PRECISION);
+}
+
+int main(int argc, char **argv)
+{
+	const char *pattern = DEFAULT_OUTPUT;
+	double xoff = 0.0, yoff = 0.0;
+	int keep_origin = 0, verbose = 0;
+	struct split sp;
+	struct gcode gc;
+	int fd;
+
+	memset(&sp, 0, sizeof(sp));
+	sp.n = DEFAULT_PARTS;
+	sp.axis = -1;
+	sp.precision = DEFAULT_PRECISION;
+
+	while (1) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "hn:a:o:X:Y:v", long_options, &option_index);
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			usage(0, argv[0]);
+			break;
+
+		case 'n':
+			sp.n = atoi(optarg);
+			if (sp.n < 1 || sp.n > MAX_PARTS)
+				die(1, "number of parts must be within 1..%d\n", MAX_PARTS);
+			break;
+
+		case 'a':
+			if (strcasecmp(optarg, "x") == 0)
+				sp.axis = 0;
+			else if (strcasecmp(optarg, "y") == 0)
+				sp.axis = 1;
+			else
+				die(1, "axis must be x or y\n");
+			break;
+
+		case 'o':
+			pattern = optarg;
+			if (!check_pattern(pattern))
+				die(1, "output pattern must contain one %%d\n");
+			break;
+
+		case 'X':
+			xoff = atof(optarg);
+			break;
+
+		case 'Y':
+			yoff = atof(optarg);
+			break;
+
+		case OPT_KEEP_ORIGIN:
+			keep_origin = 1;
+			break;
+
+		case OPT_PRECISION:
+			sp.precision = atoi(optarg);
+			if (sp.precision < 0 || sp.precision > MAX_PRECISION)
+				die(1, "precision must be within 0..%d\n", MAX_PRECISION);
+			break;
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		case ':': /* missing argument */
+		case '?': /* unknown option */
+			usage(1, argv[0]);
+		}
+	}
+
+	sp.units = pow(10, sp.precision);
+	sp.min[0] = sp.min[1] = HUGE_VAL;
+	sp.max[0] = sp.max[1] = -HUGE_VAL;
+	sp.border = calloc(sp.n + 1, sizeof(*sp.border));
+	if (!sp.border)
+		die(1, "out of memory\n");
+	recfile_init(&sp.rf, split_move);
+	gcode_init(&gc);
+
+	if (optind >= argc) {
+		if (!parse_fd(&sp.rf, &gc, 0))
+			die(1, "read error\n");
+	}
+	else {
+		fd = open(argv[optind], O_RDONLY);
+		if (fd < 0)
+			die(1, "cannot open '%s'\n", argv[optind]);
+		if (!parse_fd(&sp.rf, &gc, fd))
+			die(1, "read error\n");
+		close(fd);
+	}
+
+	if (sp.axis < 0)
+		sp.axis = sp.feed_moves && sp.max[1] - sp.min[1] > sp.max[0] - sp.min[0];
+
+	place_borders(&sp);
+	open_parts(&sp, pattern, xoff, yoff, keep_origin);
+	write_parts(&sp);
+	close_parts(&sp);
+
+	if (verbose)
+		report(&sp, &gc);
+	return 0;
+}
@@ -1,14 +1,34 @@
 /* Uses the simplified API, thus requires libpng 1.6 or above */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <math.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
 #include <png.h>
 
+#include "gcode-common.h"
+
+/* the work area's precision. Build with -DPIXEL_DOUBLE for a double precision
+ * reference, at the expense of twice the memory.
+ */
+#ifdef PIXEL_DOUBLE
+typedef double pix_t;
+#else
+typedef float pix_t;
+#endif
+
 /* default settings */
 #define DEFAULT_WIDTH            0
 #define DEFAULT_HEIGHT           0
@@ -23,6 +43,49 @@
 #define DEFAULT_ABSORPTION        0.75
 #define DEFAULT_ABSORPTION_FACTOR 2.0
 
+/* focal model: the spot diameter grows with the distance to the focal plane
+ * following the gaussian beam law d(z) = d0 * sqrt(1 + ((z - zf) / zr)^2),
+ * where d0 is the focused spot diameter, zf the focal height and zr the
+ * Rayleigh range. A zero spot diameter disables the model and keeps the
+ * historical 1-pixel beam.
+ */
+#define DEFAULT_SPOT_DIAMETER    0.0     // mm
+#define DEFAULT_FOCUS_Z          0.0     // mm
+#define DEFAULT_RAYLEIGH         1.0     // mm
+#define DEFAULT_Z_STEP           0.01    // mm, kernel cache granularity
+
+/* accuracy presets, see <qualities> below */
+#define DEFAULT_QUALITY          "normal"
+
+/* side of the square rendered by --self-check, in pixels */
+#define SELF_CHECK_SIZE          512
+
+/* number of hash buckets in the kernel cache, must be a power of two */
+#define KERNEL_CACHE_SIZE        256
+
+/* toolpath index file format */
+#define INDEX_MAGIC              "LPINDEX2"
+#define INDEX_FANOUT             16
+
+/* spindle value for full power, i.e. GRBL's $30 setting */
+#define DEFAULT_MAX_S            255
+
+/* long options without a short equivalent */
+enum {
+	OPT_QUALITY = 256,
+	OPT_CUTOFF,
+	OPT_SUBPIXEL,
+	OPT_SAMPLES,
+	OPT_SELF_CHECK,
+	OPT_ROI,
+	OPT_SAVE_INDEX,
+	OPT_LOAD_INDEX,
+	OPT_SNAPSHOT,
+	OPT_SNAPSHOT_EVERY,
+	OPT_MAX_S,
+	OPT_CURVE,
+};
+
 const struct option long_options[] = {
 	{"help",        no_argument,       0, 'h'              },
 	{"diffusion",   required_argument, 0, 'd'              },
@@ -33,16 +96,152 @@ const struct option long_options[] = {
 	{"pixel-size",  required_argument, 0, 'p'              },
 	{"beam-power",  required_argument, 0, 'P'              },
 	{"energy-density", required_argument, 0, 'e'           },
+	{"focus",       required_argument, 0, 'f'              },
+	{"rayleigh",    required_argument, 0, 'r'              },
+	{"spot",        required_argument, 0, 's'              },
+	{"z-step",      required_argument, 0, 'z'              },
+	{"quality",     required_argument, 0, OPT_QUALITY      },
+	{"cutoff",      required_argument, 0, OPT_CUTOFF       },
+	{"subpixel",    required_argument, 0, OPT_SUBPIXEL     },
+	{"samples",     required_argument, 0, OPT_SAMPLES      },
+	{"self-check",  no_argument,       0, OPT_SELF_CHECK   },
+	{"roi",         required_argument, 0, OPT_ROI          },
+	{"save-index",  required_argument, 0, OPT_SAVE_INDEX   },
+	{"load-index",  required_argument, 0, OPT_LOAD_INDEX   },
+	{"snapshot",    required_argument, 0, OPT_SNAPSHOT     },
+	{"snapshot-every", required_argument, 0, OPT_SNAPSHOT_EVERY },
+	{"max-s",       required_argument, 0, OPT_MAX_S        },
+	{"curve",       required_argument, 0, OPT_CURVE        },
 	{0,             0,                 0, 0                }
 };
 
+/* rendering accuracy knobs. Draft is meant for quick operator checks, exact
+ * serves as a regression reference and normal keeps the historical settings.
+ * Draft still diffuses heat but stops at the first ring of neighbours, the
+ * energy below the cutoff staying in the pixel, and rounds beam positions
+ * more coarsely. Exact follows the diffusion much further and aims the beam 4
+ * times per pixel. On 512x512 samples of raster and vector jobs, draft renders
+ * 13 to 25 times faster than exact, with an rms error of 4 to 19 gray levels
+ * and up to 150 on the edges of thin lines. The float or double precision of
+ * the work area is a build option (see pix_t). --self-check measures this on
+ * the input.
+ */
+struct quality {
+	const char *name;
+	float cutoff;            // energy below which add_to_pixel() stops diffusing
+	float subpixel;          // beam positions are rounded to 1/subpixel pixel
+	float samples;           // beam samples per pixel in draw_vector()
+	int lump;                // energy below the cutoff stays in the pixel
+};
+
+const struct quality qualities[] = {
+	{ "draft",  0.05,       8.0, 1.0, 1 },
+	{ "normal", 0.05,      16.0, 1.0, 0 },
+	{ "exact",  0.001,    256.0, 4.0, 0 },
+	{ NULL,     0.0,        0.0, 0.0, 0 }
+};
+
+/* deposit stamp for a given spot diameter. The kernel is (2*r+1) pixels wide
+ * and its weights sum to 1. A zero radius means the spot fits in one pixel and
+ * the regular sub-pixel burn is used instead. Kernels are cached per Z bucket.
+ */
+struct kernel {
+	struct kernel *next;     // next kernel in the same hash bucket
+	long zq;                 // quantized Z (in z_step units)
+	int r;                   // radius in pixels, 0 = in focus
+	float w[0];              // (2*r+1)^2 weights, row by row
+};
+
+/* one burning move of the toolpath, as drawn by parse_gcode(). Coordinates
+ * are kept in millimeters so that the toolpath does not depend on the pixel
+ * size. The segment's sequence number is its position in the toolpath. Large
+ * jobs have tens of millions of them, so they are stored in single precision
+ * (28 bytes): floats keep a micron over a meter, far below a pixel, and
+ * draw_segment() rounds positions to the pixel with a margin anyway.
+ */
+struct segment {
+	float x0, y0;            // start position in mm
+	float x1, y1;            // end position in mm
+	float z;                 // mid-height in mm, selects the kernel
+	float feed;              // feed rate in mm/min, 0 if unknown yet
+	int32_t s;               // spindle speed
+};
+
+/* growable list of segments in sequence order */
+struct toolpath {
+	struct segment *seg;
+	size_t count;
+	size_t size;
+};
+
+/* toolpath index file: the header is followed by the segments in sequence
+ * order, then by their numbers sorted in spatial order (both together take
+ * 32 bytes per segment, keeping the nodes aligned), then by the nodes of a packed R-tree built bottom-up. Nodes are stored
+ * level by level starting with the leaves, the root being the last one. A
+ * leaf node designates <count> entries of the sorted numbers starting at
+ * <first>, other nodes designate <count> nodes of the level below starting
+ * at <first>. The file uses the host's byte order.
+ */
+struct index_header {
+	char magic[8];           // INDEX_MAGIC
+	uint64_t nseg;           // number of segments
+	uint64_t nnodes;         // number of nodes
+	double zmin, zmax;       // Z range of all segments
+};
+
+struct index_node {
+	double x0, y0, x1, y1;   // bounding box in mm
+	uint32_t first;          // first entry or child node
+	uint16_t count;          // number of entries or child nodes
+	uint16_t leaf;           // non-zero for leaf nodes
+};
+
+/* a loaded (mapped) toolpath index */
+struct index {
+	const struct index_header *hdr;
+	const struct segment *seg;
+	const uint32_t *order;
+	const struct index_node *node;
+	size_t size;
+};
+
+/* progressive preview snapshots. <buf> holds the gray levels of the whole
+ * area as of the last snapshot and only the area's dirty rectangle is
+ * converted again. It covers more than the area so that a growing area does
+ * not have to be reallocated on every snapshot, but files only cover the area.
+ * PGM files are kept open and only the changed rows are patched in place as
+ * long as the area does not change. PNG files are encoded in full each time,
+ * so PGM is preferred for frequent snapshots of large images.
+ */
+struct snapshot {
+	const char *pattern;     // file name, may contain a %d counter
+	int numbered;            // non-zero if <pattern> contains the counter
+	long every_lines;        // lines between snapshots, 0 = never
+	double every_sec;        // seconds between snapshots, 0 = never
+	double last;             // time of the last snapshot
+	long lines;              // lines processed since the last snapshot
+	int count;               // number of snapshots taken
+	uint8_t *buf;            // gray levels, white outside the area
+	int x0, x1;              // geometry of <buf>, covers the area
+	int y0, y1;
+	int fd;                  // PGM file being patched, or -1
+	int fx0, fx1;            // area covered by the PGM file
+	int fy0, fy1;
+	int crop;                // non-zero if files only cover cx0..cy1
+	int cx0, cx1;            // region of interest
+	int cy0, cy1;
+};
+
+/* set by SIGUSR1 to request a snapshot */
+static volatile sig_atomic_t snapshot_requested;
+
 /* describes an image with upgradable dimensions, possibly supporting negative
  * coordinates.
  */
 struct img {
 	int x0, x1; // x0 <= x1
 	int y0, y1; // y0 <= y1
-	float *area;
+	pix_t *area;
 	float absorption; // 0..1, depends on the material
 	float absorption_factor; //-x..+x, depends on the material
 	float diffusion_lin;     // linear diffusion (ratio of power sent over 1px dist)
@@ -52,27 +251,37 @@ struct img {
 	float pixel_energy;      // energy per pixel in Joule
 	float beam_power;        // beam power in watts
 	float energy_density;    // minimum marking energy in J/px^2
+	float cutoff;            // diffusion recursion cutoff
+	int lump;                // keep the energy below the cutoff in place
+	float subpixel;          // sub-pixel rounding of beam positions
+	float sample_step;       // distance between beam samples in pixels
+	float spot_dia;          // focused spot diameter in mm, 0 = 1 pixel
+	float focus_z;           // Z height of the focal plane in mm
+	float rayleigh;          // Rayleigh range in mm
+	float z_step;            // Z quantization step of the kernel cache in mm
+	const struct kernel *kernel;  // current stamp, NULL if in focus
+	long kernel_zq;               // Z bucket of <kernel>
+	int kernel_valid;             // non-zero once <kernel> was looked up
+	float *kernel_work;           // work area for the stamp being burnt
+	int fixed;                    // non-zero if the area must not grow
+	struct toolpath *record;      // if not NULL, drawn segments are appended
+	struct snapshot *snap;        // if not NULL, progressive snapshots
+	int dx0, dx1;                 // dirty rectangle since last snapshot,
+	int dy0, dy1;                 // empty when dx0 > dx1
+	int kernel_work_size;         // number of floats in kernel_work
+	const struct curve *curve;    // if not NULL, maps spindle values
+	float max_s;                  // spindle value for full power
+	struct kernel *kcache[KERNEL_CACHE_SIZE];
 };
 
 
-/* display the message and exit with the code */
-__attribute__((noreturn)) void die(int code, const char *format, ...)
-{
-	va_list args;
-
-	va_start(args, format);
-	vfprintf(stderr, format, args);
-	va_end(args);
-	exit(code);
-}
-
 /* write the buffer as a <width>x<height> grayscale image into file <file>,
- * or to stdout if <file> is NULL. The image will go from top to bottom to
- * accommodate from GCODE's image directions, but this can be changed by
- * setting the row_stride argument to 1 instead of -1. Returns non-zero on
- * success, otherwise zero.
+ * or to stdout if <file> is NULL. Rows start every <stride> bytes, which is at
+ * least <width>. The image will go from top to bottom to accommodate from
+ * GCODE's image directions, but this can be changed by setting the row_stride
+ * argument to 1 instead of -1. Returns non-zero on success, otherwise zero.
  */
-int write_gs_file(const char *file, int width, int height, const uint8_t *buffer)
+int write_gs_file(const char *file, int width, int height, int stride, const uint8_t *buffer)
 {
 	const int row_stride = -1; // bottom to top
 	png_image image;
@@ -85,9 +294,9 @@ int write_gs_file(const char *file, int width, int height, const uint8_t *buffer
 	image.format  = PNG_FORMAT_GRAY;
 
 	if (file)
-		ret = png_image_write_to_file(&image, file, 0, buffer, row_stride * width, NULL);
+		ret = png_image_write_to_file(&image, file, 0, buffer, row_stride * stride, NULL);
 	else
-		ret = png_image_write_to_stdio(&image, stdout, 0, buffer, row_stride * width, NULL);
+		ret = png_image_write_to_stdio(&image, stdout, 0, buffer, row_stride * stride, NULL);
 	return ret;
 }
 
@@ -102,10 +311,7 @@ int crop_gs_image(uint8_t *buffer, int w, int h, int x0, int y0, int x1, int y1)
 {
 	int row_pre, row_post;
 	uint8_t *src, *dst;
-
-	const int row_stride = -1; // bottom to top
-	png_image image;
-	int x, y, ret;
+	int x, y;
 
 	if (w <= 0 || x0 < 0 || x1 < 0 || x0 >= w || x1 >= w || x0 > x1)
 		return 0;
@@ -114,7 +320,7 @@ int crop_gs_image(uint8_t *buffer, int w, int h, int x0, int y0, int x1, int y1)
 		return 0;
 
 	row_pre = x0;
-	row_post = h - 1 - x1;
+	row_post = w - 1 - x1;
 
 	src = dst = buffer;
 	src += y0 * w;
@@ -136,7 +342,7 @@ int crop_gs_image(uint8_t *buffer, int w, int h, int x0, int y0, int x1, int y1)
  */
 int extend_img(struct img *img, int nx0, int ny0, int nx1, int ny1)
 {
-	float *new_area;
+	pix_t *new_area;
 	int nw, nh;
 	int ow, oh;
 	int x, y;
@@ -157,6 +363,16 @@ int extend_img(struct img *img, int nx0, int ny0, int nx1, int ny1)
 		ny1 = y;
 	}
 
+	if (!img->area) {
+		/* not initialized yet */
+		img->x0 = nx0;
+		img->y0 = ny0;
+		img->x1 = nx1;
+		img->y1 = ny1;
+		img->area = calloc((nx1 + 1 - nx0) * (ny1 + 1 - ny0), sizeof(*img->area));
+		return img->area != NULL;
+	}
+
 	if (nx0 > img->x0)
 		nx0 = img->x0;
 
@@ -208,6 +424,26 @@ int extend_img(struct img *img, int nx0, int ny0, int nx1, int ny1)
 	return 1;
 }
 
+/* looks up quality preset <name>, returns NULL if not found */
+const struct quality *find_quality(const char *name)
+{
+	const struct quality *q;
+
+	for (q = qualities; q->name; q++)
+		if (strcmp(q->name, name) == 0)
+			return q;
+	return NULL;
+}
+
+/* applies the accuracy settings of preset <q> to <img> */
+void apply_quality(struct img *img, const struct quality *q)
+{
+	img->cutoff = q->cutoff;
+	img->lump = q->lump;
+	img->subpixel = q->subpixel;
+	img->sample_step = 1.0 / q->samples;
+}
+
 /* add energy <value> to pixel at <x,y> */
 static inline void add_to_pixel(struct img *img, int x0, int y0, float value)
 {
@@ -219,13 +455,20 @@ static inline void add_to_pixel(struct img *img, int x0, int y0, float value)
 	ny1 = (y0 > img->y1) ? y0 : img->y1;
 
 	if (nx0 != img->x0 || nx1 != img->x1 || ny0 != img->y0 || ny1 != img->y1) {
-		if (!extend_img(img, nx0, ny0, nx1, ny1))
+		if (img->fixed || !extend_img(img, nx0, ny0, nx1, ny1))
 			return;
 	}
 
-	img->area[(y0 - img->y0) * (img->x1 - img->x0 + 1) + (x0 - img->x0)] += value * img->diffusion;
+	/* with <lump>, the energy which stops diffusing stays in the pixel */
+	img->area[(y0 - img->y0) * (img->x1 - img->x0 + 1) + (x0 - img->x0)] +=
+		(img->lump && value < img->cutoff) ? value : value * img->diffusion;
+
+	if (x0 < img->dx0) img->dx0 = x0;
+	if (x0 > img->dx1) img->dx1 = x0;
+	if (y0 < img->dy0) img->dy0 = y0;
+	if (y0 > img->dy1) img->dy1 = y0;
 
-	if (value < 0.05)
+	if (value < img->cutoff)
 		return;
 
 	add_to_pixel(img, x0 - 1, y0 - 1, value * img->diffusion_dia * img->diffusion);
@@ -240,8 +483,163 @@ static inline void add_to_pixel(struct img *img, int x0, int y0, float value)
 	add_to_pixel(img, x0 + 1, y0 + 1, value * img->diffusion_dia * img->diffusion);
 }
 
+/* returns the spot diameter in pixels at height <z> in mm */
+static double spot_pixels(const struct img *img, double z)
+{
+	double dz = (z - img->focus_z) / img->rayleigh;
+
+	return img->spot_dia * sqrt(1.0 + dz * dz) / img->pixel_size;
+}
+
+/* returns the deposit stamp to use at height <z> (in mm), and makes it the
+ * current one. Kernels are computed once per Z bucket of img->z_step mm and
+ * kept in a hash table, so that jobs alternating between many Z levels never
+ * recompute them. NULL is returned when the spot fits in a pixel, in which
+ * case the regular sub-pixel burn applies.
+ */
+static const struct kernel *get_kernel(struct img *img, double z)
+{
+	struct kernel *k;
+	unsigned int bucket;
+	double dia, rad;
+	float sum;
+	long zq;
+	int r, kw, i, j;
+
+	if (img->spot_dia <= 0.0)
+		return NULL;
+
+	zq = lround(z / img->z_step);
+	if (img->kernel_valid && zq == img->kernel_zq)
+		return img->kernel;
+
+	bucket = (unsigned long)zq & (KERNEL_CACHE_SIZE - 1);
+	for (k = img->kcache[bucket]; k; k = k->next)
+		if (k->zq == zq)
+			goto found;
+
+	dia = spot_pixels(img, zq * img->z_step);
+	r   = (dia <= 1.0) ? 0 : (int)ceil(0.75 * dia);
+	kw  = 2 * r + 1;
+
+	k = malloc(sizeof(*k) + kw * kw * sizeof(*k->w));
+	if (!k)
+		die(1, "out of memory\n");
+
+	k->zq = zq;
+	k->r  = r;
+
+	/* gaussian profile, <rad> being the 1/e^2 radius */
+	rad = dia / 2.0;
+	sum = 0.0;
+	for (j = 0; j < kw; j++) {
+		for (i = 0; i < kw; i++) {
+			double d2 = (i - r) * (i - r) + (j - r) * (j - r);
+			k->w[j * kw + i] = exp(-2.0 * d2 / (rad * rad));
+			sum += k->w[j * kw + i];
+		}
+	}
+	for (i = 0; i < kw * kw; i++)
+		k->w[i] /= sum;
+
+	/* the stamp is spread over 2x2 positions when burnt */
+	if ((kw + 1) * (kw + 1) > img->kernel_work_size) {
+		free(img->kernel_work);
+		img->kernel_work_size = (kw + 1) * (kw + 1);
+		img->kernel_work = malloc(img->kernel_work_size * sizeof(*img->kernel_work));
+		if (!img->kernel_work)
+			die(1, "out of memory\n");
+	}
+
+	k->next = img->kcache[bucket];
+	img->kcache[bucket] = k;
+ found:
+	img->kernel_zq = zq;
+	img->kernel_valid = 1;
+	img->kernel = k->r ? k : NULL;
+	return img->kernel;
+}
+
+/* same as burn() below but for a defocused beam whose energy is spread over
+ * the stamp <k> centered on (x,y). The stamp is bilinearly split over the 4
+ * closest pixel positions, then each pixel receives its share using the same
+ * absorption and marking threshold rules as the focused beam, except that the
+ * threshold is compared to the share of energy the pixel really receives.
+ */
+static int burn_kernel(struct img *img, const struct kernel *k, double x, double y, float intensity)
+{
+	float *work = img->kernel_work;
+	const int kw = 2 * k->r + 1;
+	const int ww = kw + 1;
+	int xb, yb, x0, y0, i, j, w;
+	float ax, ay, pix_energy;
+
+	x = round(x * img->subpixel) / img->subpixel;
+	y = round(y * img->subpixel) / img->subpixel;
+
+	/* pixel p is centered on p+0.5 */
+	xb = (int)floor(x - 0.5);
+	yb = (int)floor(y - 0.5);
+	ax = x - 0.5 - xb;
+	ay = y - 0.5 - yb;
+
+	memset(work, 0, ww * ww * sizeof(*work));
+	for (j = 0; j < kw; j++) {
+		for (i = 0; i < kw; i++) {
+			float v = k->w[j * kw + i];
+
+			work[j * ww + i]           += v * (1.0 - ax) * (1.0 - ay);
+			work[j * ww + i + 1]       += v * ax * (1.0 - ay);
+			work[(j + 1) * ww + i]     += v * (1.0 - ax) * ay;
+			work[(j + 1) * ww + i + 1] += v * ax * ay;
+		}
+	}
+
+	/* work[j][i] goes to pixel (x0+i, y0+j) */
+	x0 = xb - k->r;
+	y0 = yb - k->r;
+
+	if (x0 < img->x0 || x0 + ww - 1 > img->x1 || y0 < img->y0 || y0 + ww - 1 > img->y1) {
+		if (!img->fixed && !extend_img(img, x0, y0, x0 + ww - 1, y0 + ww - 1))
+			return 0;
+	}
+
+	pix_energy = intensity * img->pixel_energy;
+
+	for (j = 0; j < ww; j++) {
+		for (i = 0; i < ww; i++) {
+			float wgt = work[j * ww + i];
+			float cur, s;
+
+			if (wgt <= 0.0)
+				continue;
+
+			/* only possible on a fixed area */
+			if (x0 + i < img->x0 || x0 + i > img->x1 || y0 + j < img->y0 || y0 + j > img->y1)
+				continue;
+
+			/* add_to_pixel() may have extended the image */
+			w   = img->x1 - img->x0 + 1;
+			cur = img->area[(y0 + j - img->y0) * w + (x0 + i - img->x0)];
+
+			s = wgt * (img->absorption + img->absorption_factor * cur);
+			if (img->absorption_factor < 0.0 && s < 0.0)
+				s = 0.0;
+			s *= intensity;
+			if (s > 1.0)
+				s = 1.0;
+			s *= img->sample_step;
+
+			if (pix_energy * wgt >= img->energy_density * (1.0 - sqrt(cur)))
+				add_to_pixel(img, x0 + i, y0 + j, s);
+		}
+	}
+	return 1;
+}
+
 /* mark the 1x1 area around (x,y) as burnt, taking the intensity and overlap
- * into account. There can be up to 4 pixels affected.
+ * into account. There can be up to 4 pixels affected. When the beam is out of
+ * focus, the current kernel is used instead.
  */
 static inline int burn(struct img *img, double x, double y, float intensity)
 {
@@ -251,14 +649,18 @@ static inline int burn(struct img *img, double x, double y, float intensity)
 	float pix_energy;         // pixel energy in J
 	double dx, dy;
 
+	if (img->kernel)
+		return burn_kernel(img, img->kernel, x, y, intensity);
+
 	/* depending on the rounding resulting from non-integer pixel sizes, we
 	 * can have some rounding issues below due to tiny fractional parts
 	 * causing some pixels to happen at the wrong place (often a line).
 	 * We don't need too much sub-pixel precision, and rounding to 1/16
-	 * of a pixel seems to solve all problems even with pixels of 7/80mm.
+	 * of a pixel (normal quality) seems to solve all problems even with
+	 * pixels of 7/80mm.
 	 */
-	x = round(x * 16.0) / 16.0;
-	y = round(y * 16.0) / 16.0;
+	x = round(x * img->subpixel) / img->subpixel;
+	y = round(y * img->subpixel) / img->subpixel;
 
 	x0 = (int)floor(x);
 	x1 = x0 + 1;
@@ -267,6 +669,8 @@ static inline int burn(struct img *img, double x, double y, float intensity)
 	y1 = y0 + 1;
 
 	if (x0 < img->x0 || x1 > img->x1 || y0 < img->y0 || y1 > img->y1) {
+		if (img->fixed)
+			return 1;
 		if (!extend_img(img, x0, y0, x1, y1))
 			return 0;
 	}
@@ -330,6 +734,12 @@ static inline int burn(struct img *img, double x, double y, float intensity)
 	if (s10 > 1.0) s10 = 1.0;
 	if (s11 > 1.0) s11 = 1.0;
 
+	/* each sample only covers its share of the pixel */
+	s00 *= img->sample_step;
+	s01 *= img->sample_step;
+	s10 *= img->sample_step;
+	s11 *= img->sample_step;
+
 	/* let's calculate this pixel's energy and the marking threshold */
 	pix_energy = intensity * img->pixel_energy;
 
@@ -357,6 +767,61 @@ static inline int burn(struct img *img, double x, double y, float intensity)
 	return 1;
 }
 
+/* returns the number of pixels around a burnt one that diffusion may reach,
+ * based on the recursion cutoff of add_to_pixel().
+ */
+int diffusion_reach(const struct img *img)
+{
+	float ratio = img->diffusion * ((img->diffusion_lin > img->diffusion_dia) ?
+	                                img->diffusion_lin : img->diffusion_dia);
+	float v = img->sample_step;
+	int reach = 0;
+
+	while (v >= img->cutoff && reach < 1000) {
+		v *= ratio;
+		reach++;
+	}
+	return reach;
+}
+
+/* Liang-Barsky clipping of the vector starting at (x0,y0) and moving by
+ * (dx,dy) against the rectangle (wx0,wy0)-(wx1,wy1). On success, non-zero is
+ * returned and <t0>,<t1> are set to the visible part's parametric bounds
+ * within [0..1]. Zero is returned if the vector is totally outside.
+ */
+int clip_vector(double x0, double y0, double dx, double dy,
+                double wx0, double wy0, double wx1, double wy1,
+                double *t0, double *t1)
+{
+	const double p[4] = { -dx, dx, -dy, dy };
+	const double q[4] = { x0 - wx0, wx1 - x0, y0 - wy0, wy1 - y0 };
+	double r;
+	int i;
+
+	*t0 = 0.0;
+	*t1 = 1.0;
+	for (i = 0; i < 4; i++) {
+		if (p[i] == 0.0) {
+			if (q[i] < 0.0)
+				return 0;
+			continue;
+		}
+		r = q[i] / p[i];
+		if (p[i] < 0.0) {
+			if (r > *t1)
+				return 0;
+			if (r > *t0)
+				*t0 = r;
+		} else {
+			if (r < *t0)
+				return 0;
+			if (r < *t1)
+				*t1 = r;
+		}
+	}
+	return 1;
+}
+
 /* Draw a vector in <img> from (x0,y0) to (x1,y1) included at intensity
  * <intensity>. The principle consists in cutting the vector into 1-px large
  * steps (vert or horiz) and assigning the beam energy in the middle of each
@@ -373,6 +838,15 @@ static inline int burn(struct img *img, double x, double y, float intensity)
  *   - 1x1 around (1.0,0.75) = (0.5,0.25)-(1.5,1.25)
  *   - 1x1 around (2.0,1.25) = (1.5,0.75)-(2.5,1.75)
  *
+ * With more or less than one sample per pixel, the beam is aimed every
+ * img->sample_step pixel instead, each sample depositing its share of the
+ * energy.
+ *
+ * On a fixed area, the vector is first clipped to the area extended by the
+ * beam's reach, and only the beam positions in this range are visited. They
+ * remain the same as for the whole vector so that the result does not depend
+ * on clipping.
+ *
  * Returns non-zero if OK, 0 on error.
  *
  * Example, with movement from location F (0,0) to T (4,2):
@@ -389,12 +863,19 @@ static inline int burn(struct img *img, double x, double y, float intensity)
  */
 int draw_vector(struct img *img, double x0, double y0, double x1, double y1, double intensity)
 {
+	double step = img->sample_step;
 	double dx = x1 - x0;
 	double dy = y1 - y0;
+	double t0 = 0.0, t1 = 1.0;
+	double margin;
+	long k;
 
 	if (!dx && !dy)
 		return 1;
 
+	/* the beam spreads up to the kernel radius plus the 2x2 split */
+	margin = (img->kernel ? img->kernel->r : 0) + 2;
+
 	if (fabs(dx) >= fabs(dy)) {
 		/* must visit all X places */
 		double x, y;
@@ -405,9 +886,18 @@ int draw_vector(struct img *img, double x0, double y0, double x1, double y1, dou
 			x1 = x0 + dx;
 		}
 
-		for (x = x0 + 0.5; x < x1 + 0.5; x += 1.0) {
+		if (img->fixed &&
+		    !clip_vector(x0, y0, dx, dy, img->x0 - margin, img->y0 - margin,
+		                 img->x1 + margin, img->y1 + margin, &t0, &t1))
+			return 1;
+
+		k = (long)floor(t0 * dx / step) - 1;
+		if (k < 0)
+			k = 0;
+
+		for (; (x = x0 + 0.5 + k * step) < x1 + 0.5 && k * step <= t1 * dx + step; k++) {
 			/* aim the beam at (x,y) */
-			y = y0 + 0.5 + (x - x0 + 0.5 /* for mid-trip */) * dy / dx;
+			y = y0 + 0.5 + (x - x0 + step / 2 /* for mid-trip */) * dy / dx;
 			/* So beam overlaps with (x-0.5,y-0.5,x+0.5,y+0.5) */
 			if (!burn(img, x, y, intensity))
 				return 0;
@@ -422,18 +912,299 @@ int draw_vector(struct img *img, double x0, double y0, double x1, double y1, dou
 			y1 = y0 + dy;
 		}
 
-		for (y = y0 + 0.5; y < y1 + 0.5; y += 1.0) {
+		if (img->fixed &&
+		    !clip_vector(x0, y0, dx, dy, img->x0 - margin, img->y0 - margin,
+		                 img->x1 + margin, img->y1 + margin, &t0, &t1))
+			return 1;
+
+		k = (long)floor(t0 * dy / step) - 1;
+		if (k < 0)
+			k = 0;
+
+		for (; (y = y0 + 0.5 + k * step) < y1 + 0.5 && k * step <= t1 * dy + step; k++) {
 			/* aim the beam at (x, y+0.5) */
-			x = x0 + 0.5 + (y - y0 + 0.5 /* for mid-trip */) * dx / dy;
+			x = x0 + 0.5 + (y - y0 + step / 2 /* for mid-trip */) * dx / dy;
 			/* So beam overlaps with (x-0.5,y-0.5,x+0.5,y+0.5) */
 			if (!burn(img, x, y, intensity))
 				return 0;
 		}
 	}
+	return 1;
+}
+
+/* SIGUSR1 handler */
+static void request_snapshot(int sig)
+{
+	(void)sig;
+	snapshot_requested = 1;
+}
+
+/* returns the current monotonic time in seconds */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* converts the rectangle (x0,y0)-(x1,y1) of <img>'s area into gray levels in
+ * the snapshot buffer.
+ */
+static void convert_area(const struct img *img, struct snapshot *sn, int x0, int y0, int x1, int y1)
+{
+	int w = img->x1 - img->x0 + 1;
+	int bw = sn->x1 - sn->x0 + 1;
+	int x, y;
+
+	for (y = y0; y <= y1; y++) {
+		for (x = x0; x <= x1; x++) {
+			float v = img->area[(y - img->y0) * w + (x - img->x0)];
+			if (v < 0.0)
+				v = 0.0;
+			else if (v > 1.0)
+				v = 1.0;
+			sn->buf[(y - sn->y0) * bw + (x - sn->x0)] = 255 - v * 255.0;
+		}
+	}
+}
+
+/* makes the snapshot buffer cover <img>'s area, leaving some room on the sides
+ * that had to grow. The previous contents are kept. Returns non-zero on
+ * success, 0 on memory allocation error.
+ */
+static int resize_snapshot(struct snapshot *sn, const struct img *img)
+{
+	int nx0 = img->x0, ny0 = img->y0, nx1 = img->x1, ny1 = img->y1;
+	int ow = sn->x1 - sn->x0 + 1;
+	int oh = sn->y1 - sn->y0 + 1;
+	int nw, nh, y;
+	uint8_t *new_buf;
+
+	if (sn->buf) {
+		/* areas only grow, by at least half of the current size */
+		if (nx0 < sn->x0) nx0 -= ow / 2; else nx0 = sn->x0;
+		if (ny0 < sn->y0) ny0 -= oh / 2; else ny0 = sn->y0;
+		if (nx1 > sn->x1) nx1 += ow / 2; else nx1 = sn->x1;
+		if (ny1 > sn->y1) ny1 += oh / 2; else ny1 = sn->y1;
+	}
+
+	nw = nx1 - nx0 + 1;
+	nh = ny1 - ny0 + 1;
+	new_buf = malloc((size_t)nw * nh);
+	if (!new_buf)
+		return 0;
+
+	memset(new_buf, 255, (size_t)nw * nh);
+	if (sn->buf) {
+		for (y = sn->y0; y <= sn->y1; y++)
+			memcpy(new_buf + (size_t)(y - ny0) * nw + (sn->x0 - nx0),
+			       sn->buf + (size_t)(y - sn->y0) * ow, ow);
+		free(sn->buf);
+	}
+
+	sn->buf = new_buf;
+	sn->x0 = nx0; sn->y0 = ny0;
+	sn->x1 = nx1; sn->y1 = ny1;
+	return 1;
+}
+
+/* writes rows <y0> to <y1> (area coordinates) of the snapshot buffer at their
+ * place in PGM file <fd> whose header is <hdr> bytes long, and which covers
+ * the area recorded in fx0..fy1. PGM goes from top to bottom, so the rows are
+ * reversed. Returns non-zero on success.
+ */
+static int write_pgm_rows(const struct snapshot *sn, size_t hdr, int y0, int y1)
+{
+	struct iovec iov[256];
+	int bw = sn->x1 - sn->x0 + 1;
+	int w = sn->fx1 - sn->fx0 + 1;
+	int y, n;
+
+	/* start with the top row */
+	for (y = y1; y >= y0; y -= n) {
+		for (n = 0; n < 256 && y - n >= y0; n++) {
+			iov[n].iov_base = sn->buf + (size_t)(y - n - sn->y0) * bw + (sn->fx0 - sn->x0);
+			iov[n].iov_len  = w;
+		}
+		if (pwritev(sn->fd, iov, n, hdr + (size_t)(sn->fy1 - y) * w) != (ssize_t)n * w)
+			return 0;
+	}
+	return 1;
+}
+
+/* returns the number of %d conversions, possibly with a width, in snapshot
+ * file name <pattern>, or -1 if it contains any other one than "%%".
+ */
+static int check_pattern(const char *pattern)
+{
+	int count = 0;
+
+	for (; *pattern; pattern++) {
+		if (*pattern != '%')
+			continue;
+		if (*++pattern == '%')
+			continue;
+		while (isdigit((unsigned char)*pattern))
+			pattern++;
+		if (*pattern != 'd')
+			return -1;
+		count++;
+	}
+	return count;
+}
+
+/* writes the current state of <img> to the next snapshot file, cropped to the
+ * area, or to the region of interest if any. Only the dirty rectangle is
+ * converted, and for a PGM file that is still open, only the rows it covers
+ * are written. Returns non-zero on success.
+ */
+int take_snapshot(struct img *img)
+{
+	struct snapshot *sn = img->snap;
+	int x0 = img->dx0, y0 = img->dy0, x1 = img->dx1, y1 = img->dy1;
+	int ax0 = img->x0, ay0 = img->y0, ax1 = img->x1, ay1 = img->y1;
+	int pgm, bw, w, h, ret = 1;
+	char name[PATH_MAX], hdr[64];
+	size_t len;
+
+	snapshot_requested = 0;
+	sn->lines = 0;
+	sn->last = now();
+
+	if (!sn->buf || img->x0 < sn->x0 || img->y0 < sn->y0 || img->x1 > sn->x1 || img->y1 > sn->y1) {
+		/* the buffer must grow, keeping some slack */
+		if (!sn->buf) {
+			x0 = img->x0; y0 = img->y0;
+			x1 = img->x1; y1 = img->y1;
+		}
+		if (!resize_snapshot(sn, img))
+			return 0;
+	}
+
+	if (sn->crop) {
+		/* the area is fixed and contains the region of interest */
+		ax0 = sn->cx0; ay0 = sn->cy0;
+		ax1 = sn->cx1; ay1 = sn->cy1;
+	}
+
+	if (sn->fd >= 0 && (ax0 != sn->fx0 || ay0 != sn->fy0 || ax1 != sn->fx1 || ay1 != sn->fy1)) {
+		/* the area grew, the whole file will be written */
+		close(sn->fd);
+		sn->fd = -1;
+	}
+
+	bw = sn->x1 - sn->x0 + 1;
+	w = ax1 - ax0 + 1;
+	h = ay1 - ay0 + 1;
+
+	/* pixels outside a fixed area are not updated */
+	if (x0 < img->x0) x0 = img->x0;
+	if (y0 < img->y0) y0 = img->y0;
+	if (x1 > img->x1) x1 = img->x1;
+	if (y1 > img->y1) y1 = img->y1;
+
+	if (x0 <= x1 && y0 <= y1)
+		convert_area(img, sn, x0, y0, x1, y1);
+
+	img->dx0 = img->dy0 = INT_MAX;
+	img->dx1 = img->dy1 = INT_MIN;
+
+	snprintf(name, sizeof(name), sn->pattern, sn->count++);
+	len = strlen(name);
+	pgm = len >= 4 && strcasecmp(name + len - 4, ".pgm") == 0;
+
+	if (!pgm)
+		return write_gs_file(name, w, h, bw,
+		                     sn->buf + (size_t)(ay0 - sn->y0) * bw + (ax0 - sn->x0));
+
+	len = snprintf(hdr, sizeof(hdr), "P5\n%d %d\n255\n", w, h);
+
+	if (sn->fd >= 0) {
+		/* patch the changed rows only */
+		if (y0 < ay0) y0 = ay0;
+		if (y1 > ay1) y1 = ay1;
+		if (y0 <= y1)
+			ret = write_pgm_rows(sn, len, y0, y1);
+		return ret;
+	}
+
+	sn->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (sn->fd < 0)
+		return 0;
+
+	sn->fx0 = ax0; sn->fy0 = ay0;
+	sn->fx1 = ax1; sn->fy1 = ay1;
+	ret = write(sn->fd, hdr, len) == (ssize_t)len && write_pgm_rows(sn, len, sn->fy0, sn->fy1);
+
+	if (sn->numbered || !ret) {
+		close(sn->fd);
+		sn->fd = -1;
+	}
+	return ret;
+}
+
+/* to be called once per processed line or segment, takes a snapshot when one
+ * is due.
+ */
+static inline void snapshot_progress(struct img *img)
+{
+	struct snapshot *sn = img->snap;
+
+	if (!sn)
+		return;
+
+	sn->lines++;
+	if (snapshot_requested ||
+	    (sn->every_lines && sn->lines >= sn->every_lines) ||
+	    (sn->every_sec && !(sn->lines & 63) && now() - sn->last >= sn->every_sec)) {
+		if (!take_snapshot(img))
+			die(1, "failed to write snapshot\n");
+	}
+}
+
+/* draws segment <seg> in <img>, applying <power> as a power ratio and <zoom>
+ * to x & y coordinates, exactly as parse_gcode() would. Returns non-zero if
+ * OK, 0 on error.
+ */
+int draw_segment(struct img *img, const struct segment *seg, double zoom, float power)
+{
+	if (seg->feed > 0.0) {
+		// speed in mm/mn. Div 60 for mm/s. Power in Watts = J/s.
+		// pxsz in mm/px, thus P/(F/60) = J/mm. P*pxsz*60/F = J/px.
+		img->pixel_energy = img->beam_power * img->pixel_size * 60.0 / seg->feed;
+	}
+
+	get_kernel(img, seg->z);
+	return draw_vector(img,
+	                   floor(seg->x0 * zoom + zoom / 16), floor(seg->y0 * zoom + zoom / 16),
+	                   floor(seg->x1 * zoom + zoom / 16), floor(seg->y1 * zoom + zoom / 16),
+	                   seg->s / img->max_s * power);
+}
+
+/* appends segment <seg> to toolpath <tp>. Returns non-zero if OK, 0 on
+ * memory allocation error.
+ */
+int record_segment(struct toolpath *tp, const struct segment *seg)
+{
+	struct segment *new_seg;
+
+	if (tp->count == tp->size) {
+		new_seg = realloc(tp->seg, (tp->size * 2 + 1024) * sizeof(*tp->seg));
+		if (!new_seg)
+			return 0;
+		tp->seg = new_seg;
+		tp->size = tp->size * 2 + 1024;
+	}
+	tp->seg[tp->count++] = *seg;
+	return 1;
 }
 
 /* minimalistic parsing of a gcode file, applying <power> as a power ratio, and
- * zoom to x & y coordinates.
+ * zoom to x & y coordinates. Z is tracked in millimeters and selects the beam
+ * kernel through the focal model. Spindle values go through img->curve when
+ * set. Drawn segments are recorded into img->record when set. If <img> has
+ * no area yet, they are only recorded.
  * The feed time is not taken into account, only the spindle speed. Returns 0
  * on error otherwise the number of lines read.
  */
@@ -443,9 +1214,9 @@ int parse_gcode(struct img *img, FILE *file, double zoom, float power)
 	char *p, *e;
 	double val;
 	int drawing = 0;
-	double spindle;
-	double new_x = 0, new_y = 0;
-	double cur_x = 0, cur_y = 0;
+	double new_x = 0, new_y = 0, new_z = 0;
+	double cur_x = 0, cur_y = 0, cur_z = 0;
+	double feed = 0;
 	int cur_s = 0;
 
 	while (fgets(line, sizeof(line), file) != NULL) {
@@ -475,37 +1246,520 @@ int parse_gcode(struct img *img, FILE *file, double zoom, float power)
 			else if (*p == 'M') {
 				if (val == 3 || val == 4) {
 					drawing = 1;
-					cur_s = 255;
+					cur_s = img->max_s;
 				}
 				else if (val == 5)
 					drawing = 0;
 			}
 			else if (*p == 'X') {
-				new_x = floor(val * zoom + zoom / 16);
+				new_x = val;
 			}
 			else if (*p == 'Y') {
-				new_y = floor(val * zoom + zoom / 16);
+				new_y = val;
+			}
+			else if (*p == 'Z') {
+				new_z = val;
 			}
 			else if (*p == 'S') {
-				cur_s = val;
+				cur_s = img->curve ? trunc(map_power(img->curve, val)) : val;
 			}
 			else if (*p == 'F' && val > 0.0) {
-				// speed in mm/mn. Div 60 for mm/s. Power in Watts = J/s.
-				// pxsz in mm/px, thus P/(F/60) = J/mm. P*pxsz*60/F = J/px.
-				img->pixel_energy = img->beam_power * img->pixel_size * 60.0 / val;
+				feed = val;
 			}
 		}
 
 		if (drawing && (new_x != cur_x || new_y != cur_y)) {
-			draw_vector(img, cur_x, cur_y, new_x, new_y, cur_s / 255.0 * power);
+			struct segment seg = {
+				.x0 = cur_x, .y0 = cur_y, .x1 = new_x, .y1 = new_y,
+				/* a ramp uses the spot at its mid-height */
+				.z = (cur_z + new_z) / 2.0,
+				.feed = feed, .s = cur_s,
+			};
+
+			if (img->record && !record_segment(img->record, &seg))
+				return 0;
+			if (img->area)
+				draw_segment(img, &seg, zoom, power);
 		}
 
 		cur_x = new_x;
 		cur_y = new_y;
+		cur_z = new_z;
+		snapshot_progress(img);
 	}
 	return 1;
 }
 
+/* sort keys used by the index builder's comparison function */
+static const double *index_sort_key;
+
+static int cmp_by_key(const void *a, const void *b)
+{
+	double ka = index_sort_key[*(const uint32_t *)a];
+	double kb = index_sort_key[*(const uint32_t *)b];
+
+	return (ka > kb) - (ka < kb);
+}
+
+/* returns the bounding box of segment <seg> into <box> (x0,y0,x1,y1) */
+static void segment_box(const struct segment *seg, double *box)
+{
+	box[0] = fmin(seg->x0, seg->x1);
+	box[1] = fmin(seg->y0, seg->y1);
+	box[2] = fmax(seg->x0, seg->x1);
+	box[3] = fmax(seg->y0, seg->y1);
+}
+
+/* extends node <n>'s bounding box to cover box <box> */
+static void node_extend(struct index_node *n, const double *box)
+{
+	if (box[0] < n->x0) n->x0 = box[0];
+	if (box[1] < n->y0) n->y0 = box[1];
+	if (box[2] > n->x1) n->x1 = box[2];
+	if (box[3] > n->y1) n->y1 = box[3];
+}
+
+/* returns the number of nodes of the packed R-tree indexing <n> segments:
+ * one node per INDEX_FANOUT entries of each level, up to the root.
+ */
+static size_t index_nodes(size_t n)
+{
+	size_t nnodes, next;
+
+	nnodes = next = (n + INDEX_FANOUT - 1) / INDEX_FANOUT;
+	while (next > 1) {
+		next = (next + INDEX_FANOUT - 1) / INDEX_FANOUT;
+		nnodes += next;
+	}
+	return nnodes;
+}
+
+/* builds a packed R-tree over toolpath <tp> using Sort-Tile-Recursive
+ * ordering and writes it with the segments to <file>. Returns non-zero on
+ * success, 0 on failure.
+ */
+int save_index(const char *file, const struct toolpath *tp)
+{
+	struct index_header hdr;
+	struct index_node *node = NULL;
+	uint32_t *order = NULL;
+	double *key = NULL;
+	size_t n = tp->count, nnodes, level, next, slice, i, j;
+	double box[4];
+	FILE *f;
+	int ret = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.nseg = n;
+	hdr.zmin = hdr.zmax = n ? tp->seg[0].z : 0.0;
+
+	nnodes = index_nodes(n);
+
+	order = malloc((n + 1) * sizeof(*order));
+	key   = malloc((n + 1) * sizeof(*key));
+	node  = calloc(nnodes + 1, sizeof(*node));
+	if (!order || !key || !node)
+		goto out;
+
+	/* sort by X center, then cut into vertical slices of sqrt(leaves)
+	 * leaves each, that are in turn sorted by Y center.
+	 */
+	for (i = 0; i < n; i++) {
+		order[i] = i;
+		key[i] = tp->seg[i].x0 + tp->seg[i].x1;
+		if (tp->seg[i].z < hdr.zmin)
+			hdr.zmin = tp->seg[i].z;
+		if (tp->seg[i].z > hdr.zmax)
+			hdr.zmax = tp->seg[i].z;
+	}
+	index_sort_key = key;
+	qsort(order, n, sizeof(*order), cmp_by_key);
+
+	for (i = 0; i < n; i++)
+		key[i] = tp->seg[i].y0 + tp->seg[i].y1;
+
+	slice = ceil(sqrt((n + INDEX_FANOUT - 1) / INDEX_FANOUT)) * INDEX_FANOUT;
+	for (i = 0; i < n; i += slice)
+		qsort(order + i, (n - i < slice) ? n - i : slice, sizeof(*order), cmp_by_key);
+
+	/* leaves */
+	nnodes = 0;
+	for (i = 0; i < n; i += INDEX_FANOUT) {
+		struct index_node *nd = &node[nnodes++];
+
+		nd->first = i;
+		nd->count = (n - i < INDEX_FANOUT) ? n - i : INDEX_FANOUT;
+		nd->leaf  = 1;
+		segment_box(&tp->seg[order[i]], box);
+		nd->x0 = box[0]; nd->y0 = box[1]; nd->x1 = box[2]; nd->y1 = box[3];
+		for (j = 1; j < nd->count; j++) {
+			segment_box(&tp->seg[order[i + j]], box);
+			node_extend(nd, box);
+		}
+	}
+
+	/* upper levels until a single root remains */
+	level = 0;
+	while (nnodes - level > 1) {
+		next = nnodes;
+		for (i = level; i < next; i += INDEX_FANOUT) {
+			struct index_node *nd = &node[nnodes++];
+
+			nd->first = i;
+			nd->count = (next - i < INDEX_FANOUT) ? next - i : INDEX_FANOUT;
+			nd->leaf  = 0;
+			nd->x0 = node[i].x0; nd->y0 = node[i].y0;
+			nd->x1 = node[i].x1; nd->y1 = node[i].y1;
+			for (j = 1; j < nd->count; j++) {
+				box[0] = node[i + j].x0; box[1] = node[i + j].y0;
+				box[2] = node[i + j].x1; box[3] = node[i + j].y1;
+				node_extend(nd, box);
+			}
+		}
+		level = next;
+	}
+	hdr.nnodes = nnodes;
+
+	f = fopen(file, "w");
+	if (!f)
+		goto out;
+
+	ret = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+	      fwrite(tp->seg, sizeof(*tp->seg), n, f) == n &&
+	      fwrite(order, sizeof(*order), n, f) == n &&
+	      fwrite(node, sizeof(*node), nnodes, f) == nnodes;
+
+	if (fclose(f) != 0)
+		ret = 0;
+ out:
+	free(node);
+	free(key);
+	free(order);
+	return ret;
+}
+
+/* maps index file <file> into <idx>. Returns non-zero on success, 0 on
+ * failure.
+ */
+int load_index(const char *file, struct index *idx)
+{
+	const char *base;
+	struct stat st;
+	uint64_t nseg, nnodes;
+	size_t ofs;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*idx->hdr)) {
+		close(fd);
+		return 0;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return 0;
+
+	idx->size = st.st_size;
+	idx->hdr = (const struct index_header *)base;
+	nseg = idx->hdr->nseg;
+	nnodes = idx->hdr->nnodes;
+
+	/* the counts come from the file: bound them by its size before
+	 * computing any offset, and only accept the tree save_index() builds.
+	 */
+	ofs = sizeof(*idx->hdr);
+	if (memcmp(idx->hdr->magic, INDEX_MAGIC, sizeof(idx->hdr->magic)) != 0 ||
+	    nseg > UINT32_MAX ||
+	    nseg > (idx->size - ofs) / (sizeof(*idx->seg) + sizeof(*idx->order)) ||
+	    nnodes != index_nodes(nseg))
+		goto fail;
+
+	idx->seg = (const struct segment *)(base + ofs);
+	ofs += nseg * sizeof(*idx->seg);
+	idx->order = (const uint32_t *)(base + ofs);
+	ofs += nseg * sizeof(*idx->order);
+	idx->node = (const struct index_node *)(base + ofs);
+	ofs += nnodes * sizeof(*idx->node);
+
+	if (ofs != idx->size)
+		goto fail;
+	return 1;
+ fail:
+	munmap((void *)base, st.st_size);
+	return 0;
+}
+
+static int cmp_uint32(const void *a, const void *b)
+{
+	uint32_t ua = *(const uint32_t *)a;
+	uint32_t ub = *(const uint32_t *)b;
+
+	return (ua > ub) - (ua < ub);
+}
+
+/* appends to <res> the numbers of the segments below node <n> whose bounding
+ * boxes intersect (x0,y0)-(x1,y1), <count> and <size> being the number of
+ * entries used and allocated. Returns 0 on memory allocation error.
+ */
+static int query_node(const struct index *idx, const struct index_node *n,
+                      double x0, double y0, double x1, double y1,
+                      uint32_t **res, size_t *count, size_t *size)
+{
+	uint32_t *new_res;
+	double box[4];
+	int i;
+
+	if (n->x1 < x0 || n->x0 > x1 || n->y1 < y0 || n->y0 > y1)
+		return 1;
+
+	for (i = 0; i < n->count; i++) {
+		if (!n->leaf) {
+			if (!query_node(idx, &idx->node[n->first + i], x0, y0, x1, y1, res, count, size))
+				return 0;
+			continue;
+		}
+
+		segment_box(&idx->seg[idx->order[n->first + i]], box);
+		if (box[2] < x0 || box[0] > x1 || box[3] < y0 || box[1] > y1)
+			continue;
+
+		if (*count == *size) {
+			new_res = realloc(*res, (*size * 2 + 1024) * sizeof(**res));
+			if (!new_res)
+				return 0;
+			*res = new_res;
+			*size = *size * 2 + 1024;
+		}
+		(*res)[(*count)++] = idx->order[n->first + i];
+	}
+	return 1;
+}
+
+/* returns in <res> an allocated array of the numbers of the segments of <idx>
+ * touching the box (x0,y0)-(x1,y1) in mm, sorted in sequence order. Returns
+ * the number of segments found, or -1 on memory allocation error.
+ */
+ssize_t query_index(const struct index *idx, double x0, double y0, double x1, double y1, uint32_t **res)
+{
+	size_t count = 0, size = 0;
+
+	*res = NULL;
+	if (!idx->hdr->nnodes)
+		return 0;
+
+	if (!query_node(idx, &idx->node[idx->hdr->nnodes - 1], x0, y0, x1, y1, res, &count, &size)) {
+		free(*res);
+		return -1;
+	}
+	qsort(*res, count, sizeof(**res), cmp_uint32);
+	return count;
+}
+
+/* draws into <img> the segments of index <idx>, only those possibly affecting
+ * the image if it is fixed, otherwise all of them, in sequence order. Returns
+ * non-zero if OK, 0 on error.
+ */
+int render_index(struct img *img, const struct index *idx, double zoom, float power)
+{
+	uint32_t *res;
+	ssize_t count, i;
+	double reach;
+
+	if (!img->fixed) {
+		for (i = 0; i < (ssize_t)idx->hdr->nseg; i++) {
+			if (!draw_segment(img, &idx->seg[i], zoom, power))
+				return 0;
+			snapshot_progress(img);
+		}
+		return 1;
+	}
+
+	/* the largest spot is at one end of the Z range. Pixel p covers
+	 * [p/zoom - 1/16, (p+1)/zoom - 1/16[ in mm, see draw_segment().
+	 */
+	reach = fmax(spot_pixels(img, idx->hdr->zmin), spot_pixels(img, idx->hdr->zmax));
+	reach = (img->spot_dia > 0.0 ? ceil(0.75 * reach) : 0) + 2;
+
+	count = query_index(idx,
+	                    (img->x0 - reach) / zoom - 1.0 / 16, (img->y0 - reach) / zoom - 1.0 / 16,
+	                    (img->x1 + 1 + reach) / zoom, (img->y1 + 1 + reach) / zoom, &res);
+	if (count < 0)
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		if (!draw_segment(img, &idx->seg[res[i]], zoom, power))
+			break;
+		snapshot_progress(img);
+	}
+
+	free(res);
+	return i == count;
+}
+
+/* returns the gray level of pixel (x,y) of <img>, or 0 if outside */
+static float gray_level(const struct img *img, int x, int y)
+{
+	float v;
+
+	if (x < img->x0 || x > img->x1 || y < img->y0 || y > img->y1)
+		return 0.0;
+
+	v = img->area[(y - img->y0) * (img->x1 - img->x0 + 1) + (x - img->x0)];
+	if (v < 0.0)
+		v = 0.0;
+	else if (v > 1.0)
+		v = 1.0;
+	return v * 255.0;
+}
+
+/* renders toolpath <tp> over the fixed area (x0,y0)-(x1,y1) of <img> using
+ * quality preset <q>, starting from the settings in <model>. Returns the time
+ * spent in seconds.
+ */
+static double timed_render(struct img *img, const struct img *model, const struct quality *q,
+                           const struct toolpath *tp, int x0, int y0, int x1, int y1,
+                           double multiply)
+{
+	struct timespec t0, t1;
+	size_t i;
+
+	*img = *model;
+	apply_quality(img, q);
+	if (!extend_img(img, x0, y0, x1, y1))
+		die(1, "out of memory\n");
+	img->fixed = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < tp->count; i++)
+		if (!draw_segment(img, &tp->seg[i], 1.0 / img->pixel_size, multiply))
+			die(1, "failed to render sample\n");
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+/* renders a SELF_CHECK_SIZE pixels wide square of the gcode from <file> both
+ * in draft and exact qualities, and reports on stderr the time spent in each
+ * and the deviation of draft output from exact, in gray levels. The square is
+ * centered where the beam reaches half of the burnt length, so that it always
+ * covers some work, and cropped to the burnt area. Dies if nothing burns.
+ */
+void self_check(const struct img *model, FILE *file, double multiply)
+{
+	struct toolpath tp;
+	struct img rec, draft, exact;
+	const struct segment *seg;
+	double t_draft, t_exact, len, half, d;
+	double sum2 = 0.0, max = 0.0;
+	double cx = 0.0, cy = 0.0;
+	long count = 0;
+	size_t i;
+	int x0, y0, x1, y1, margin;
+	int ix0, iy0, ix1, iy1; // burnt area in pixels
+	double bx0, by0, bx1, by1; // burnt area in mm
+	int x, y;
+
+	/* without an area, segments are only recorded */
+	memset(&tp, 0, sizeof(tp));
+	rec = *model;
+	rec.area = NULL;
+	rec.record = &tp;
+	if (!parse_gcode(&rec, file, 1.0 / rec.pixel_size, multiply))
+		die(1, "failed to process gcode");
+
+	bx0 = by0 = HUGE_VAL;
+	bx1 = by1 = -HUGE_VAL;
+	for (len = 0.0, i = 0; i < tp.count; i++) {
+		seg = &tp.seg[i];
+		if (seg->s <= 0)
+			continue;
+		len += hypot(seg->x1 - seg->x0, seg->y1 - seg->y0);
+		bx0 = fmin(bx0, fmin(seg->x0, seg->x1));
+		by0 = fmin(by0, fmin(seg->y0, seg->y1));
+		bx1 = fmax(bx1, fmax(seg->x0, seg->x1));
+		by1 = fmax(by1, fmax(seg->y0, seg->y1));
+	}
+
+	/* nothing to compare, and the window below would be meaningless */
+	if (len <= 0.0)
+		die(1, "self-check: no burning move in the input\n");
+
+	for (half = 0.0, i = 0; i < tp.count; i++) {
+		seg = &tp.seg[i];
+		if (seg->s <= 0)
+			continue;
+		d = hypot(seg->x1 - seg->x0, seg->y1 - seg->y0);
+		if (half + d >= len / 2.0) {
+			d = d > 0.0 ? (len / 2.0 - half) / d : 0.0;
+			cx = seg->x0 + (seg->x1 - seg->x0) * d;
+			cy = seg->y0 + (seg->y1 - seg->y0) * d;
+			break;
+		}
+		half += d;
+	}
+
+	/* keep the square within the work, and crop it when the work is
+	 * smaller.
+	 */
+	ix0 = floor(bx0 / model->pixel_size);
+	iy0 = floor(by0 / model->pixel_size);
+	ix1 = floor(bx1 / model->pixel_size);
+	iy1 = floor(by1 / model->pixel_size);
+
+	x0 = floor(cx / model->pixel_size) - SELF_CHECK_SIZE / 2;
+	y0 = floor(cy / model->pixel_size) - SELF_CHECK_SIZE / 2;
+	if (x0 + SELF_CHECK_SIZE - 1 > ix1)
+		x0 = ix1 - (SELF_CHECK_SIZE - 1);
+	if (x0 < ix0)
+		x0 = ix0;
+	if (y0 + SELF_CHECK_SIZE - 1 > iy1)
+		y0 = iy1 - (SELF_CHECK_SIZE - 1);
+	if (y0 < iy0)
+		y0 = iy0;
+	x1 = x0 + SELF_CHECK_SIZE - 1;
+	y1 = y0 + SELF_CHECK_SIZE - 1;
+	if (x1 > ix1)
+		x1 = ix1;
+	if (y1 > iy1)
+		y1 = iy1;
+
+	/* both renders cover the margin of the widest diffusion, like --roi */
+	exact = *model;
+	apply_quality(&exact, find_quality("exact"));
+	margin = 2 * (diffusion_reach(&exact) + 2) + 1;
+
+	t_draft = timed_render(&draft, model, find_quality("draft"), &tp,
+	                       x0 - margin, y0 - margin, x1 + margin, y1 + margin, multiply);
+	t_exact = timed_render(&exact, model, find_quality("exact"), &tp,
+	                       x0 - margin, y0 - margin, x1 + margin, y1 + margin, multiply);
+
+	for (y = y0; y <= y1; y++) {
+		for (x = x0; x <= x1; x++) {
+			d = fabs(gray_level(&draft, x, y) - gray_level(&exact, x, y));
+			sum2 += d * d;
+			if (d > max)
+				max = d;
+			count++;
+		}
+	}
+
+	fprintf(stderr, "sample=(%.1f,%.1f)-(%.1f,%.1f)mm precision=%s draft=%.3fs exact=%.3fs "
+	        "speedup=%.1fx rms=%.3f max=%.3f (gray levels)\n",
+	        x0 * model->pixel_size, y0 * model->pixel_size,
+	        (x1 + 1) * model->pixel_size, (y1 + 1) * model->pixel_size,
+	        sizeof(pix_t) == sizeof(double) ? "double" : "float",
+	        t_draft, t_exact, t_draft > 0.0 ? t_exact / t_draft : 0.0,
+	        count ? sqrt(sum2 / count) : 0.0, max);
+	free(draft.area);
+	free(exact.area);
+	free(tp.seg);
+}
+
 void usage(int code, const char *cmd)
 {
 	die(code,
@@ -517,19 +1771,49 @@ void usage(int code, const char *cmd)
 	    "  -a --absorption <value>      absorption (def: 0.75 for clear wood)\n"
 	    "  -b --beam-power <value>      beam power in Watts (default: 10)\n"
 	    "  -e --energy-density <value>  minimum energy density in J/mm^2 (def: 0.5)\n"
+	    "  -f --focus <z>               Z height of the focal plane in mm (def: 0)\n"
 	    "  -A --absorption_mul <value>  absorption factor once marked (def: 2.0 for wood)\n"
 	    "  -d --diffusion <value>       linear diffusion ratio (def: 0.25)\n"
 	    "  -m --multiply <value>        multiply input value by this (def: 1.0)\n"
 	    "  -o --output <file>           output PNG file name (default: none=stdout)\n"
 	    "  -p --pixel-size <size>       pixel-size in millimeters (default: 0.1)\n"
+	    "  -r --rayleigh <size>         Rayleigh range of the beam in mm (def: 1.0)\n"
+	    "  -s --spot <size>             focused spot diameter in mm (def: 0=1 pixel)\n"
+	    "  -z --z-step <size>           Z resolution of the kernel cache in mm (def: 0.01)\n"
+	    "     --max-s <value>           spindle value for full power (def: 255)\n"
+	    "     --curve <file>            map spindle values through this gcode-fixup\n"
+	    "                               power curve, whose max sets --max-s\n"
+	    "     --quality <preset>        draft, normal or exact (def: normal)\n"
+	    "     --cutoff <value>          stop diffusing energies below this (def: preset)\n"
+	    "     --subpixel <value>        round beam positions to 1/value px (def: preset)\n"
+	    "     --samples <value>         beam samples per pixel (def: preset)\n"
+	    "     --self-check              report draft vs exact deviation on a sample of the input\n"
+	    "     --roi <x0,y0,x1,y1>       only render this region, in mm (def: all)\n"
+	    "     --save-index <file>       save the toolpath's spatial index to <file>\n"
+	    "     --load-index <file>       render from this index instead of stdin\n"
+	    "     --snapshot <file>         write progress snapshots (PNG or PGM) to <file>,\n"
+	    "                               which may contain a %%d counter, on SIGUSR1.\n"
+	    "                               PGM is patched in place, PNG written in full\n"
+	    "     --snapshot-every <n>[s]   also every <n> lines, or <n> seconds with 's'\n"
 	    "\n", cmd);
 }
 
 int main(int argc, char **argv)
 {
+	const struct quality *quality;
 	uint8_t *buffer;
 	const char *file;
 	struct img img;
+	float cutoff = -1.0, subpixel = -1.0, samples = -1.0;
+	double roi[4];
+	int rx0 = 0, ry0 = 0, rx1 = 0, ry1 = 0; // ROI in pixels
+	int use_roi = 0;
+	const char *save_file = NULL, *load_file = NULL;
+	struct toolpath toolpath;
+	struct index index;
+	struct snapshot snap;
+	struct curve curve;
+	int check = 0;
 	float energy_density = DEFAULT_ENERGY_DENSITY;
 	double multiply = 1.0;
 	int w, h;
@@ -537,6 +1821,10 @@ int main(int argc, char **argv)
 	int ret;
 
 	memset(&img, 0, sizeof(img));
+	memset(&snap, 0, sizeof(snap));
+	snap.fd = -1;
+	img.dx0 = img.dy0 = INT_MAX;
+	img.dx1 = img.dy1 = INT_MIN;
 
 	file = NULL;
 	w = DEFAULT_WIDTH;
@@ -546,10 +1834,16 @@ int main(int argc, char **argv)
 	img.absorption = DEFAULT_ABSORPTION;
 	img.absorption_factor = DEFAULT_ABSORPTION_FACTOR;
 	img.beam_power = DEFAULT_BEAM_POWER;
+	img.spot_dia = DEFAULT_SPOT_DIAMETER;
+	img.focus_z = DEFAULT_FOCUS_Z;
+	img.rayleigh = DEFAULT_RAYLEIGH;
+	img.z_step = DEFAULT_Z_STEP;
+	img.max_s = DEFAULT_MAX_S;
+	quality = find_quality(DEFAULT_QUALITY);
 
 	while (1) {
 		int option_index = 0;
-		int c = getopt_long(argc, argv, "ha:A:d:e:m:o:p:P:W:H:", long_options, &option_index);
+		int c = getopt_long(argc, argv, "ha:A:d:e:f:m:o:p:P:r:s:W:H:z:", long_options, &option_index);
 		double arg_f = optarg ? atof(optarg) : 0.0;
 		int arg_i   = optarg ? atoi(optarg) : 0;
 
@@ -576,6 +1870,10 @@ int main(int argc, char **argv)
 			energy_density = arg_f;
 			break;
 
+		case 'f':
+			img.focus_z = arg_f;
+			break;
+
 		case 'h':
 			usage(0, argv[0]);
 			break;
@@ -597,6 +1895,20 @@ int main(int argc, char **argv)
 			img.beam_power = arg_f;
 			break;
 
+		case 'r':
+			if (arg_f > 0.0)
+				img.rayleigh = arg_f;
+			break;
+
+		case 's':
+			img.spot_dia = arg_f;
+			break;
+
+		case 'z':
+			if (arg_f > 0.0)
+				img.z_step = arg_f;
+			break;
+
 		case 'W':
 			w = arg_i;
 			break;
@@ -606,6 +1918,77 @@ int main(int argc, char **argv)
 			break;
 			break;
 
+		case OPT_QUALITY:
+			quality = find_quality(optarg);
+			if (!quality)
+				die(1, "unknown quality '%s'\n", optarg);
+			break;
+
+		case OPT_CUTOFF:
+			cutoff = arg_f;
+			break;
+
+		case OPT_SUBPIXEL:
+			if (arg_f > 0.0)
+				subpixel = arg_f;
+			break;
+
+		case OPT_SAMPLES:
+			if (arg_f > 0.0)
+				samples = arg_f;
+			break;
+
+		case OPT_SELF_CHECK:
+			check = 1;
+			break;
+
+		case OPT_ROI:
+			if (sscanf(optarg, "%lf,%lf,%lf,%lf", &roi[0], &roi[1], &roi[2], &roi[3]) != 4)
+				die(1, "invalid ROI '%s', expecting x0,y0,x1,y1\n", optarg);
+			use_roi = 1;
+			break;
+
+		case OPT_SAVE_INDEX:
+			save_file = optarg;
+			break;
+
+		case OPT_LOAD_INDEX:
+			load_file = optarg;
+			break;
+
+		case OPT_SNAPSHOT:
+			snap.pattern = optarg;
+			snap.numbered = check_pattern(optarg);
+			if (snap.numbered < 0 || snap.numbered > 1)
+				die(1, "snapshot file name may only contain one %%d\n");
+			break;
+
+		case OPT_SNAPSHOT_EVERY: {
+			char *end;
+			double v = strtod(optarg, &end);
+
+			if (v <= 0.0 || (*end && strcmp(end, "s") != 0))
+				die(1, "invalid snapshot period '%s'\n", optarg);
+			if (*end)
+				snap.every_sec = v;
+			else
+				snap.every_lines = v;
+			break;
+		}
+
+		case OPT_MAX_S:
+			if (arg_f < 1.0)
+				die(1, "invalid max spindle value '%s'\n", optarg);
+			img.max_s = arg_f;
+			break;
+
+		case OPT_CURVE:
+			if (!load_curve(&curve, optarg))
+				die(1, "cannot load power curve from '%s'\n", optarg);
+			img.curve = &curve;
+			img.max_s = curve.max;
+			break;
+
 		case ':': /* missing argument */
 		case '?': /* unknown option */
 			die(1, "");
@@ -618,7 +2001,41 @@ int main(int argc, char **argv)
 	/* thus we have diff*(1+4*dia+4*lin) = 1 */
 	printf("dif=%f lin=%f dia=%f\n", img.diffusion, img.diffusion_lin, img.diffusion_dia);
 
-	if (!extend_img(&img, 0, 0, w-1, h-1))
+	if (check) {
+		self_check(&img, stdin, multiply);
+		return 0;
+	}
+
+	apply_quality(&img, quality);
+	if (cutoff >= 0.0)
+		img.cutoff = cutoff;
+	if (subpixel > 0.0)
+		img.subpixel = subpixel;
+	if (samples > 0.0)
+		img.sample_step = 1.0 / samples;
+
+	if (use_roi) {
+		/* Only allocate the ROI plus a margin covering what may diffuse
+		 * into it, as well as what may diffuse into that margin and
+		 * change its absorption. Nothing will be drawn outside.
+		 */
+		int margin = 2 * (diffusion_reach(&img) + 2) + 1;
+
+		rx0 = floor(fmin(roi[0], roi[2]) / img.pixel_size);
+		ry0 = floor(fmin(roi[1], roi[3]) / img.pixel_size);
+		rx1 = floor(fmax(roi[0], roi[2]) / img.pixel_size);
+		ry1 = floor(fmax(roi[1], roi[3]) / img.pixel_size);
+
+		if (!extend_img(&img, rx0 - margin, ry0 - margin, rx1 + margin, ry1 + margin))
+			die(1, "out of memory\n");
+		img.fixed = 1;
+
+		/* snapshots show the same region as the final image */
+		snap.crop = 1;
+		snap.cx0 = rx0; snap.cy0 = ry0;
+		snap.cx1 = rx1; snap.cy1 = ry1;
+	}
+	else if (!extend_img(&img, 0, 0, w-1, h-1))
 		die(1, "out of memory\n");
 
 	/* gradient for experimentation */
@@ -632,8 +2049,38 @@ int main(int argc, char **argv)
 	//draw_vector(&img, 125, 125, 600, 600, 10.0);
 	//draw_vector(&img, 125, 125, 600, 500, 10.0);
 
-	if (!parse_gcode(&img, stdin, 1.0 / img.pixel_size, multiply))
-		die(1, "failed to process gcode");
+	if (snap.pattern) {
+		struct sigaction sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = request_snapshot;
+		sa.sa_flags = SA_RESTART;
+		sigaction(SIGUSR1, &sa, NULL);
+
+		snap.last = now();
+		img.snap = &snap;
+	}
+
+	if (load_file) {
+		if (!load_index(load_file, &index))
+			die(1, "failed to load index '%s'\n", load_file);
+		if (!render_index(&img, &index, 1.0 / img.pixel_size, multiply))
+			die(1, "failed to render index\n");
+	}
+	else {
+		if (save_file) {
+			memset(&toolpath, 0, sizeof(toolpath));
+			img.record = &toolpath;
+		}
+		if (!parse_gcode(&img, stdin, 1.0 / img.pixel_size, multiply))
+			die(1, "failed to process gcode");
+		if (save_file && !save_index(save_file, &toolpath))
+			die(1, "failed to save index '%s'\n", save_file);
+	}
+
+	/* last frame */
+	if (img.snap && !take_snapshot(&img))
+		die(1, "failed to write snapshot\n");
 
 	printf("x0=%d y0=%d x1=%d y1=%d\n", img.x0, img.y0, img.x1, img.y1);
 
@@ -663,7 +2110,15 @@ int main(int argc, char **argv)
 	//crop_gs_image(buffer, w, h, 100, 100, w - 1 - 100, h - 1 - 100);
 	//ret = write_gs_file(file, w-200, h-200, buffer);
 
-	ret = write_gs_file(file, w, h, buffer);
+	if (use_roi) {
+		/* drop the margin */
+		if (!crop_gs_image(buffer, w, h, rx0 - img.x0, ry0 - img.y0, rx1 - img.x0, ry1 - img.y0))
+			die(1, "failed to crop image\n");
+		w = rx1 - rx0 + 1;
+		h = ry1 - ry0 + 1;
+	}
+
+	ret = write_gs_file(file, w, h, w, buffer);
 	if (!ret)
 		die(1, "failed to write file\n");
 	return 0;
@@ -0,0 +1,904 @@
+/* Converts a PNG image into raster G-CODE for laser engravers. Pixels are
+ * turned into spindle values through the same power curve as gcode-fixup,
+ * and rows are emitted in alternate directions, trimmed to their burning
+ * span, with runs of equal pixels merged into single moves. Blank rows are
+ * skipped. The output is as compact as gcode-fixup --compact produces, and
+ * the image is read row by row so that only one row is kept in memory.
+ *
+ * Uses libpng's row by row reading API, any libpng 1.6 works.
+ */
+#include <getopt.h>
+#include <math.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <png.h>
+
+#include "gcode-common.h"
+
+/* default settings, same as gcode-fixup for the power curve */
+#define DEFAULT_POWER            1.0
+#define DEFAULT_GAMMA            1.0
+#define DEFAULT_OFFSET           0.0
+#define DEFAULT_MAX_S            255
+#define DEFAULT_FEED             3000.0  // mm/min while burning
+#define DEFAULT_PIX_SIZE         0.1     // mm
+#define DEFAULT_OVERSCAN         0.0     // mm
+#define DEFAULT_PRECISION        3
+#define MAX_PRECISION            8
+
+/* halftoning: size of the ordered dithering masks (powers of 2), and width
+ * of the gaussian filter used to build the blue noise one.
+ */
+#define BAYER_SIZE               16
+#define BLUE_NOISE_SIZE          64
+#define BLUE_NOISE_SIGMA         1.5
+
+/* the output buffer is flushed once it holds this many bytes */
+#define OUTPUT_BUFFER_SIZE       (1 << 20)
+
+/* long options without a short equivalent */
+enum {
+	OPT_LOAD_CURVE = 256,
+	OPT_OVERSCAN,
+	OPT_PRECISION,
+};
+
+const struct option long_options[] = {
+	{"help",        no_argument,       0, 'h'              },
+	{"power",       required_argument, 0, 'p'              },
+	{"offset",      required_argument, 0, 'o'              },
+	{"gamma",       required_argument, 0, 'g'              },
+	{"feed",        required_argument, 0, 'f'              },
+	{"pixel-size",  required_argument, 0, 'r'              },
+	{"xoff",        required_argument, 0, 'X'              },
+	{"yoff",        required_argument, 0, 'Y'              },
+	{"max-s",       required_argument, 0, 'm'              },
+	{"load-curve",  required_argument, 0, OPT_LOAD_CURVE   },
+	{"overscan",    required_argument, 0, OPT_OVERSCAN     },
+	{"precision",   required_argument, 0, OPT_PRECISION    },
+	{"dither",      required_argument, 0, 'd'              },
+	{"verbose",     no_argument,       0, 'v'              },
+	{0,             0,                 0, 0                }
+};
+
+/* halftoning methods */
+enum {
+	DITHER_NONE = 0,
+	DITHER_FS,
+	DITHER_JJN,
+	DITHER_STUCKI,
+	DITHER_BAYER,
+	DITHER_BLUE_NOISE,
+};
+
+static const char *const dither_names[] = {
+	[DITHER_NONE]       = "none",
+	[DITHER_FS]         = "floyd-steinberg",
+	[DITHER_JJN]        = "jjn",
+	[DITHER_STUCKI]     = "stucki",
+	[DITHER_BAYER]      = "bayer",
+	[DITHER_BLUE_NOISE] = "blue-noise",
+};
+
+/* error diffusion kernel: weights of the next 2 pixels on the row in the
+ * scanning direction, and of the 5 pixels centered under the current one on
+ * the next 2 rows, all divided by <div>.
+ */
+struct kernel {
+	int next[2];
+	int below[2][5];
+	int div;
+};
+
+static const struct kernel kernels[] = {
+	[DITHER_FS]     = { { 7, 0 }, { { 0, 3, 5, 1, 0 }, { 0, 0, 0, 0, 0 } }, 16 },
+	[DITHER_JJN]    = { { 7, 5 }, { { 3, 5, 7, 5, 3 }, { 1, 3, 5, 3, 1 } }, 48 },
+	[DITHER_STUCKI] = { { 8, 4 }, { { 2, 4, 8, 4, 2 }, { 1, 2, 4, 2, 1 } }, 42 },
+};
+
+/* halftoning state. Pixels are either off or burnt at spindle value <on>.
+ * Error diffusion keeps the errors of the current and next 2 rows, with 2
+ * pixels of margin on each side, and values carry 4 fractional bits. The
+ * ordered methods compare pixels to a <mask_size> wide square threshold mask.
+ */
+struct halftone {
+	int method;
+	uint32_t on;
+	long w;
+	int32_t *err[3];
+	int32_t recip;            // 2^24 / kernel divisor
+	uint32_t *mask;
+	int mask_size;
+	unsigned long long pixels, burnt;
+	double time;              // time spent halftoning, in seconds
+};
+
+/* G-CODE generator. Positions are integer numbers of units at the output
+ * precision so that relative moves never accumulate rounding errors.
+ */
+struct gen {
+	/* settings */
+	double pix_size;          // mm per pixel
+	double xoff, yoff;        // position of the image's bottom left corner
+	double feed;              // burning feed rate in mm/min
+	long long overscan;       // laser-off extension on each end, in units
+	int precision;            // decimals of coordinates
+	double units;             // 10^precision
+
+	/* modal state */
+	long long x, y;           // current position, in units
+	int known;                // non-zero once the position is known
+	int g;                    // current motion mode, -1 if unknown
+	int rel;                  // non-zero in G91 mode
+	uint32_t s;               // current spindle value
+	int f_sent;               // non-zero once F was sent
+
+	/* output */
+	char *out;
+	size_t out_len;
+	int dir;                  // direction of the next row, 1 or -1
+
+	/* statistics */
+	unsigned long rows, blank, moves;
+	unsigned long long bytes;
+	double burn_len, travel_len; // in mm
+};
+
+/* returns the time in seconds from an arbitrary origin */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* fills <lut> with the spindle value of each of the 256 darkness levels: the
+ * level is scaled to the curve's input range, mapped and truncated like
+ * gcode-fixup does, and clamped to the valid range. White is never burnt,
+ * even with an offset.
+ */
+static void build_lut(uint32_t *lut, const struct curve *c)
+{
+	double v;
+	int d;
+
+	lut[0] = 0;
+	for (d = 1; d < 256; d++) {
+		v = trunc(map_power(c, d * (double)c->max / 255.0));
+		lut[d] = v < 0 ? 0 : v > c->max ? c->max : v;
+	}
+}
+
+/* appends a decimal integer at <o>, returns the new end */
+static char *fmt_uint(char *o, unsigned long v)
+{
+	return fmt_units(o, v, 0);
+}
+
+/* writes the output buffer to stdout */
+static void flush_output(struct gen *gen)
+{
+	if (gen->out_len && fwrite(gen->out, 1, gen->out_len, stdout) != gen->out_len)
+		die(1, "write error\n");
+	gen->bytes += gen->out_len;
+	gen->out_len = 0;
+}
+
+/* appends string <str> to the output */
+static void put_str(struct gen *gen, const char *str)
+{
+	size_t len = strlen(str);
+
+	memcpy(gen->out + gen->out_len, str, len);
+	gen->out_len += len;
+	if (gen->out_len >= OUTPUT_BUFFER_SIZE)
+		flush_output(gen);
+}
+
+/* emits a move in mode <g> to (<x>,<y>) units with spindle value <s>, the
+ * latter being ignored for rapids. Coordinates are sent as absolute or
+ * relative values, whichever is shorter including the G90/G91 switch.
+ */
+static void emit_move(struct gen *gen, int g, long long x, long long y, uint32_t s)
+{
+	char *o = gen->out + gen->out_len;
+	char ax[24], rx[24], ay[24], ry[24];
+	int axl = 0, rxl = 0, ayl = 0, ryl = 0, rel;
+	int chx = !gen->known || x != gen->x;
+	int chy = !gen->known || y != gen->y;
+
+	if (!chx && !chy)
+		return;
+
+	/* both forms are formatted once, then the shortest is copied */
+	if (chx) {
+		axl = fmt_units(ax, x, gen->precision) - ax;
+		rxl = fmt_units(rx, x - gen->x, gen->precision) - rx;
+	}
+	if (chy) {
+		ayl = fmt_units(ay, y, gen->precision) - ay;
+		ryl = fmt_units(ry, y - gen->y, gen->precision) - ry;
+	}
+
+	rel = gen->known && rxl + ryl + (gen->rel ? 0 : 3) < axl + ayl + (gen->rel ? 3 : 0);
+	if (rel != gen->rel) {
+		memcpy(o, rel ? "G91" : "G90", 3);
+		o += 3;
+		gen->rel = rel;
+	}
+
+	if (g != gen->g) {
+		*o++ = 'G';
+		*o++ = '0' + g;
+		gen->g = g;
+	}
+
+	if (chx) {
+		*o++ = 'X';
+		memcpy(o, rel ? rx : ax, rel ? rxl : axl);
+		o += rel ? rxl : axl;
+	}
+	if (chy) {
+		*o++ = 'Y';
+		memcpy(o, rel ? ry : ay, rel ? ryl : ayl);
+		o += rel ? ryl : ayl;
+	}
+
+	if (g) {
+		if (s != gen->s) {
+			*o++ = 'S';
+			o = fmt_uint(o, s);
+			gen->s = s;
+		}
+		if (!gen->f_sent) {
+			*o++ = 'F';
+			o = fmt_units(o, llround(gen->feed * gen->units), gen->precision);
+			gen->f_sent = 1;
+		}
+	}
+	*o++ = '\n';
+
+	if (gen->known) {
+		double len = hypot(x - gen->x, y - gen->y) / gen->units;
+
+		if (g)
+			gen->burn_len += len;
+		else
+			gen->travel_len += len;
+	}
+	gen->x = x;
+	gen->y = y;
+	gen->known = 1;
+	gen->moves++;
+	gen->out_len = o - gen->out;
+	if (gen->out_len >= OUTPUT_BUFFER_SIZE)
+		flush_output(gen);
+}
+
+/* returns the X position of the left edge of pixel <i>, in units */
+static inline long long pix_x(const struct gen *gen, long i)
+{
+	return llround((gen->xoff + i * gen->pix_size) * gen->units);
+}
+
+/* emits row <s> of <w> spindle values at height <y> units, trimmed to its
+ * burning span and extended by the overscan with the laser off, in the row's
+ * direction which then alternates. Equal neighbours are merged into single
+ * moves. Blank rows are skipped and keep the direction.
+ */
+static void emit_row(struct gen *gen, const uint32_t *s, long w, long long y)
+{
+	long first, last, i, j;
+	int dir = gen->dir;
+
+	for (first = 0; first < w && !s[first]; first++)
+		;
+	if (first == w) {
+		gen->blank++;
+		return;
+	}
+	for (last = w - 1; !s[last]; last--)
+		;
+	gen->rows++;
+
+	if (dir > 0) {
+		emit_move(gen, 0, pix_x(gen, first) - gen->overscan, y, 0);
+		if (gen->overscan)
+			emit_move(gen, 1, pix_x(gen, first), y, 0);
+		for (i = first; i <= last; i = j) {
+			for (j = i + 1; j <= last && s[j] == s[i]; j++)
+				;
+			emit_move(gen, 1, pix_x(gen, j), y, s[i]);
+		}
+		if (gen->overscan)
+			emit_move(gen, 1, pix_x(gen, last + 1) + gen->overscan, y, 0);
+	}
+	else {
+		emit_move(gen, 0, pix_x(gen, last + 1) + gen->overscan, y, 0);
+		if (gen->overscan)
+			emit_move(gen, 1, pix_x(gen, last + 1), y, 0);
+		for (i = last; i >= first; i = j) {
+			for (j = i - 1; j >= first && s[j] == s[i]; j--)
+				;
+			emit_move(gen, 1, pix_x(gen, j + 1), y, s[i]);
+		}
+		if (gen->overscan)
+			emit_move(gen, 1, pix_x(gen, first) - gen->overscan, y, 0);
+	}
+	gen->dir = -dir;
+}
+
+/* builds the <n>x<n> Bayer matrix into <m>, each quadrant of a level being
+ * the previous level times 4 plus 0, 2, 3 or 1.
+ */
+static void build_bayer(uint32_t *m, int n)
+{
+	int size, x, y;
+	uint32_t v;
+
+	m[0] = 0;
+	for (size = 1; size < n; size *= 2) {
+		for (y = 0; y < size; y++) {
+			for (x = 0; x < size; x++) {
+				v = m[y * n + x] * 4;
+				m[y * n + x] = v;
+				m[y * n + x + size] = v + 2;
+				m[(y + size) * n + x] = v + 3;
+				m[(y + size) * n + x + size] = v + 1;
+			}
+		}
+	}
+}
+
+/* adds (<sign>=1) or removes (-1) a dot at <p> in the <n>x<n> pattern <bits>
+ * whose energy is <e>, the energy being the sum of the gaussian <g> of the
+ * toroidal distance to each dot.
+ */
+static void vac_set(char *bits, double *e, const double *g, int n, int p, int sign)
+{
+	int px = p % n, py = p / n, x, y;
+
+	bits[p] = sign > 0;
+	for (y = 0; y < n; y++) {
+		const double *gy = g + ((y - py) & (n - 1)) * n;
+		double *ey = e + y * n;
+
+		for (x = 0; x < n; x++)
+			ey[x] += sign * gy[(x - px) & (n - 1)];
+	}
+}
+
+/* returns the dot of the tightest cluster (<want>=1, highest energy among
+ * dots) or the largest void (<want>=0, lowest energy among empty places).
+ */
+static int vac_find(const char *bits, const double *e, int count, int want)
+{
+	int i, best = -1;
+
+	for (i = 0; i < count; i++) {
+		if (bits[i] != want)
+			continue;
+		if (best < 0 || (want ? e[i] > e[best] : e[i] < e[best]))
+			best = i;
+	}
+	return best;
+}
+
+/* builds the <n>x<n> blue noise rank matrix into <m> using Ulichney's void
+ * and cluster method: an initial random pattern is made homogeneous by
+ * moving dots from the tightest clusters to the largest voids, then dots are
+ * ranked by removing the tightest clusters down to zero, and filling the
+ * largest voids up to the full matrix. <n> must be a power of 2. Returns
+ * non-zero on success, 0 on allocation error.
+ */
+static int build_blue_noise(uint32_t *m, int n)
+{
+	int count = n * n, ones = count / 10, i, k, c, v, ret = 0;
+	double *g = malloc(count * sizeof(*g));
+	double *e = calloc(count, sizeof(*e)), *e0 = malloc(count * sizeof(*e0));
+	char *bits = calloc(count, 1), *bits0 = malloc(count);
+	uint32_t rnd = 2463534242u;
+
+	if (!g || !e || !e0 || !bits || !bits0)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		int dx = i % n, dy = i / n;
+
+		dx = dx > n / 2 ? n - dx : dx;
+		dy = dy > n / 2 ? n - dy : dy;
+		g[i] = exp(-(dx * dx + dy * dy) / (2 * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+	}
+
+	for (k = 0; k < ones; ) {
+		rnd ^= rnd << 13;
+		rnd ^= rnd >> 17;
+		rnd ^= rnd << 5;
+		i = rnd % count;
+		if (!bits[i]) {
+			vac_set(bits, e, g, n, i, 1);
+			k++;
+		}
+	}
+
+	for (k = 0; k < count; k++) {
+		c = vac_find(bits, e, count, 1);
+		vac_set(bits, e, g, n, c, -1);
+		v = vac_find(bits, e, count, 0);
+		vac_set(bits, e, g, n, v, 1);
+		if (v == c)
+			break;
+	}
+
+	memcpy(bits0, bits, count);
+	memcpy(e0, e, count * sizeof(*e));
+	for (k = ones - 1; k >= 0; k--) {
+		c = vac_find(bits, e, count, 1);
+		vac_set(bits, e, g, n, c, -1);
+		m[c] = k;
+	}
+
+	memcpy(bits, bits0, count);
+	memcpy(e, e0, count * sizeof(*e));
+	for (k = ones; k < count; k++) {
+		v = vac_find(bits, e, count, 0);
+		vac_set(bits, e, g, n, v, 1);
+		m[v] = k;
+	}
+
+	ret = 1;
+ out:
+	free(g);
+	free(e);
+	free(e0);
+	free(bits);
+	free(bits0);
+	return ret;
+}
+
+/* prepares halftoning state <ht> for rows of <w> pixels. Ranks of ordered
+ * masks are turned into thresholds in spindle values. Returns non-zero on
+ * success, 0 on allocation error.
+ */
+static int init_halftone(struct halftone *ht, long w)
+{
+	int i, count;
+
+	ht->w = w;
+	if (ht->method == DITHER_BAYER || ht->method == DITHER_BLUE_NOISE) {
+		ht->mask_size = ht->method == DITHER_BAYER ? BAYER_SIZE : BLUE_NOISE_SIZE;
+		count = ht->mask_size * ht->mask_size;
+		ht->mask = malloc(count * sizeof(*ht->mask));
+		if (!ht->mask)
+			return 0;
+		if (ht->method == DITHER_BAYER)
+			build_bayer(ht->mask, ht->mask_size);
+		else if (!build_blue_noise(ht->mask, ht->mask_size))
+			return 0;
+		for (i = 0; i < count; i++)
+			ht->mask[i] = (2 * (uint64_t)ht->mask[i] + 1) * ht->on / (2 * count);
+		return 1;
+	}
+
+	ht->recip = (1 << 24) / kernels[ht->method].div;
+	for (i = 0; i < 3; i++) {
+		ht->err[i] = calloc(w + 4, sizeof(*ht->err[i]));
+		if (!ht->err[i])
+			return 0;
+	}
+	return 1;
+}
+
+/* halftones row <s> of spindle values by error diffusion with kernel <k>,
+ * scanning it in direction <dir>. It is always inlined with constant
+ * arguments so that the weights become immediate values and null ones
+ * vanish.
+ */
+static inline __attribute__((always_inline))
+void diffuse(struct halftone *ht, uint32_t *s, const struct kernel *k, int dir)
+{
+	int32_t *e0 = ht->err[0] + 2, *e1 = ht->err[1] + 2, *e2 = ht->err[2] + 2;
+	const int32_t on = ht->on << 4, half = ht->on << 3;
+	long x = dir > 0 ? 0 : ht->w - 1, end = dir > 0 ? ht->w : -1;
+	const int64_t r = ht->recip, r0 = r * k->next[0], r1 = r * k->next[1];
+	int64_t n1 = 0, n2 = 0;   // errors for the next 2 pixels, times 2^24
+	int32_t a0 = 0, a1 = 0, a2 = 0, a3 = 0; // for x-2..x+1 on the next row
+	int32_t b0 = 0, b1 = 0, b2 = 0, b3 = 0; // same on the row after
+	const int *w1 = k->below[0], *w2 = k->below[1];
+	int32_t v, err, burn, *t;
+
+	/* Errors going to the next pixels are kept in registers, and each
+	 * position of the next rows is only written once all 5 pixels above
+	 * it contributed, which keeps memory accesses off the dependency
+	 * chain between consecutive pixels.
+	 */
+	for (; x != end; x += dir) {
+		v = ((int32_t)s[x] << 4) + (int32_t)((e0[x] * r + n1) >> 24);
+		/* branchless, the outcome being as random as the dots */
+		burn = -(int32_t)(v >= half);
+		s[x] = burn & ht->on;
+		err = v - (burn & on);
+		n1 = n2 + err * r0;
+		n2 = err * r1;
+		e1[x - 2 * dir] += a0 + err * w1[0];
+		e2[x - 2 * dir] += b0 + err * w2[0];
+		a0 = a1 + err * w1[1];
+		a1 = a2 + err * w1[2];
+		a2 = a3 + err * w1[3];
+		a3 = err * w1[4];
+		b0 = b1 + err * w2[1];
+		b1 = b2 + err * w2[2];
+		b2 = b3 + err * w2[3];
+		b3 = err * w2[4];
+	}
+
+	/* x is now past the end */
+	e1[x - 2 * dir] += a0;
+	e1[x - dir] += a1;
+	e1[x] += a2;
+	e1[x + dir] += a3;
+	e2[x - 2 * dir] += b0;
+	e2[x - dir] += b1;
+	e2[x] += b2;
+	e2[x + dir] += b3;
+
+	t = ht->err[0];
+	memset(t, 0, (ht->w + 4) * sizeof(*t));
+	ht->err[0] = ht->err[1];
+	ht->err[1] = ht->err[2];
+	ht->err[2] = t;
+}
+
+/* halftones row <s> of spindle values by error diffusion, scanning it in
+ * direction <dir> so that the errors follow the head in serpentine order.
+ */
+static void diffuse_row(struct halftone *ht, uint32_t *s, int dir)
+{
+	switch (ht->method) {
+	case DITHER_FS:
+		if (dir > 0)
+			diffuse(ht, s, &kernels[DITHER_FS], 1);
+		else
+			diffuse(ht, s, &kernels[DITHER_FS], -1);
+		break;
+	case DITHER_JJN:
+		if (dir > 0)
+			diffuse(ht, s, &kernels[DITHER_JJN], 1);
+		else
+			diffuse(ht, s, &kernels[DITHER_JJN], -1);
+		break;
+	case DITHER_STUCKI:
+		if (dir > 0)
+			diffuse(ht, s, &kernels[DITHER_STUCKI], 1);
+		else
+			diffuse(ht, s, &kernels[DITHER_STUCKI], -1);
+		break;
+	}
+}
+
+/* halftones row <y> of spindle values <s> against the ordered mask. Each
+ * mask-wide block is a plain compare and select which compilers vectorize.
+ */
+static void threshold_row(struct halftone *ht, uint32_t *s, unsigned long y)
+{
+	const int n = ht->mask_size;
+	const uint32_t *t = ht->mask + (y & (n - 1)) * n;
+	const uint32_t on = ht->on;
+	long x, i, len;
+
+	for (x = 0; x < ht->w; x += n) {
+		uint32_t *b = s + x;
+
+		len = ht->w - x < n ? ht->w - x : n;
+		for (i = 0; i < len; i++)
+			b[i] = b[i] > t[i] ? on : 0;
+	}
+}
+
+/* halftones row <y> of spindle values <s> which will be burnt in direction
+ * <dir>, turning it into off and <on> pixels.
+ */
+static void halftone_row(struct halftone *ht, uint32_t *s, unsigned long y, int dir)
+{
+	double start = now();
+	long x;
+
+	if (ht->mask)
+		threshold_row(ht, s, y);
+	else
+		diffuse_row(ht, s, dir);
+
+	ht->pixels += ht->w;
+	for (x = 0; x < ht->w; x++)
+		ht->burnt += s[x] != 0;
+	ht->time += now() - start;
+}
+
+/* libpng error handler, returns to the setjmp() point */
+static void png_error_fn(png_structp png, png_const_charp msg)
+{
+	fprintf(stderr, "png error: %s\n", msg);
+	png_longjmp(png, 1);
+}
+
+static void png_warning_fn(png_structp png, png_const_charp msg)
+{
+	(void)png;
+	(void)msg;
+}
+
+/* converts PNG image <in> into G-CODE. The image is read one row at a time,
+ * converted to 8-bit gray, plus alpha if it has transparency, and the
+ * darkness of each pixel composited on white is mapped through <lut>, then
+ * halftoned by <ht> if not NULL. The top row is at the highest Y. Returns
+ * non-zero on success, 0 on error.
+ */
+static int convert(struct gen *gen, FILE *in, const uint32_t *lut, struct halftone *ht,
+                   png_uint_32 *pw, png_uint_32 *ph)
+{
+	png_structp png;
+	png_infop info;
+	png_uint_32 w, h, x, y;
+	int bit_depth, color_type, interlace, alpha;
+	uint8_t *volatile row = NULL;
+	uint32_t *volatile s = NULL;
+	volatile int ret = 0;
+
+	png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, png_error_fn, png_warning_fn);
+	if (!png)
+		return 0;
+	info = png_create_info_struct(png);
+	if (!info)
+		goto out;
+
+	if (setjmp(png_jmpbuf(png)))
+		goto out;
+
+	png_init_io(png, in);
+	png_read_info(png, info);
+	png_get_IHDR(png, info, &w, &h, &bit_depth, &color_type, &interlace, NULL, NULL);
+
+	if (interlace != PNG_INTERLACE_NONE) {
+		fprintf(stderr, "interlaced images are not supported\n");
+		goto out;
+	}
+
+	png_set_expand(png);
+	png_set_strip_16(png);
+	if (color_type & PNG_COLOR_MASK_COLOR)
+		png_set_rgb_to_gray_fixed(png, 1, -1, -1);
+	alpha = (color_type & PNG_COLOR_MASK_ALPHA) || png_get_valid(png, info, PNG_INFO_tRNS);
+	png_read_update_info(png, info);
+
+	if (png_get_rowbytes(png, info) != (alpha ? 2 : 1) * (size_t)w) {
+		fprintf(stderr, "unsupported pixel format\n");
+		goto out;
+	}
+
+	row = malloc(2 * (size_t)w);
+	s = malloc(w * sizeof(*s));
+	if (!row || !s || (ht && !init_halftone(ht, w))) {
+		fprintf(stderr, "out of memory\n");
+		goto out;
+	}
+
+	*pw = w;
+	*ph = h;
+	for (y = 0; y < h; y++) {
+		png_read_row(png, row, NULL);
+		if (alpha) {
+			for (x = 0; x < w; x++) {
+				unsigned int a = row[2 * x + 1], d = 255 - row[2 * x];
+
+				s[x] = lut[(d * a + 127) / 255];
+			}
+		}
+		else {
+			for (x = 0; x < w; x++)
+				s[x] = lut[255 - row[x]];
+		}
+		if (ht)
+			halftone_row(ht, s, y, gen->dir);
+		emit_row(gen, s, w, llround((gen->yoff + (h - 1 - y) * gen->pix_size) * gen->units));
+	}
+	png_read_end(png, NULL);
+	ret = 1;
+ out:
+	png_destroy_read_struct(&png, info ? &info : NULL, NULL);
+	free(row);
+	free(s);
+	return ret;
+}
+
+void usage(int code, const char *cmd)
+{
+	die(code,
+	    "Usage: %s [args*] [image.png] > file.gcode\n"
+	    "Converts the image, or stdin, into raster G-CODE. Dark pixels burn.\n"
+	    "Arguments:\n"
+	    "  -h | --help             display this help message\n"
+	    "  -p | --power <ratio>    set this power ratio (def: %g)\n"
+	    "  -o | --offset <ofs>     add this offset to output power (def: %g)\n"
+	    "  -g | --gamma <ratio>    adjust the signal gamma (def: %g)\n"
+	    "  -m | --max-s <value>    max spindle value, GRBL's $30 (def: %d)\n"
+	    "     --load-curve <file>  map pixels using this gcode-fixup curve instead\n"
+	    "                          of -p/-o/-g\n"
+	    "  -f | --feed <rate>      burning feed rate in mm/min (def: %g)\n"
+	    "  -r | --pixel-size <mm>  size of a pixel (def: %g)\n"
+	    "  -X | --xoff <offset>    X of the image's left edge (def: 0.0)\n"
+	    "  -Y | --yoff <offset>    Y of the image's bottom edge (def: 0.0)\n"
+	    "     --overscan <mm>      extend rows by this length on each end with the\n"
+	    "                          laser off (def: %g)\n"
+	    "     --precision <digits> decimals of coordinates (def: %d)\n"
+	    "  -d | --dither <method>  halftone pixels to off or max power with method\n"
+	    "                          none, floyd-steinberg, jjn, stucki, bayer or\n"
+	    "                          blue-noise (def: none)\n"
+	    "  -v | --verbose          report statistics on stderr\n"
+	    "\n", cmd, DEFAULT_POWER, DEFAULT_OFFSET, DEFAULT_GAMMA, DEFAULT_MAX_S,
+	    DEFAULT_FEED, DEFAULT_PIX_SIZE, DEFAULT_OVERSCAN, DEFAULT_PRECISION);
+}
+
+int main(int argc, char **argv)
+{
+	double power = DEFAULT_POWER, gamma = DEFAULT_GAMMA, offset = DEFAULT_OFFSET;
+	double overscan = DEFAULT_OVERSCAN;
+	const char *load_file = NULL;
+	int max_s = DEFAULT_MAX_S;
+	png_uint_32 w = 0, h = 0;
+	uint32_t lut[256];
+	struct curve curve;
+	struct halftone ht;
+	struct gen gen;
+	int verbose = 0;
+	double start;
+	FILE *in = stdin;
+
+	memset(&gen, 0, sizeof(gen));
+	memset(&ht, 0, sizeof(ht));
+	gen.feed = DEFAULT_FEED;
+	gen.pix_size = DEFAULT_PIX_SIZE;
+	gen.precision = DEFAULT_PRECISION;
+
+	while (1) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "hp:o:g:m:f:r:X:Y:d:v", long_options, &option_index);
+		double arg_f = optarg ? atof(optarg) : 0.0;
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			usage(0, argv[0]);
+			break;
+
+		case 'p':
+			power = arg_f;
+			break;
+
+		case 'o':
+			offset = arg_f;
+			break;
+
+		case 'g':
+			gamma = arg_f;
+			if (gamma <= 0)
+				die(1, "gamma must be positive\n");
+			break;
+
+		case 'm':
+			max_s = arg_f;
+			if (max_s < 1 || max_s > MAX_CURVE_SIZE)
+				die(1, "max spindle value must be within 1..%d\n", MAX_CURVE_SIZE);
+			break;
+
+		case OPT_LOAD_CURVE:
+			load_file = optarg;
+			break;
+
+		case 'f':
+			gen.feed = arg_f;
+			if (gen.feed <= 0)
+				die(1, "feed rate must be positive\n");
+			break;
+
+		case 'r':
+			gen.pix_size = arg_f;
+			if (gen.pix_size <= 0)
+				die(1, "pixel size must be positive\n");
+			break;
+
+		case 'X':
+			gen.xoff = arg_f;
+			break;
+
+		case 'Y':
+			gen.yoff = arg_f;
+			break;
+
+		case OPT_OVERSCAN:
+			overscan = arg_f;
+			if (overscan < 0)
+				die(1, "overscan must not be negative\n");
+			break;
+
+		case OPT_PRECISION:
+			gen.precision = atoi(optarg);
+			if (gen.precision < 0 || gen.precision > MAX_PRECISION)
+				die(1, "precision must be within 0..%d\n", MAX_PRECISION);
+			break;
+
+		case 'd':
+			for (ht.method = DITHER_BLUE_NOISE; ht.method > DITHER_NONE; ht.method--)
+				if (strcmp(optarg, dither_names[ht.method]) == 0)
+					break;
+			if (ht.method == DITHER_NONE && strcmp(optarg, dither_names[DITHER_NONE]) != 0)
+				die(1, "unknown dithering method '%s'\n", optarg);
+			break;
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		case ':': /* missing argument */
+		case '?': /* unknown option */
+			usage(1, argv[0]);
+		}
+	}
+
+	if (load_file) {
+		if (!load_curve(&curve, load_file))
+			die(1, "cannot load power curve from '%s'\n", load_file);
+	}
+	else if (!build_curve(&curve, max_s, gamma, power, offset))
+		die(1, "out of memory\n");
+	build_lut(lut, &curve);
+	ht.on = curve.max;
+
+	if (optind < argc) {
+		in = fopen(argv[optind], "rb");
+		if (!in)
+			die(2, "cannot open file '%s'\n", argv[optind]);
+	}
+
+	gen.units = pow(10, gen.precision);
+	gen.overscan = llround(overscan * gen.units);
+	gen.g = -1;
+	gen.dir = 1;
+	gen.out = malloc(OUTPUT_BUFFER_SIZE + 256);
+	if (!gen.out)
+		die(1, "out of memory\n");
+
+	start = now();
+	put_str(&gen, "G21\nG90\nM4S0\n");
+	if (!convert(&gen, in, lut, ht.method ? &ht : NULL, &w, &h))
+		die(1, "cannot convert '%s'\n", optind < argc ? argv[optind] : "stdin");
+	if (gen.rel)
+		put_str(&gen, "G90");
+	put_str(&gen, "M5\nG0X0Y0\n");
+	flush_output(&gen);
+	if (fflush(stdout) != 0)
+		die(1, "write error\n");
+
+	if (verbose) {
+		fprintf(stderr, "image: %lu x %lu pixels, %lu rows burnt, %lu blank\n",
+		        (unsigned long)w, (unsigned long)h, gen.rows, gen.blank);
+		fprintf(stderr, "output: %lu moves, %llu bytes, %.1f bytes/line\n",
+		        gen.moves, gen.bytes, gen.moves ? (double)gen.bytes / gen.moves : 0.0);
+		fprintf(stderr, "job: %.0f mm burning in %.1fs at F%g, %.0f mm travels\n",
+		        gen.burn_len, gen.burn_len * 60.0 / gen.feed, gen.feed, gen.travel_len);
+		if (ht.method)
+			fprintf(stderr, "halftone: %s, %.1f%% of pixels burnt, %.1f Mpixels/s\n",
+			        dither_names[ht.method], ht.pixels ? 100.0 * ht.burnt / ht.pixels : 0.0,
+			        ht.time > 0 ? ht.pixels / 1e6 / ht.time : 0.0);
+		fprintf(stderr, "converted in %.2fs, %.1f Mpixels/s\n", now() - start,
+		        (double)w * h / 1e6 / (now() - start));
+	}
+	return 0;
+}